@@ -0,0 +1,20 @@
+/*
+
+One file of the synthetic corpus for the `jobserver`
+benchmark. The template does a fair amount of work, so
+that the time is spent running templates rather than
+starting processes.
+
+FIDDLE TEMPLATE:
+%local names = {}
+%for i = 1, 2000 do
+%    names[i] = string.format("entry_%04d", (i * 7919) % 2000)
+%end
+%table.sort(names)
+%for i, name in ipairs(names) do
+%    if i % 100 == 0 then
+static int const ${name} = ${i};
+%    end
+%end
+FIDDLE OUTPUT: */
+/* FIDDLE END */
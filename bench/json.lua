@@ -0,0 +1,88 @@
+-- A small JSON decoder in plain Lua, in the style of the
+-- libraries templates used before `fiddle.load_json`. The
+-- `json` benchmark compares the two.
+
+local json = {}
+
+local escapes = {
+	['"'] = '"', ["\\"] = "\\", ["/"] = "/",
+	b = "\b", f = "\f", n = "\n", r = "\r", t = "\t",
+}
+
+local parseValue
+
+local function skip(text, pos)
+	return text:find("[^ \t\r\n]", pos) or #text + 1
+end
+
+local function parseString(text, pos)
+	local parts = {}
+	local start = pos + 1
+	while true do
+		local stop = text:find('["\\]', start)
+		if not stop then error("unterminated string") end
+		parts[#parts + 1] = text:sub(start, stop - 1)
+		if text:sub(stop, stop) == '"' then
+			return table.concat(parts), stop + 1
+		end
+		local c = text:sub(stop + 1, stop + 1)
+		if c == "u" then
+			parts[#parts + 1] = utf8.char(tonumber(text:sub(stop + 2, stop + 5), 16))
+			start = stop + 6
+		else
+			parts[#parts + 1] = escapes[c] or error("invalid escape")
+			start = stop + 2
+		end
+	end
+end
+
+function parseValue(text, pos)
+	pos = skip(text, pos)
+	local c = text:sub(pos, pos)
+	if c == "{" then
+		local result = {}
+		pos = skip(text, pos + 1)
+		if text:sub(pos, pos) == "}" then return result, pos + 1 end
+		while true do
+			local key
+			key, pos = parseString(text, skip(text, pos))
+			pos = skip(text, pos)
+			if text:sub(pos, pos) ~= ":" then error("expected ':'") end
+			result[key], pos = parseValue(text, pos + 1)
+			pos = skip(text, pos)
+			c = text:sub(pos, pos)
+			if c == "}" then return result, pos + 1 end
+			if c ~= "," then error("expected ',' or '}'") end
+			pos = pos + 1
+		end
+	elseif c == "[" then
+		local result = {}
+		pos = skip(text, pos + 1)
+		if text:sub(pos, pos) == "]" then return result, pos + 1 end
+		while true do
+			result[#result + 1], pos = parseValue(text, pos)
+			pos = skip(text, pos)
+			c = text:sub(pos, pos)
+			if c == "]" then return result, pos + 1 end
+			if c ~= "," then error("expected ',' or ']'") end
+			pos = pos + 1
+		end
+	elseif c == '"' then
+		return parseString(text, pos)
+	elseif text:sub(pos, pos + 3) == "true" then
+		return true, pos + 4
+	elseif text:sub(pos, pos + 4) == "false" then
+		return false, pos + 5
+	elseif text:sub(pos, pos + 3) == "null" then
+		return nil, pos + 4
+	end
+	local number = text:match("^-?%d+%.?%d*[eE]?[-+]?%d*", pos)
+	if not number then error("expected a value") end
+	return tonumber(number), pos + #number
+end
+
+function json.decode(text)
+	return (parseValue(text, 1))
+end
+
+return json
@@ -0,0 +1,3 @@
+-- The model for the `snapshot` benchmark: the same one
+-- the `json` benchmark loads.
+return fiddle.load_json("json-data.out")
@@ -18,9 +18,67 @@ string manipulation, and assertions:
 
 	*/
 	#include <assert.h>
+	#include <errno.h>
+	#include <locale.h>
+	#include <stdarg.h>
+	#include <stdint.h>
 	#include <stdio.h>
 	#include <stdlib.h>
 	#include <string.h>
+	#include <time.h>
+	/*
+
+### Platform
+
+Input files are memory-mapped where the platform allows it,
+and cache files are replaced atomically, so we need the
+native file, directory and mapping APIs:
+
+	*/
+	#ifdef _WIN32
+	#include <Windows.h>
+	#include <direct.h>
+	#include <fcntl.h>
+	#include <io.h>
+	#include <process.h>
+	#include <sys/stat.h>
+	#include <sys/utime.h>
+	#else
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <sys/socket.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <utime.h>
+	#include <poll.h>
+	#include <pthread.h>
+	#include <signal.h>
+	#include <unistd.h>
+	#endif
+	#ifdef __linux__
+	#include <sys/inotify.h>
+	#endif
+	/*
+
+When the compiler targets a machine with SSE2 or AVX2
+we use those instructions to scan input text quickly.
+Everything has a portable scalar fallback.
+
+	*/
+	#if defined(__AVX2__)
+	#include <immintrin.h>
+	#define FIDDLE_USE_AVX2 1
+	#endif
+	#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#include <emmintrin.h>
+	#define FIDDLE_USE_SSE2 1
+	#endif
+	#ifdef _MSC_VER
+	#include <intrin.h>
+	#endif
 	/*
 
 ### Lua
@@ -55,1275 +113,11749 @@ StringSpan emptyStringSpan()
 	return span;
 }
 
-StringSpan readFile(char const* path)
+/*
+
+### Input Files
+
+An `InputFile` holds the text of a file we are
+processing. Whenever possible the text is a read-only
+memory mapping of the file, so that the parser (and
+every `StringSpan` it produces) points straight into
+the page cache without any copying.
+
+Pipes, terminals and other special files can't be
+mapped, so for those we fall back to reading the
+contents into a heap buffer.
+
+Note that the text is *not* NUL-terminated, so code
+that walks it must always respect `text.end`.
+
+*/
+typedef struct InputFile
 {
-	size_t size = 0;
-	FILE* file = NULL;
-	char* buffer = NULL;
-	StringSpan span = emptyStringSpan();
+	StringSpan	text;
 
-	/* Try to open the file */
-	file = fopen(path, "rb");
-	if(!file)
-	{
-		fprintf(stderr,
-			"fiddle: failed to open '%s' for reading\n",
-			path);
-		return span;
-	}
+	/* Mapped view of the file, if we were able to map it */
+	void*		mapping;
+	size_t		mappingSize;
 
-	/* Use `ftell` to determine size of file */
-	fseek(file, 0, SEEK_END);
-	size = ftell(file);
-	fseek(file, 0, SEEK_SET);
+	/* Heap buffer, if we had to fall back to reading */
+	char*		buffer;
+} InputFile;
 
-	/* Allocate buffer for result */
-	buffer = (char*) malloc(size + 1);
+static char const kEmptyText[] = "";
+
+static int readInputFileBuffered(
+	InputFile*	file,
+	FILE*		stream,
+	size_t		sizeHint)
+{
+	size_t capacity = sizeHint ? sizeHint + 1 : 64 * 1024;
+	size_t size = 0;
+	char* buffer = (char*) malloc(capacity);
 	if(!buffer)
+		return 0;
+
+	for(;;)
 	{
-		fprintf(stderr,
-			"fiddle: memory allocation failed\n");
-		fclose(file);
-		return span;
+		if(size == capacity)
+		{
+			size_t newCapacity = capacity * 2;
+			char* newBuffer = (char*) realloc(buffer, newCapacity);
+			if(!newBuffer)
+			{
+				free(buffer);
+				return 0;
+			}
+			buffer = newBuffer;
+			capacity = newCapacity;
+		}
+
+		size_t count = fread(buffer + size, 1, capacity - size, stream);
+		size += count;
+		if(count == 0)
+			break;
 	}
 
-	if(fread(buffer, size, 1, file) != 1)
+	if(ferror(stream))
 	{
-		fprintf(stderr,
-			"fiddle: failed to read from '%s'\n",
-			path);
-		fclose(file);
-		return span;
+		free(buffer);
+		return 0;
 	}
 
-	fclose(file);
-
-	buffer[size] = 0;
-	span.begin = buffer;
-	span.end = buffer + size;
-	return span;
+	file->buffer = buffer;
+	file->text.begin = buffer;
+	file->text.end = buffer + size;
+	return 1;
 }
 
-
-typedef enum TemplateNodeFlavor
+#ifdef _WIN32
+static int mapInputFile(
+	InputFile*	file,
+	char const*	path)
 {
-	kTemplateNodeFlavor_Text,
-	kTemplateNodeFlavor_TextAndNewline,
-	kTemplateNodeFlavor_Escape,
-	kTemplateNodeFlavor_EscapeExpr,
-} TemplateNodeFlavor;
+	HANDLE handle = CreateFileA(
+		path,
+		GENERIC_READ,
+		FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL,
+		OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN,
+		NULL);
+	if(handle == INVALID_HANDLE_VALUE)
+		return 0;
 
-typedef struct TemplateNode TemplateNode;
-struct TemplateNode
-{
-	TemplateNodeFlavor flavor;
+	LARGE_INTEGER size;
+	if(GetFileType(handle) != FILE_TYPE_DISK
+		|| !GetFileSizeEx(handle, &size)
+		|| size.QuadPart == 0
+		|| (unsigned long long) size.QuadPart > (size_t) -1)
+	{
+		CloseHandle(handle);
+		return 0;
+	}
 
-	/* Full (raw) text of the node */
-	StringSpan text;
+	HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+	CloseHandle(handle);
+	if(!mapping)
+		return 0;
 
-	TemplateNode*	firstChild;
-	TemplateNode*	next;
-};
+	void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if(!view)
+		return 0;
 
-static TemplateNode* allocateNode()
-{
-	TemplateNode* node = (TemplateNode*) malloc(sizeof(TemplateNode));
-	memset(node, 0, sizeof(TemplateNode));
-	return node;
+	file->mapping = view;
+	file->mappingSize = (size_t) size.QuadPart;
+	file->text.begin = (char const*) view;
+	file->text.end = file->text.begin + file->mappingSize;
+	return 1;
 }
-
-static char const* isEscapeLine(
-	StringSpan line)
+#else
+static int mapInputFile(
+	InputFile*	file,
+	char const*	path)
 {
-	char const* cursor = line.begin;
-	char const* end = line.end;
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return 0;
 
-	for(;;)
+	struct stat info;
+	if(fstat(fd, &info) != 0
+		|| !S_ISREG(info.st_mode)
+		|| info.st_size <= 0
+		|| (unsigned long long) info.st_size > (size_t) -1)
 	{
-		if(cursor == end)
-			return 0;
+		close(fd);
+		return 0;
+	}
 
-		switch(*cursor)
-		{
-		case ' ': case '\t':
-			cursor++;
-			continue;
+	size_t size = (size_t) info.st_size;
+	void* view = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(view == MAP_FAILED)
+		return 0;
 
-		default:
-			break;
-		}
-		break;
-	}
+#ifdef MADV_SEQUENTIAL
+	madvise(view, size, MADV_SEQUENTIAL);
+#endif
 
-	if(*cursor == '%')
-		return cursor + 1;
-	return 0;
+	file->mapping = view;
+	file->mappingSize = size;
+	file->text.begin = (char const*) view;
+	file->text.end = file->text.begin + size;
+	return 1;
 }
+#endif
 
-StringSpan readLine(char const** ioCursor, char const*end)
+/*
+
+`tryOpenInputFile()` tries to map the file at `path`, and
+falls back to buffered reading if that isn't possible
+(including for empty files, which can't be mapped).
+If the file can't be read at all, it returns zero and
+sets `failure` to a description of what went wrong.
+
+*/
+static int tryOpenInputFile(
+	InputFile*		file,
+	char const*		path,
+	char const**	failure)
 {
-	StringSpan span;
-	char const* cursor = *ioCursor;
+	memset(file, 0, sizeof(InputFile));
 
-	span.begin = cursor;
+	if(mapInputFile(file, path))
+		return 1;
 
-	for(;;)
+	FILE* stream = fopen(path, "rb");
+	if(!stream)
 	{
-		span.end = cursor;
-		if(cursor == end)
-			break;
+		*failure = "failed to open '%s' for reading";
+		return 0;
+	}
 
-		int c = *cursor++;
-		switch(c)
-		{
-		default:
-			continue;
+	size_t sizeHint = 0;
+	if(fseek(stream, 0, SEEK_END) == 0)
+	{
+		long size = ftell(stream);
+		if(size > 0)
+			sizeHint = (size_t) size;
+		fseek(stream, 0, SEEK_SET);
+	}
 
-		case '\r': case '\n':
-			{
-				int d = *cursor;
-				if( (c ^ d) == ('\r' ^ '\n'))
-				{
-					cursor++;
-				}
-			}
-			break;
-		}
-		break;
+	int ok = readInputFileBuffered(file, stream, sizeHint);
+	fclose(stream);
+	if(!ok)
+	{
+		*failure = "failed to read from '%s'";
+		return 0;
 	}
 
-//	fprintf(stderr, "LINE: '%.*s'\n", (int) (span.end - span.begin), span.begin);	
+	if(file->text.begin == file->text.end)
+	{
+		free(file->buffer);
+		file->buffer = NULL;
+		file->text.begin = kEmptyText;
+		file->text.end = kEmptyText;
+	}
+	return 1;
+}
 
-	*ioCursor = cursor;
-	return span;
+static void closeInputFile(
+	InputFile*	file)
+{
+	if(file->mapping)
+	{
+#ifdef _WIN32
+		UnmapViewOfFile(file->mapping);
+#else
+		munmap(file->mapping, file->mappingSize);
+#endif
+	}
+	free(file->buffer);
+	memset(file, 0, sizeof(InputFile));
 }
 
-static TemplateNode* addTextNode(
-	TemplateNode*** ioLink,
-	char const* begin,
-	char const* end)
+/*
+
+### Hashing
+
+We use a streaming 64-bit hash (the XXH64 algorithm)
+to derive cache keys from text. It processes 32 bytes
+per round, which keeps it cheap even for large files.
+Input is always read as little-endian, so hashes are
+the same on every machine.
+
+*/
+typedef struct Hasher
 {
-	TemplateNode* node = allocateNode();
-	node->flavor = kTemplateNodeFlavor_Text;
-	node->text.begin = begin;
-	node->text.end = end;
+	uint64_t	lanes[4];
+	uint64_t	seed;
+	uint64_t	totalSize;
+	uint8_t		pending[32];
+	size_t		pendingSize;
+} Hasher;
+
+static uint64_t const kHashPrime1 = 11400714785074694791ULL;
+static uint64_t const kHashPrime2 = 14029467366897019727ULL;
+static uint64_t const kHashPrime3 = 1609587929392839161ULL;
+static uint64_t const kHashPrime4 = 9650029242287828579ULL;
+static uint64_t const kHashPrime5 = 2870177450012600261ULL;
+
+static uint64_t rotateLeft64(uint64_t value, int amount)
+{
+	return (value << amount) | (value >> (64 - amount));
+}
 
-	*(*ioLink) = node;
-	(*ioLink) = &node->next;
+static uint64_t readLittleEndian64(uint8_t const* bytes)
+{
+	return (uint64_t) bytes[0]
+		| ((uint64_t) bytes[1] << 8)
+		| ((uint64_t) bytes[2] << 16)
+		| ((uint64_t) bytes[3] << 24)
+		| ((uint64_t) bytes[4] << 32)
+		| ((uint64_t) bytes[5] << 40)
+		| ((uint64_t) bytes[6] << 48)
+		| ((uint64_t) bytes[7] << 56);
+}
 
-	return node;
+static uint32_t readLittleEndian32(uint8_t const* bytes)
+{
+	return (uint32_t) bytes[0]
+		| ((uint32_t) bytes[1] << 8)
+		| ((uint32_t) bytes[2] << 16)
+		| ((uint32_t) bytes[3] << 24);
 }
 
-static TemplateNode* maybeAddTextNode(
-	TemplateNode*** ioLink,
-	char const* begin,
-	char const* end)
+static uint64_t hashRound(uint64_t lane, uint64_t input)
 {
-	if(begin == end)
-		return 0;
+	lane += input * kHashPrime2;
+	lane = rotateLeft64(lane, 31);
+	return lane * kHashPrime1;
+}
 
-	return addTextNode(ioLink, begin, end);
+static uint64_t hashMergeRound(uint64_t hash, uint64_t lane)
+{
+	hash ^= hashRound(0, lane);
+	return hash * kHashPrime1 + kHashPrime4;
 }
 
-static int gErrorCount = 0;
-static void fiddle_error(char const* message, ...)
+static void initHasher(
+	Hasher*		hasher,
+	uint64_t	seed)
 {
-	gErrorCount++;
-	va_list args;
-	va_start(args, message);
-	fprintf(stderr, "fiddle: error: ");
-	vfprintf(stderr, message, args);
-	fprintf(stderr, "\n");
-	va_end(args);
+	memset(hasher, 0, sizeof(Hasher));
+	hasher->seed = seed;
+	hasher->lanes[0] = seed + kHashPrime1 + kHashPrime2;
+	hasher->lanes[1] = seed + kHashPrime2;
+	hasher->lanes[2] = seed;
+	hasher->lanes[3] = seed - kHashPrime1;
 }
 
-typedef enum TemplateParseState
+static void hashStripe(
+	Hasher*			hasher,
+	uint8_t const*	stripe)
 {
-	kTemplateParseState_Default,
-	kTemplateParseState_InExprEscape,
-} TemplateParseState;
+	hasher->lanes[0] = hashRound(hasher->lanes[0], readLittleEndian64(stripe));
+	hasher->lanes[1] = hashRound(hasher->lanes[1], readLittleEndian64(stripe + 8));
+	hasher->lanes[2] = hashRound(hasher->lanes[2], readLittleEndian64(stripe + 16));
+	hasher->lanes[3] = hashRound(hasher->lanes[3], readLittleEndian64(stripe + 24));
+}
 
-static TemplateNode* parseTemplate(
-	StringSpan 	templateLines,
-	StringSpan 	prefix)
+static void updateHasher(
+	Hasher*		hasher,
+	void const*	data,
+	size_t		size)
 {
-	TemplateNode* nodes = 0;
-	TemplateNode** link = &nodes;
+	uint8_t const* cursor = (uint8_t const*) data;
+	uint8_t const* end = cursor + size;
 
-	TemplateNode* spliceNode = 0;
+	hasher->totalSize += size;
 
-	TemplateParseState state = kTemplateParseState_Default;
+	if(hasher->pendingSize)
+	{
+		size_t count = 32 - hasher->pendingSize;
+		if(count > size)
+			count = size;
+		memcpy(hasher->pending + hasher->pendingSize, cursor, count);
+		hasher->pendingSize += count;
+		cursor += count;
+		if(hasher->pendingSize < 32)
+			return;
+		hashStripe(hasher, hasher->pending);
+		hasher->pendingSize = 0;
+	}
 
-	size_t prefixSize = prefix.end - prefix.begin;
-	char const* cursor = templateLines.begin;
-	char const* end = templateLines.end;
-	for(;;)
+	while(end - cursor >= 32)
 	{
-		if(cursor == end)
-			break;
+		hashStripe(hasher, cursor);
+		cursor += 32;
+	}
 
-		StringSpan line = readLine(&cursor, end);
-		line.begin += prefixSize;
-		/*
+	memcpy(hasher->pending, cursor, end - cursor);
+	hasher->pendingSize = end - cursor;
+}
 
-		First, we'll check if this line is a full
-		on lua code line.
+static uint64_t finishHasher(
+	Hasher const*	hasher)
+{
+	uint64_t hash;
+	if(hasher->totalSize >= 32)
+	{
+		hash = rotateLeft64(hasher->lanes[0], 1)
+			+ rotateLeft64(hasher->lanes[1], 7)
+			+ rotateLeft64(hasher->lanes[2], 12)
+			+ rotateLeft64(hasher->lanes[3], 18);
+		hash = hashMergeRound(hash, hasher->lanes[0]);
+		hash = hashMergeRound(hash, hasher->lanes[1]);
+		hash = hashMergeRound(hash, hasher->lanes[2]);
+		hash = hashMergeRound(hash, hasher->lanes[3]);
+	}
+	else
+	{
+		hash = hasher->seed + kHashPrime5;
+	}
+	hash += hasher->totalSize;
 
-		*/
-		char const* escapeBegin = isEscapeLine(line);
-		if(escapeBegin)
-		{
-			switch(state)
-			{
-			case kTemplateParseState_Default:
-				{
-					TemplateNode* node = allocateNode();
-					node->flavor = kTemplateNodeFlavor_Escape;
-					node->text.begin = escapeBegin;
-					node->text.end = line.end;
+	uint8_t const* cursor = hasher->pending;
+	uint8_t const* end = cursor + hasher->pendingSize;
+	while(end - cursor >= 8)
+	{
+		hash ^= hashRound(0, readLittleEndian64(cursor));
+		hash = rotateLeft64(hash, 27) * kHashPrime1 + kHashPrime4;
+		cursor += 8;
+	}
+	if(end - cursor >= 4)
+	{
+		hash ^= (uint64_t) readLittleEndian32(cursor) * kHashPrime1;
+		hash = rotateLeft64(hash, 23) * kHashPrime2 + kHashPrime3;
+		cursor += 4;
+	}
+	while(cursor != end)
+	{
+		hash ^= (*cursor++) * kHashPrime5;
+		hash = rotateLeft64(hash, 11) * kHashPrime1;
+	}
 
-					*link = node;
-					link = &node->next;
-				}
-				break;
+	hash ^= hash >> 33;
+	hash *= kHashPrime2;
+	hash ^= hash >> 29;
+	hash *= kHashPrime3;
+	hash ^= hash >> 32;
+	return hash;
+}
 
-			case kTemplateParseState_InExprEscape:
-				fiddle_error("unterminated escape\n");
-				return 0;
-			}
-		}
-		else
-		{
-			char const* cc = line.begin;
-			char const* spanBegin = cc;
-			for(;;)
-			{
-				if(cc == line.end)
-					break;
+static void hashSpan(
+	Hasher*		hasher,
+	StringSpan	span)
+{
+	/* Include the size, so that adjacent spans can't alias */
+	uint64_t size = span.end - span.begin;
+	updateHasher(hasher, &size, sizeof(size));
+	updateHasher(hasher, span.begin, span.end - span.begin);
+}
 
-				char const* spanEnd = cc;
+static void hashString(
+	Hasher*		hasher,
+	char const*	text)
+{
+	StringSpan span;
+	span.begin = text;
+	span.end = text + strlen(text);
+	hashSpan(hasher, span);
+}
 
-				int c = *cc++;
-				switch(state)
-				{
-				case kTemplateParseState_Default:
-					if(c == '$')
-					{
-						if(cc != line.end
-							&& *cc == '{')
-						{
-							cc++;
-							maybeAddTextNode(&link, spanBegin, spanEnd);
-							/*
+static void hashInteger(
+	Hasher*		hasher,
+	uint64_t	value)
+{
+	updateHasher(hasher, &value, sizeof(value));
+}
 
-							We create a node to represent
-							the splice.
+static void formatHash(
+	uint64_t	hash,
+	char*		buffer)
+{
+	snprintf(buffer, 17, "%016llx", (unsigned long long) hash);
+}
 
-							*/
-							spliceNode = allocateNode();
-							spliceNode->flavor = kTemplateNodeFlavor_EscapeExpr;
+/*
 
-							*link = spliceNode;
-							link = &spliceNode->firstChild;
+### Threads
 
-							spanBegin = cc;
-							state = kTemplateParseState_InExprEscape;
-						}
-					}
-					break;
+Several files can be processed in parallel, by a pool
+of worker threads. We only need a handful of primitives
+for that: threads, a mutex, an atomic counter, and
+thread-local storage.
 
-				case kTemplateParseState_InExprEscape:
-					if(*cc == '}')
-					{
-						spanEnd = cc;
-						cc++;
-						maybeAddTextNode(&link, spanBegin, spanEnd);
+*/
+#if defined(_MSC_VER)
+#define FIDDLE_THREAD_LOCAL __declspec(thread)
+#else
+#define FIDDLE_THREAD_LOCAL __thread
+#endif
 
-						link = &spliceNode->next;
-						spliceNode = 0;
+#ifdef _WIN32
+typedef HANDLE				FiddleThread;
+typedef CRITICAL_SECTION	FiddleMutex;
+typedef CONDITION_VARIABLE	FiddleCondition;
+#else
+typedef pthread_t			FiddleThread;
+typedef pthread_mutex_t		FiddleMutex;
+typedef pthread_cond_t		FiddleCondition;
+#endif
 
-						spanBegin = cc;
-						state = kTemplateParseState_Default;
-					}
-					break;
-				}
-			}
-			addTextNode(&link, spanBegin, line.end)->flavor = kTemplateNodeFlavor_TextAndNewline;
-		}
-	}
+typedef void (*FiddleThreadFunc)(void* userData);
+
+typedef struct FiddleThreadStart
+{
+	FiddleThreadFunc	func;
+	void*				userData;
+} FiddleThreadStart;
 
-	return nodes;
+#ifdef _WIN32
+static DWORD WINAPI threadEntryPoint(LPVOID param)
+#else
+static void* threadEntryPoint(void* param)
+#endif
+{
+	FiddleThreadStart start = *(FiddleThreadStart*) param;
+	free(param);
+	start.func(start.userData);
+	return 0;
 }
 
-static char const* findMatch(
-	char const* pattern,
-	char const* begin,
-	char const* end)
+/*
+
+Worker threads get a stack as large as the usual main
+thread stack, since Lua code can recurse deeply through
+C functions.
+
+*/
+enum
 {
-	size_t inputSize = end - begin;
-	size_t patternSize = strlen(pattern);
+	kThreadStackSize = 8 * 1024 * 1024,
+};
 
-	if(inputSize < patternSize)
-		return NULL;
+static int startThread(
+	FiddleThread*		thread,
+	FiddleThreadFunc	func,
+	void*				userData)
+{
+	FiddleThreadStart* start = (FiddleThreadStart*) malloc(sizeof(FiddleThreadStart));
+	if(!start)
+		return 0;
+	start->func = func;
+	start->userData = userData;
+#ifdef _WIN32
+	*thread = CreateThread(NULL, kThreadStackSize, &threadEntryPoint, start, 0, NULL);
+	if(*thread)
+		return 1;
+#else
+	pthread_attr_t attributes;
+	pthread_attr_init(&attributes);
+	pthread_attr_setstacksize(&attributes, kThreadStackSize);
+	int result = pthread_create(thread, &attributes, &threadEntryPoint, start);
+	pthread_attr_destroy(&attributes);
+	if(result == 0)
+		return 1;
+#endif
+	free(start);
+	return 0;
+}
 
-	end -= (patternSize - 1);
+static void joinThread(
+	FiddleThread	thread)
+{
+#ifdef _WIN32
+	WaitForSingleObject(thread, INFINITE);
+	CloseHandle(thread);
+#else
+	pthread_join(thread, NULL);
+#endif
+}
 
-	char const* cursor = begin;
-	while(cursor != end)
-	{
-		if(strncmp(cursor, pattern, patternSize) == 0)
-			return cursor;
+static void initMutex(FiddleMutex* mutex)
+{
+#ifdef _WIN32
+	InitializeCriticalSection(mutex);
+#else
+	pthread_mutex_init(mutex, NULL);
+#endif
+}
 
-		cursor++;
-	}
-	return NULL;
+static void destroyMutex(FiddleMutex* mutex)
+{
+#ifdef _WIN32
+	DeleteCriticalSection(mutex);
+#else
+	pthread_mutex_destroy(mutex);
+#endif
 }
 
-static char const* findMatchInLine(
-	char const* pattern,
-	StringSpan 	line)
+static void lockMutex(FiddleMutex* mutex)
 {
-	return findMatch(pattern, line.begin, line.end);
+#ifdef _WIN32
+	EnterCriticalSection(mutex);
+#else
+	pthread_mutex_lock(mutex);
+#endif
 }
 
-/*
+static void unlockMutex(FiddleMutex* mutex)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(mutex);
+#else
+	pthread_mutex_unlock(mutex);
+#endif
+}
 
-A `Chunk` represents the large-scale structure of
-an input file, which is composed of raw text spans
-and templates.
+static void initCondition(FiddleCondition* condition)
+{
+#ifdef _WIN32
+	InitializeConditionVariable(condition);
+#else
+	pthread_cond_init(condition, NULL);
+#endif
+}
 
-A template file will be parsed into a single chunk,
-while a source file with embedded tempaltes may
-have one or more chunks.
+static void destroyCondition(FiddleCondition* condition)
+{
+#ifdef _WIN32
+	(void) condition;
+#else
+	pthread_cond_destroy(condition);
+#endif
+}
 
-*/
-typedef struct Chunk Chunk;
-struct Chunk
+static void waitCondition(FiddleCondition* condition, FiddleMutex* mutex)
 {
-	StringSpan prefix;
-	StringSpan linePrefix;
-	StringSpan code;
-	StringSpan outputSpan;
-	TemplateNode* codeNode;
+#ifdef _WIN32
+	SleepConditionVariableCS(condition, mutex, INFINITE);
+#else
+	pthread_cond_wait(condition, mutex);
+#endif
+}
 
-	Chunk*	next;
-};
+static void wakeAllWaiting(FiddleCondition* condition)
+{
+#ifdef _WIN32
+	WakeAllConditionVariable(condition);
+#else
+	pthread_cond_broadcast(condition);
+#endif
+}
 
-static Chunk* allocateChunk()
+static unsigned long atomicIncrement(
+	unsigned long volatile*	value)
 {
-	Chunk* chunk = (Chunk*) malloc(sizeof(Chunk));
-	memset(chunk, 0, sizeof(Chunk));
-	return chunk;
+#ifdef _MSC_VER
+	return (unsigned long) InterlockedIncrement((LONG volatile*) value);
+#else
+	return __sync_add_and_fetch(value, 1);
+#endif
 }
 
-StringSpan commonPrefix(
-	StringSpan left,
-	StringSpan right)
+static int getProcessorCount()
 {
-	char const* ll = left.begin;
-	char const* rr = right.begin;
+#ifdef _WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+#else
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return count > 0 ? (int) count : 1;
+#endif
+}
 
-	StringSpan prefix;
-	prefix.begin = ll;
+/*
 
-	for(;;)
-	{
-		if(ll == left.end)
-			break;
-		if(rr == right.end)
-			break;
+### Replacing Files
 
-		if(*ll != *rr)
-			break;
+Files that may be read by other processes at the same
+time (like cache entries) are written to a temporary
+file in the same directory, and then renamed into
+place, so that readers only ever see complete files.
 
-		ll++;
-		rr++;
-	}
+*/
+static unsigned long getProcessId()
+{
+#ifdef _WIN32
+	return (unsigned long) _getpid();
+#else
+	return (unsigned long) getpid();
+#endif
+}
 
-	prefix.end = ll;
-	return prefix;
+static char* makeTemporaryPath(
+	char const*	path)
+{
+	static unsigned long volatile counter = 0;
+	unsigned long id = atomicIncrement(&counter);
+
+	size_t size = strlen(path) + 64;
+	char* result = (char*) malloc(size);
+	if(!result)
+		return NULL;
+	snprintf(result, size, "%s.tmp%lu-%lu", path, getProcessId(), id);
+	return result;
 }
 
-static Chunk* parseTemplateFile(
-	char const* begin,
-	char const* end)
+static int replaceFile(
+	char const*	fromPath,
+	char const*	toPath)
 {
-	Chunk* chunk = allocateChunk();
+#ifdef _WIN32
+	return MoveFileExA(fromPath, toPath, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(fromPath, toPath) == 0;
+#endif
+}
 
-	StringSpan code;
-	code.begin = begin;
-	code.end = end;
+static int makeDirectory(
+	char const*	path)
+{
+#ifdef _WIN32
+	int result = _mkdir(path);
+#else
+	int result = mkdir(path, 0777);
+#endif
+	return result == 0 || errno == EEXIST;
+}
 
-	StringSpan prefix = emptyStringSpan();
+static int writeSpansAtomically(
+	char const*			path,
+	StringSpan const*	spans,
+	size_t				spanCount)
+{
+	char* tempPath = makeTemporaryPath(path);
+	if(!tempPath)
+		return 0;
 
-	chunk->codeNode = parseTemplate(
-		code,
-		prefix);
+	int ok = 0;
+	FILE* file = fopen(tempPath, "wb");
+	if(file)
+	{
+		ok = 1;
+		for(size_t ii = 0; ii < spanCount && ok; ii++)
+		{
+			size_t size = spans[ii].end - spans[ii].begin;
+			ok = fwrite(spans[ii].begin, 1, size, file) == size;
+		}
+		ok = (fclose(file) == 0) && ok;
+		ok = ok && replaceFile(tempPath, path);
+		if(!ok)
+			remove(tempPath);
+	}
+	free(tempPath);
+	return ok;
+}
 
-	return chunk;
+static int writeFileAtomically(
+	char const*	path,
+	char const*	begin,
+	char const*	end)
+{
+	StringSpan span;
+	span.begin = begin;
+	span.end = end;
+	return writeSpansAtomically(path, &span, 1);
 }
 
+typedef enum TemplateNodeFlavor
+{
+	kTemplateNodeFlavor_Text,
+	kTemplateNodeFlavor_TextAndNewline,
+	kTemplateNodeFlavor_Escape,
+	kTemplateNodeFlavor_EscapeExpr,
+} TemplateNodeFlavor;
+
 /*
 
-The parsing of a source file with embedded templates
-uses a little state machine, so that we can issue
-useful error messages when people leave out directives
-(or misspell them, etc.).
+### Memory Arena
+
+All of the data structures we build while parsing a
+file are allocated from a `MemoryArena`, which hands
+out memory from large blocks by bumping a pointer.
+Nothing is freed individually; instead the whole arena
+is released in one step once the file has been processed.
 
 */
-typedef enum SourceFileParseState SourceFileParseState;
-enum SourceFileParseState
+typedef struct MemoryArenaBlock MemoryArenaBlock;
+struct MemoryArenaBlock
 {
-	kSourceFileParseState_Initial,
-	kSourceFileParseState_Default,
-	kSourceFileParseState_InTemplateCode,
-	kSourceFileParseState_InTemplateOutput,
+	MemoryArenaBlock*	next;
+	size_t				size;
 };
-/*
-
-The `parseSourceFile()` function is responsible for
-reading the text of a source file (possibly with embedded
-templates) into a sequence of "chunks".
 
-*/
-static Chunk* parseSourceFile(
-	char const* begin,
-	char const* end)
+typedef struct MemoryArena
 {
-	/*
+	MemoryArenaBlock*	blocks;
+	char*				cursor;
+	char*				end;
 
-	We are going to build up a linked list of chunks
-	of the file.
+	/* Most recent allocation, which can be grown in place */
+	char*				last;
+} MemoryArena;
 
-	*/
-	Chunk* chunks = NULL;
-	Chunk** link = &chunks;
-	/*
-
-	We will use the variable `cursor` to track
-	our progress through the input text.
+enum
+{
+	kMemoryArenaAlignment = 16,
+	kMemoryArenaMinBlockSize = 64 * 1024,
+};
 
-	*/
-	SourceFileParseState state = kSourceFileParseState_Initial;
-	char const* cursor = begin;
-	/*
+static size_t alignArenaSize(size_t size)
+{
+	return (size + kMemoryArenaAlignment - 1) & ~(size_t)(kMemoryArenaAlignment - 1);
+}
 
-	There will always be at least one chunk,
-	even in a file with no templates, so
-	we'll start the first one here.
+static void* arenaAllocate(
+	MemoryArena*	arena,
+	size_t			size)
+{
+	size = alignArenaSize(size ? size : 1);
+	if((size_t)(arena->end - arena->cursor) < size)
+	{
+		size_t headerSize = alignArenaSize(sizeof(MemoryArenaBlock));
+		size_t blockSize = kMemoryArenaMinBlockSize;
+		if(arena->blocks && blockSize < arena->blocks->size * 2)
+			blockSize = arena->blocks->size * 2;
+		if(blockSize < size + headerSize)
+			blockSize = size + headerSize;
+
+		MemoryArenaBlock* block = (MemoryArenaBlock*) malloc(blockSize);
+		if(!block)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		block->next = arena->blocks;
+		block->size = blockSize;
+		arena->blocks = block;
+		arena->cursor = (char*) block + headerSize;
+		arena->end = (char*) block + blockSize;
+	}
 
-	*/
-	Chunk* chunk = allocateChunk();
-	chunk->prefix.begin = cursor;
+	char* result = arena->cursor;
+	arena->cursor += size;
+	arena->last = result;
+	return result;
+}
 
-	*link = chunk;
-	link = &chunk->next;
-	/*
+/*
 
-	The patterns we are looking for on the lines
-	are fixed.
+`arenaGrowArray()` implements the usual doubling strategy
+for a dynamic array living in an arena. When the array is
+the most recent allocation it is simply extended in place;
+otherwise it is copied, and the old storage is reclaimed
+along with the rest of the arena.
 
-	*/
-	char const* openTagPattern 	= "FIDDLE TEMPLATE";
-	char const* closeTagPattern = "FIDDLE OUTPUT";
-	char const* endTagPattern	= "FIDDLE END";
-	/*
+*/
+static void* arenaGrowArray(
+	MemoryArena*	arena,
+	void*			array,
+	size_t			elementSize,
+	size_t*			ioCapacity)
+{
+	size_t oldCapacity = *ioCapacity;
+	size_t newCapacity = oldCapacity ? oldCapacity * 2 : 64;
+	size_t oldSize = alignArenaSize(oldCapacity * elementSize);
+	size_t newSize = alignArenaSize(newCapacity * elementSize);
+
+	*ioCapacity = newCapacity;
+	if(array && (char*) array == arena->last
+		&& (size_t)(arena->end - (char*) array) >= newSize)
+	{
+		arena->cursor = (char*) array + newSize;
+		return array;
+	}
 
-	With the preliminaries out of the way, we are
-	going to start scaning through the file.
+	void* result = arenaAllocate(arena, newSize);
+	if(array)
+		memcpy(result, array, oldSize);
+	return result;
+}
 
-	*/
-	for(;;)
+static void freeArena(
+	MemoryArena*	arena)
+{
+	MemoryArenaBlock* block = arena->blocks;
+	while(block)
 	{
-		/*
-	
-		If we've reached the end of the input text,
-		then we are done parsing, and need to bail
-		out of this loop.
+		MemoryArenaBlock* next = block->next;
+		free(block);
+		block = next;
+	}
+	memset(arena, 0, sizeof(MemoryArena));
+}
 
-		*/
-		if(cursor == end)
-			break;
-		/*
+/*
 
-		Otherwise, we'll read in the next line of
-		the file, and see if it looks like the start
-		of a template.
+### Template IR
 
-		*/
-		StringSpan line = readLine(&cursor, end);
-		char const* openLoc = findMatchInLine(openTagPattern, line);
-		if(openLoc)
-		{
-			/*
+A parsed template is stored as a flat array of
+`TemplateNode`s, so that code generation can walk it
+linearly. A splice (`kTemplateNodeFlavor_EscapeExpr`)
+is immediately followed by the `childCount` text
+nodes that make up its expression.
 
-			
+*/
+typedef struct TemplateNode TemplateNode;
+struct TemplateNode
+{
+	TemplateNodeFlavor flavor;
 
-			*/
+	/* Full (raw) text of the node */
+	StringSpan text;
+
+	/* Number of nodes following a splice that belong to it */
+	size_t childCount;
+};
+
+static char const* isEscapeLine(
+	StringSpan line)
+{
+	char const* cursor = line.begin;
+	char const* end = line.end;
+
+	for(;;)
+	{
+		if(cursor == end)
+			return 0;
+
+		switch(*cursor)
+		{
+		case ' ': case '\t':
+			cursor++;
+			continue;
+
+		default:
+			break;
+		}
+		break;
+	}
+
+	if(*cursor == '%')
+		return cursor + 1;
+	return 0;
+}
+
+/*
+
+### Scanning Text
+
+Most files we are asked to process contain no templates
+at all, so the scanning routines here are written to
+skip over ordinary text as quickly as possible.
+
+*/
+static unsigned countTrailingZeros(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (unsigned) index;
+#else
+	return (unsigned) __builtin_ctz(mask);
+#endif
+}
+
+/*
+
+`findLineBreak()` returns a pointer to the first `'\r'`
+or `'\n'` in the range, or `end` if there is none.
+
+*/
+static char const* findLineBreak(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_SSE2
+	__m128i const cr = _mm_set1_epi8('\r');
+	__m128i const lf = _mm_set1_epi8('\n');
+	while(end - cursor >= 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const*) cursor);
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, cr),
+			_mm_cmpeq_epi8(v, lf)));
+		if(mask)
+			return cursor + countTrailingZeros(mask);
+		cursor += 16;
+	}
+#endif
+	while(cursor != end)
+	{
+		char c = *cursor;
+		if(c == '\r' || c == '\n')
+			return cursor;
+		cursor++;
+	}
+	return end;
+}
+
+StringSpan readLine(char const** ioCursor, char const*end)
+{
+	StringSpan span;
+	char const* cursor = *ioCursor;
+
+	span.begin = cursor;
+	span.end = findLineBreak(cursor, end);
+
+	/*
+
+	A line break is `\r`, `\n`, or either of the
+	two-character sequences `\r\n` and `\n\r`.
+
+	*/
+	cursor = span.end;
+	if(cursor != end)
+	{
+		int c = *cursor++;
+		if(cursor != end)
+		{
+			int d = *cursor;
+			if( (c ^ d) == ('\r' ^ '\n'))
+			{
+				cursor++;
+			}
+		}
+	}
+
+	*ioCursor = cursor;
+	return span;
+}
+
+static size_t countLineBreaks(
+	char const* cursor,
+	char const* end)
+{
+	size_t count = 0;
+	while(cursor != end)
+	{
+		StringSpan line = readLine(&cursor, end);
+		if(line.end != cursor)
+			count++;
+	}
+	return count;
+}
+
+/*
+
+`findLineStart()` scans backwards from `cursor` to
+find the start of the line containing it, where
+`begin` is known to be the start of some earlier line.
+
+*/
+static char const* findLineStart(
+	char const* begin,
+	char const* cursor)
+{
+	while(cursor != begin)
+	{
+		char c = cursor[-1];
+		if(c == '\r' || c == '\n')
+			break;
+		cursor--;
+	}
+	return cursor;
+}
+
+/*
+
+All of the marker lines in an embedded template
+contain `FIDDLE ` followed by a keyword. Rather than
+searching for each marker separately, we search for
+the common prefix, using its first character and the
+`E` at offset five as anchors, and then verify any
+candidate we find.
+
+*/
+typedef enum MarkerKind
+{
+	kMarkerKind_None		= 0,
+	kMarkerKind_Template	= 1 << 0,
+	kMarkerKind_Output		= 1 << 1,
+	kMarkerKind_End			= 1 << 2,
+} MarkerKind;
+
+static char const kMarkerPrefix[] = "FIDDLE ";
+enum { kMarkerPrefixSize = sizeof(kMarkerPrefix) - 1 };
+
+static char const* findMarkerCandidate(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_AVX2
+	{
+		__m256i const f = _mm256_set1_epi8('F');
+		__m256i const e = _mm256_set1_epi8('E');
+		while(end - cursor >= 32 + 5)
+		{
+			__m256i a = _mm256_loadu_si256((__m256i const*) cursor);
+			__m256i b = _mm256_loadu_si256((__m256i const*) (cursor + 5));
+			unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_and_si256(
+				_mm256_cmpeq_epi8(a, f),
+				_mm256_cmpeq_epi8(b, e)));
+			if(mask)
+				return cursor + countTrailingZeros(mask);
+			cursor += 32;
+		}
+	}
+#endif
+#if FIDDLE_USE_SSE2
+	{
+		__m128i const f = _mm_set1_epi8('F');
+		__m128i const e = _mm_set1_epi8('E');
+		while(end - cursor >= 16 + 5)
+		{
+			__m128i a = _mm_loadu_si128((__m128i const*) cursor);
+			__m128i b = _mm_loadu_si128((__m128i const*) (cursor + 5));
+			unsigned mask = (unsigned) _mm_movemask_epi8(_mm_and_si128(
+				_mm_cmpeq_epi8(a, f),
+				_mm_cmpeq_epi8(b, e)));
+			if(mask)
+				return cursor + countTrailingZeros(mask);
+			cursor += 16;
+		}
+	}
+#endif
+	while(end - cursor > 5)
+	{
+		char const* found = (char const*) memchr(cursor, 'F', (end - cursor) - 5);
+		if(!found)
+			return NULL;
+		if(found[5] == 'E')
+			return found;
+		cursor = found + 1;
+	}
+	return NULL;
+}
+
+static int matchesAt(
+	char const* cursor,
+	char const* end,
+	char const* pattern,
+	size_t		patternSize)
+{
+	return (size_t)(end - cursor) >= patternSize
+		&& memcmp(cursor, pattern, patternSize) == 0;
+}
+
+/*
+
+`findMarker()` returns the location of the first marker
+in the range, and stores its kind in `outKind`. It returns
+`NULL` if the range contains no markers.
+
+*/
+static char const* findMarker(
+	char const* cursor,
+	char const* end,
+	MarkerKind*	outKind)
+{
+	for(;;)
+	{
+		char const* candidate = findMarkerCandidate(cursor, end);
+		if(!candidate)
+			return NULL;
+
+		if(matchesAt(candidate, end, kMarkerPrefix, kMarkerPrefixSize))
+		{
+			char const* keyword = candidate + kMarkerPrefixSize;
+			MarkerKind kind = kMarkerKind_None;
+			if(matchesAt(keyword, end, "TEMPLATE", 8))
+				kind = kMarkerKind_Template;
+			else if(matchesAt(keyword, end, "OUTPUT", 6))
+				kind = kMarkerKind_Output;
+			else if(matchesAt(keyword, end, "END", 3))
+				kind = kMarkerKind_End;
+
+			if(kind != kMarkerKind_None)
+			{
+				*outKind = kind;
+				return candidate;
+			}
+		}
+		cursor = candidate + 1;
+	}
+}
+
+/*
+
+`containsTemplateMarker()` checks whether the text has
+a `FIDDLE TEMPLATE` marker anywhere. Files without one
+have nothing for us to do.
+
+*/
+static int containsTemplateMarker(
+	StringSpan	text)
+{
+	char const* cursor = text.begin;
+	MarkerKind kind = kMarkerKind_None;
+	while((cursor = findMarker(cursor, text.end, &kind)) != NULL)
+	{
+		if(kind == kMarkerKind_Template)
+			return 1;
+		cursor++;
+	}
+	return 0;
+}
+
+/*
+
+`findLineMarkers()` returns the set of markers that
+appear anywhere on the given line.
+
+*/
+static unsigned findLineMarkers(
+	StringSpan	line)
+{
+	unsigned markers = 0;
+	char const* cursor = line.begin;
+	for(;;)
+	{
+		MarkerKind kind;
+		char const* marker = findMarker(cursor, line.end, &kind);
+		if(!marker)
+			break;
+		markers |= kind;
+		cursor = marker + kMarkerPrefixSize;
+	}
+	return markers;
+}
+
+/*
+
+A `Chunk` represents the large-scale structure of
+an input file, which is composed of raw text spans
+and templates.
+
+A template file will be parsed into a single chunk,
+while a source file with embedded tempaltes may
+have one or more chunks.
+
+Each chunk refers to its template as a range of
+nodes in the file's node array.
+
+*/
+typedef struct Chunk Chunk;
+struct Chunk
+{
+	StringSpan prefix;
+	StringSpan linePrefix;
+	StringSpan code;
+	StringSpan outputSpan;
+
+	size_t firstNode;
+	size_t nodeCount;
+
+	/* Line breaks before and after the template source */
+	size_t prefixLineCount;
+	size_t suffixLineCount;
+};
+
+/*
+
+A `ParsedFile` holds the chunks and template nodes
+for a single input file. Both arrays live in the
+file's arena, and are released along with it.
+
+*/
+typedef struct ParsedFile
+{
+	MemoryArena*	arena;
+
+	TemplateNode*	nodes;
+	size_t			nodeCount;
+	size_t			nodeCapacity;
+
+	Chunk*			chunks;
+	size_t			chunkCount;
+	size_t			chunkCapacity;
+} ParsedFile;
+
+static void initParsedFile(
+	ParsedFile*		file,
+	MemoryArena*	arena)
+{
+	memset(file, 0, sizeof(ParsedFile));
+	file->arena = arena;
+}
+
+static TemplateNode* addNode(
+	ParsedFile*			file,
+	TemplateNodeFlavor	flavor)
+{
+	if(file->nodeCount == file->nodeCapacity)
+	{
+		file->nodes = (TemplateNode*) arenaGrowArray(
+			file->arena,
+			file->nodes,
+			sizeof(TemplateNode),
+			&file->nodeCapacity);
+	}
+
+	TemplateNode* node = &file->nodes[file->nodeCount++];
+	memset(node, 0, sizeof(TemplateNode));
+	node->flavor = flavor;
+	return node;
+}
+
+static Chunk* addChunk(
+	ParsedFile*	file)
+{
+	if(file->chunkCount == file->chunkCapacity)
+	{
+		file->chunks = (Chunk*) arenaGrowArray(
+			file->arena,
+			file->chunks,
+			sizeof(Chunk),
+			&file->chunkCapacity);
+	}
+
+	Chunk* chunk = &file->chunks[file->chunkCount++];
+	memset(chunk, 0, sizeof(Chunk));
+	return chunk;
+}
+
+static TemplateNode* addTextNode(
+	ParsedFile*	file,
+	char const* begin,
+	char const* end)
+{
+	TemplateNode* node = addNode(file, kTemplateNodeFlavor_Text);
+	node->text.begin = begin;
+	node->text.end = end;
+	return node;
+}
+
+static TemplateNode* maybeAddTextNode(
+	ParsedFile*	file,
+	char const* begin,
+	char const* end)
+{
+	if(begin == end)
+		return 0;
+
+	return addTextNode(file, begin, end);
+}
+
+/*
+
+### Diagnostics
+
+Error messages for a file are collected in a `Diagnostics`
+object while the file is processed, and printed once it
+is done. When several files are processed in parallel,
+this lets us print all messages in the order the files
+were given on the command line, no matter which thread
+finished first.
+
+Each thread points `tDiagnostics` at the diagnostics of
+the file it is working on. Messages reported outside of
+any file go straight to `stderr`.
+
+*/
+typedef struct TextBuffer
+{
+	char*	data;
+	size_t	size;
+	size_t	capacity;
+} TextBuffer;
+
+static void appendText(
+	TextBuffer*	buffer,
+	char const*	text,
+	size_t		size)
+{
+	if(buffer->capacity - buffer->size < size)
+	{
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+		if(capacity < buffer->size + size)
+			capacity = buffer->size + size;
+		char* data = (char*) realloc(buffer->data, capacity);
+		if(!data)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		buffer->data = data;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->data + buffer->size, text, size);
+	buffer->size += size;
+}
+
+static void freeTextBuffer(
+	TextBuffer*	buffer)
+{
+	free(buffer->data);
+	memset(buffer, 0, sizeof(TextBuffer));
+}
+
+typedef struct Diagnostics
+{
+	/* Messages for `stderr` */
+	TextBuffer	messages;
+
+	/* Output from `print()`, when it is being captured */
+	TextBuffer	output;
+
+	int			errorCount;
+} Diagnostics;
+
+static FIDDLE_THREAD_LOCAL Diagnostics* tDiagnostics = NULL;
+static int gErrorCount = 0;
+
+static void reportErrorV(
+	char const*	prefix,
+	char const*	format,
+	va_list		args)
+{
+	char buffer[1024];
+	char* message = buffer;
+
+	va_list argsCopy;
+	va_copy(argsCopy, args);
+	int size = vsnprintf(buffer, sizeof(buffer), format, argsCopy);
+	va_end(argsCopy);
+	if(size < 0)
+		size = 0;
+	if((size_t) size >= sizeof(buffer))
+	{
+		message = (char*) malloc(size + 1);
+		if(!message)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		vsnprintf(message, size + 1, format, args);
+	}
+
+	Diagnostics* diagnostics = tDiagnostics;
+	if(diagnostics)
+	{
+		diagnostics->errorCount++;
+		appendText(&diagnostics->messages, "fiddle: ", 8);
+		appendText(&diagnostics->messages, prefix, strlen(prefix));
+		appendText(&diagnostics->messages, message, size);
+		appendText(&diagnostics->messages, "\n", 1);
+	}
+	else
+	{
+		gErrorCount++;
+		fprintf(stderr, "fiddle: %s%.*s\n", prefix, size, message);
+	}
+
+	if(message != buffer)
+		free(message);
+}
+
+/*
+
+`reportError()` reports a message that is not specific
+to any one part of the input (e.g., an error from Lua),
+while `fiddle_error()` reports a problem in the input.
+
+*/
+static void reportError(char const* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	reportErrorV("", format, args);
+	va_end(args);
+}
+
+static void fiddle_error(char const* message, ...)
+{
+	va_list args;
+	va_start(args, message);
+	reportErrorV("error: ", message, args);
+	va_end(args);
+}
+
+typedef enum TemplateParseState
+{
+	kTemplateParseState_Default,
+	kTemplateParseState_InExprEscape,
+} TemplateParseState;
+
+/*
+
+`parseTemplate()` appends the nodes for one template
+to `file`, and records their range in `chunk`. It
+returns zero if the template is malformed.
+
+*/
+static int parseTemplate(
+	ParsedFile*	file,
+	Chunk*		chunk,
+	StringSpan 	templateLines,
+	StringSpan 	prefix)
+{
+	/*
+
+	Splice nodes are tracked by index, since the
+	node array may move as it grows.
+
+	*/
+	size_t spliceNode = 0;
+	chunk->firstNode = file->nodeCount;
+
+	TemplateParseState state = kTemplateParseState_Default;
+
+	size_t prefixSize = prefix.end - prefix.begin;
+	char const* cursor = templateLines.begin;
+	char const* end = templateLines.end;
+	for(;;)
+	{
+		if(cursor == end)
+			break;
+
+		StringSpan line = readLine(&cursor, end);
+		line.begin += prefixSize;
+		/*
+
+		First, we'll check if this line is a full
+		on lua code line.
+
+		*/
+		char const* escapeBegin = isEscapeLine(line);
+		if(escapeBegin)
+		{
+			switch(state)
+			{
+			case kTemplateParseState_Default:
+				{
+					TemplateNode* node = addNode(file, kTemplateNodeFlavor_Escape);
+					node->text.begin = escapeBegin;
+					node->text.end = line.end;
+				}
+				break;
+
+			case kTemplateParseState_InExprEscape:
+				fiddle_error("unterminated escape");
+				return 0;
+			}
+		}
+		else
+		{
+			char const* cc = line.begin;
+			char const* spanBegin = cc;
+			for(;;)
+			{
+				if(cc == line.end)
+					break;
+
+				char const* spanEnd = cc;
+
+				int c = *cc++;
+				switch(state)
+				{
+				case kTemplateParseState_Default:
+					if(c == '$')
+					{
+						if(cc != line.end
+							&& *cc == '{')
+						{
+							cc++;
+							maybeAddTextNode(file, spanBegin, spanEnd);
+							/*
+
+							We create a node to represent
+							the splice. The nodes we add
+							until it is closed are its
+							children.
+
+							*/
+							spliceNode = file->nodeCount;
+							addNode(file, kTemplateNodeFlavor_EscapeExpr);
+
+							spanBegin = cc;
+							state = kTemplateParseState_InExprEscape;
+						}
+					}
+					break;
+
+				case kTemplateParseState_InExprEscape:
+					if(cc != line.end && *cc == '}')
+					{
+						spanEnd = cc;
+						cc++;
+						maybeAddTextNode(file, spanBegin, spanEnd);
+
+						file->nodes[spliceNode].childCount =
+							file->nodeCount - spliceNode - 1;
+
+						spanBegin = cc;
+						state = kTemplateParseState_Default;
+					}
+					break;
+				}
+			}
+			addTextNode(file, spanBegin, line.end)->flavor = kTemplateNodeFlavor_TextAndNewline;
+		}
+	}
+
+	if(state == kTemplateParseState_InExprEscape)
+	{
+		file->nodes[spliceNode].childCount =
+			file->nodeCount - spliceNode - 1;
+	}
+
+	chunk->nodeCount = file->nodeCount - chunk->firstNode;
+	return 1;
+}
+
+StringSpan commonPrefix(
+	StringSpan left,
+	StringSpan right)
+{
+	char const* ll = left.begin;
+	char const* rr = right.begin;
+
+	StringSpan prefix;
+	prefix.begin = ll;
+
+	for(;;)
+	{
+		if(ll == left.end)
+			break;
+		if(rr == right.end)
+			break;
+
+		if(*ll != *rr)
+			break;
+
+		ll++;
+		rr++;
+	}
+
+	prefix.end = ll;
+	return prefix;
+}
+
+static int parseTemplateFile(
+	ParsedFile*	file,
+	char const* begin,
+	char const* end)
+{
+	Chunk* chunk = addChunk(file);
+
+	StringSpan code;
+	code.begin = begin;
+	code.end = end;
+
+	StringSpan prefix = emptyStringSpan();
+
+	return parseTemplate(
+		file,
+		chunk,
+		code,
+		prefix);
+}
+
+/*
+
+The parsing of a source file with embedded templates
+uses a little state machine, so that we can issue
+useful error messages when people leave out directives
+(or misspell them, etc.).
+
+*/
+typedef enum SourceFileParseState SourceFileParseState;
+enum SourceFileParseState
+{
+	kSourceFileParseState_Initial,
+	kSourceFileParseState_Default,
+	kSourceFileParseState_InTemplateCode,
+	kSourceFileParseState_InTemplateOutput,
+};
+/*
+
+The `parseSourceFile()` function is responsible for
+reading the text of a source file (possibly with embedded
+templates) into a sequence of "chunks", which are
+appended to `file`. It returns zero if the file has
+no embedded templates, or if parsing failed.
+
+*/
+static int parseSourceFile(
+	ParsedFile*	file,
+	char const* begin,
+	char const* end)
+{
+	/*
+
+	We will use the variable `cursor` to track
+	our progress through the input text.
+
+	*/
+	SourceFileParseState state = kSourceFileParseState_Initial;
+	char const* cursor = begin;
+	/*
+
+	There will always be at least one chunk,
+	even in a file with no templates, so
+	we'll start the first one here.
+
+	*/
+	Chunk* chunk = addChunk(file);
+	chunk->prefix.begin = cursor;
+	/*
+
+	With the preliminaries out of the way, we are
+	going to start scaning through the file.
+
+	*/
+	for(;;)
+	{
+		/*
+	
+		If we've reached the end of the input text,
+		then we are done parsing, and need to bail
+		out of this loop.
+
+		*/
+		if(cursor == end)
+			break;
+		/*
+
+		Unless we are inside template code (where every
+		line matters), the only lines we care about are
+		marker lines, so we skip straight to the line
+		containing the next marker.
+
+		On the first iteration this also serves as a
+		whole-file check: a file without any markers is
+		rejected after a single scan, without ever being
+		split into lines.
+
+		*/
+		if(state != kSourceFileParseState_InTemplateCode)
+		{
+			MarkerKind kind;
+			char const* marker = findMarker(cursor, end, &kind);
+			if(!marker)
+				break;
+
+			cursor = findLineStart(cursor, marker);
+		}
+		/*
+
+		Otherwise, we'll read in the next line of
+		the file, and see if it looks like the start
+		of a template.
+
+		*/
+		StringSpan line = readLine(&cursor, end);
+		unsigned markers = findLineMarkers(line);
+		if(markers & kMarkerKind_Template)
+		{
+			/*
+
+			
+
+			*/
+			switch(state)
+			{
+			case kSourceFileParseState_Initial:
+			case kSourceFileParseState_Default:
+				chunk->code.begin = cursor;
+				chunk->linePrefix = line;
+				state = kSourceFileParseState_InTemplateCode;
+				break;
+
+			case kSourceFileParseState_InTemplateCode:
+			case kSourceFileParseState_InTemplateOutput:
+				fiddle_error("starting new template without ending previous one");
+				return 0;
+			}
+
+			continue;
+		}
+
+		if(markers & kMarkerKind_Output)
+		{
+			/*
+			*/
+			switch(state)
+			{
+			case kSourceFileParseState_InTemplateCode:
+				chunk->code.end = line.begin;
+				chunk->prefix.end = cursor;
+				chunk->outputSpan.begin = cursor;
+				chunk->linePrefix = commonPrefix(line, chunk->linePrefix);
+				state = kSourceFileParseState_InTemplateOutput;
+				break;
+
+			case kSourceFileParseState_Initial:
+			case kSourceFileParseState_Default:
+			case kSourceFileParseState_InTemplateOutput:
+				fiddle_error("'OUTPUT' tag without 'TEMPLATE'");
+				return 0;
+
+			}
+		}
+
+		if(markers & kMarkerKind_End)
+		{
+			/*
+			*/
 			switch(state)
 			{
-			case kSourceFileParseState_Initial:
-			case kSourceFileParseState_Default:
-				chunk->code.begin = cursor;
-				chunk->linePrefix = line;
-				state = kSourceFileParseState_InTemplateCode;
+			case kSourceFileParseState_InTemplateOutput:
+				/*
+
+				Okay, we've reached the end of an embedded
+				template, and we need to finish up
+				the current chunk and start a new one.
+
+				*/
+				chunk->outputSpan.end = line.begin;
+				/*
+
+				Failure to parse the template should
+				count as a failure for the overall
+				file.
+
+				*/
+				if(!parseTemplate(
+					file,
+					chunk,
+					chunk->code,
+					chunk->linePrefix))
+				{
+					return 0;
+				}
+
+				/*
+
+				State a new chunk.
+
+				*/
+				chunk = addChunk(file);
+				chunk->prefix.begin = line.begin;
+				state = kSourceFileParseState_Default;
+				break;
+
+			case kSourceFileParseState_Initial:
+			case kSourceFileParseState_Default:
+				fiddle_error("'END' tag without 'TEMPLATE'");
+				return 0;
+			case kSourceFileParseState_InTemplateCode:
+				fiddle_error("'END' tag without 'OUTPUT'");
+				return 0;
+
+			}
+		}
+		/*
+
+		If none of the above cases matched, then this
+		is an "ordinary" line.
+
+		*/
+		switch(state)
+		{
+		default:
+			break;
+
+		case kSourceFileParseState_InTemplateCode:
+			chunk->linePrefix = commonPrefix(line, chunk->linePrefix);
+			break;
+		}
+	}
+	/*
+
+	We've reached the end of the file.
+	If we never ran into any embedded templates,
+	then there is no point in processing this file
+	further, and we should bail.
+
+	*/
+	if(state == kSourceFileParseState_Initial)
+		return 0;
+	/*
+
+	Otherwise we need to terminate the last
+	chunk, which has no template of its own.
+
+	*/
+	chunk->prefix.end = end;
+	chunk->code.begin = end;
+	chunk->code.end = end;
+	chunk->outputSpan.begin = end;
+	chunk->outputSpan.end = end;
+	chunk->firstNode = file->nodeCount;
+	chunk->nodeCount = 0;
+	return 1;
+}
+
+
+
+static int stringEndsWith(
+	char const*	str,
+	char const*	suffix)
+{
+	size_t strSize = strlen(str);
+	size_t suffixSize = strlen(suffix);
+	if(strSize < suffixSize)
+		return 0;		
+
+	return strcmp(
+		str + strSize - suffixSize,
+		suffix) == 0;
+}
+
+static char* pickOutputPath(
+	char const* inputPath,
+	char const* suffix)
+{
+	assert(stringEndsWith(inputPath, suffix));
+
+	size_t inputSize = strlen(inputPath);
+	size_t suffixSize = strlen(suffix);
+
+	size_t trimmedSize = inputSize - suffixSize;
+
+	char* buffer = (char*) malloc(trimmedSize + 1);
+	if(!buffer)
+		return NULL;
+
+	memcpy(buffer, inputPath, trimmedSize);
+	buffer[trimmedSize] = 0;
+
+	return buffer;
+}
+
+/*
+
+### Statistics
+
+With `--stats` (or `--stats-json <path>`) we report, for
+each file, how long each phase of processing it took,
+and how much it produced along the way: reading the
+input, parsing it, generating the Lua code, loading that
+code (or its cached bytecode), running it, and writing
+the output. Output streamed while the templates run is
+counted as running them. Phases don't account for
+everything (looking up the output cache, say), so the
+total can be larger than their sum.
+
+Times come from a monotonic clock, so changes to the
+system time don't affect them. Each thread points
+`tFileStats` at the statistics of the file it is working
+on, which are reported along with its diagnostics; when
+it is `NULL` we don't read the clock at all.
+
+*/
+typedef enum StatsPhase
+{
+	kStatsPhase_Read,
+	kStatsPhase_Parse,
+	kStatsPhase_Generate,
+	kStatsPhase_Load,
+	kStatsPhase_Run,
+	kStatsPhase_Write,
+	kStatsPhaseCount,
+} StatsPhase;
+
+static char const* const kStatsPhaseNames[kStatsPhaseCount] =
+{
+	"read", "parse", "generate", "load", "run", "write",
+};
+
+typedef enum StatsCounter
+{
+	kStatsCounter_InputBytes,
+	kStatsCounter_Chunks,
+	kStatsCounter_Nodes,
+	kStatsCounter_LuaBytes,
+	kStatsCounter_RawCalls,
+	kStatsCounter_SpliceCalls,
+	kStatsCounter_OutputBytes,
+	kStatsCounterCount,
+} StatsCounter;
+
+static char const* const kStatsCounterNames[kStatsCounterCount] =
+{
+	"inputBytes", "chunks", "nodes", "luaBytes", "rawCalls", "spliceCalls", "outputBytes",
+};
+
+typedef struct FileStats
+{
+	/* Whether the file was read (and is worth reporting) */
+	int			processed;
+
+	/* In nanoseconds */
+	uint64_t	totalTime;
+	uint64_t	phaseTimes[kStatsPhaseCount];
+
+	uint64_t	counts[kStatsCounterCount];
+} FileStats;
+
+static FIDDLE_THREAD_LOCAL FileStats* tFileStats = NULL;
+static int gPrintStats = 0;
+static char const* gStatsJsonPath = NULL;
+
+static uint64_t readClock()
+{
+#ifdef _WIN32
+	LARGE_INTEGER frequency;
+	LARGE_INTEGER counter;
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&counter);
+	uint64_t ticks = (uint64_t) counter.QuadPart;
+	uint64_t rate = (uint64_t) frequency.QuadPart;
+	return (ticks / rate) * 1000000000u + (ticks % rate) * 1000000000u / rate;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+#endif
+}
+
+/*
+
+`endStatsPhase()` adds the time since `start` to `phase`,
+and returns the current time, which is where the next
+phase starts.
+
+*/
+static uint64_t endStatsPhase(
+	FileStats*	stats,
+	StatsPhase	phase,
+	uint64_t	start)
+{
+	if(!stats)
+		return 0;
+	uint64_t now = readClock();
+	stats->phaseTimes[phase] += now - start;
+	return now;
+}
+
+/*
+
+A `StatsReport` adds up the statistics of the files
+processed by one command line, in the order they are
+reported, and holds the JSON for each of them until
+we write the whole report.
+
+*/
+typedef struct StatsReport
+{
+	FileStats	total;
+	size_t		fileCount;
+	TextBuffer	json;
+} StatsReport;
+
+static void appendFormattedText(
+	TextBuffer*	buffer,
+	char const*	format,
+	...)
+{
+	char text[256];
+	va_list args;
+	va_start(args, format);
+	int size = vsnprintf(text, sizeof(text), format, args);
+	va_end(args);
+	assert(size >= 0 && (size_t) size < sizeof(text));
+	appendText(buffer, text, (size_t) size);
+}
+
+static void appendJsonString(
+	TextBuffer*	buffer,
+	char const*	text)
+{
+	appendText(buffer, "\"", 1);
+	for(char const* cursor = text; *cursor; cursor++)
+	{
+		unsigned char c = (unsigned char) *cursor;
+		if(c == '"' || c == '\\')
+		{
+			appendText(buffer, "\\", 1);
+			appendText(buffer, cursor, 1);
+		}
+		else if(c < 0x20)
+			appendFormattedText(buffer, "\\u%04x", c);
+		else
+			appendText(buffer, cursor, 1);
+	}
+	appendText(buffer, "\"", 1);
+}
+
+static void appendStatsJson(
+	TextBuffer*			buffer,
+	FileStats const*	stats)
+{
+	appendFormattedText(buffer, "\"nanoseconds\": {\"total\": %llu",
+		(unsigned long long) stats->totalTime);
+	for(int ii = 0; ii < kStatsPhaseCount; ii++)
+	{
+		appendFormattedText(buffer, ", \"%s\": %llu",
+			kStatsPhaseNames[ii], (unsigned long long) stats->phaseTimes[ii]);
+	}
+	appendText(buffer, "}", 1);
+	for(int ii = 0; ii < kStatsCounterCount; ii++)
+	{
+		appendFormattedText(buffer, ", \"%s\": %llu",
+			kStatsCounterNames[ii], (unsigned long long) stats->counts[ii]);
+	}
+}
+
+/*
+
+`printStats()` prints the statistics for `name` (a
+quoted path, or a count of files) in two lines: one
+with the time spent in each phase, in milliseconds, and
+one with the counters.
+
+*/
+static void printStats(
+	char const*			name,
+	FileStats const*	stats)
+{
+	fprintf(stderr, "fiddle: stats: %s: %.3f ms (", name, stats->totalTime / 1e6);
+	for(int ii = 0; ii < kStatsPhaseCount; ii++)
+	{
+		fprintf(stderr, "%s%s %.3f", ii ? ", " : "",
+			kStatsPhaseNames[ii], stats->phaseTimes[ii] / 1e6);
+	}
+	fprintf(stderr, ")\n");
+
+	uint64_t const* counts = stats->counts;
+	fprintf(stderr,
+		"fiddle: stats: %s: %llu bytes in, %llu chunks, %llu nodes, "
+		"%llu bytes of Lua, %llu _RAW and %llu _SPLICE calls, %llu bytes out\n",
+		name,
+		(unsigned long long) counts[kStatsCounter_InputBytes],
+		(unsigned long long) counts[kStatsCounter_Chunks],
+		(unsigned long long) counts[kStatsCounter_Nodes],
+		(unsigned long long) counts[kStatsCounter_LuaBytes],
+		(unsigned long long) counts[kStatsCounter_RawCalls],
+		(unsigned long long) counts[kStatsCounter_SpliceCalls],
+		(unsigned long long) counts[kStatsCounter_OutputBytes]);
+}
+
+static void reportFileStats(
+	StatsReport*		report,
+	char const*			path,
+	FileStats const*	stats)
+{
+	if(!stats->processed)
+		return;
+
+	FileStats* total = &report->total;
+	total->totalTime += stats->totalTime;
+	for(int ii = 0; ii < kStatsPhaseCount; ii++)
+		total->phaseTimes[ii] += stats->phaseTimes[ii];
+	for(int ii = 0; ii < kStatsCounterCount; ii++)
+		total->counts[ii] += stats->counts[ii];
+
+	if(gPrintStats)
+	{
+		char* name = (char*) malloc(strlen(path) + 3);
+		if(!name)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		sprintf(name, "'%s'", path);
+		printStats(name, stats);
+		fflush(stderr);
+		free(name);
+	}
+
+	if(gStatsJsonPath)
+	{
+		if(report->fileCount)
+			appendText(&report->json, ",", 1);
+		appendText(&report->json, "\n    {\"path\": ", 14);
+		appendJsonString(&report->json, path);
+		appendText(&report->json, ", ", 2);
+		appendStatsJson(&report->json, stats);
+		appendText(&report->json, "}", 1);
+	}
+	report->fileCount++;
+}
+
+/*
+
+`finishStatsReport()` prints the totals, and writes the
+JSON report, whose `files` array has an object for
+each file (with its `path`, a `nanoseconds` object with
+the time of each phase, and the counters), and whose
+`total` object adds them up (and counts the `files`).
+
+*/
+static void finishStatsReport(
+	StatsReport*	report)
+{
+	if(gPrintStats)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "%llu file%s",
+			(unsigned long long) report->fileCount, report->fileCount == 1 ? "" : "s");
+		printStats(name, &report->total);
+	}
+
+	if(gStatsJsonPath)
+	{
+		TextBuffer json;
+		memset(&json, 0, sizeof(TextBuffer));
+		appendText(&json, "{\n  \"files\": [", 14);
+		if(report->json.size)
+			appendText(&json, report->json.data, report->json.size);
+		appendText(&json, "\n  ],\n", 6);
+		appendFormattedText(&json, "  \"total\": {\"files\": %llu, ",
+			(unsigned long long) report->fileCount);
+		appendStatsJson(&json, &report->total);
+		appendText(&json, "}\n}\n", 4);
+
+		if(!writeFileAtomically(gStatsJsonPath, json.data, json.data + json.size))
+			reportError("cannot write '%s'", gStatsJsonPath);
+		freeTextBuffer(&json);
+	}
+	freeTextBuffer(&report->json);
+}
+
+/*
+
+### Output Streams
+
+Generated output can be much larger than the input (think
+of tables or data files produced by a short template), so
+rather than accumulating the whole expansion in memory we
+stream it to a temporary file next to the output path, in
+blocks of `kOutputBlockSize` bytes. Once the file is done
+the temporary file replaces the output.
+
+Most of the time, though, the output is exactly what is
+already on disk, and rewriting it would only bump its
+modification time and trigger needless rebuilds of
+everything that depends on it. So as long as the output
+matches the existing file (the `baseline`), we just
+compare the two and write nothing. Only when they first
+differ do we create the temporary file, and copy the
+matching prefix into it from the baseline.
+
+Writes go straight to a file descriptor, and a single
+`write()` may be cut short (Linux never writes more than
+about 2GB in one call), so we loop until everything has
+been written.
+
+*/
+enum
+{
+	kOutputBlockSize = 256 * 1024,
+};
+
+typedef struct OutputStream
+{
+	char const*	path;
+	char const*	modelPath;
+	int			fd;
+	int			failed;
+	uint64_t	size;
+
+	/* Bytes given to the stream, whether written or matched */
+	uint64_t	outputSize;
+
+	StringSpan	baseline;
+	int			hasBaseline;
+	int			diverged;
+	size_t		matched;
+} OutputStream;
+
+static int gFsync = 0;
+
+/*
+
+`initOutputStream()` prepares to write a temporary file
+at `path`, which will replace the file at `modelPath`.
+The temporary file is only created once the output
+differs from `baseline`, if there is one. A stream with
+no `path` never writes anything, and only compares.
+
+*/
+static void initOutputStream(
+	OutputStream*	stream,
+	char const*		path,
+	char const*		modelPath,
+	StringSpan*		baseline)
+{
+	memset(stream, 0, sizeof(OutputStream));
+	stream->path = path;
+	stream->modelPath = modelPath;
+	stream->fd = -1;
+	if(baseline)
+	{
+		stream->baseline = *baseline;
+		stream->hasBaseline = 1;
+	}
+	else
+	{
+		stream->diverged = 1;
+	}
+}
+
+static int openOutputStreamFile(
+	OutputStream*	stream)
+{
+#ifdef _WIN32
+	stream->fd = _open(stream->path,
+		_O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY,
+		_S_IREAD | _S_IWRITE);
+#else
+	stream->fd = open(stream->path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+	/*
+
+	When we replace an existing file, the new file
+	should keep its permissions (e.g., a generated
+	script that is executable).
+
+	*/
+	struct stat info;
+	if(stream->fd >= 0 && stream->modelPath && stat(stream->modelPath, &info) == 0)
+		fchmod(stream->fd, info.st_mode & 07777);
+#endif
+	if(stream->fd < 0)
+		stream->failed = 1;
+	return stream->fd >= 0;
+}
+
+static void writeStreamFile(
+	OutputStream*	stream,
+	StringSpan*		spans,
+	int				spanCount)
+{
+	if(stream->failed || !stream->path)
+		return;
+	if(stream->fd < 0 && !openOutputStreamFile(stream))
+		return;
+#ifdef _WIN32
+	for(int ii = 0; ii < spanCount; ii++)
+	{
+		char const* cursor = spans[ii].begin;
+		while(cursor != spans[ii].end)
+		{
+			size_t size = spans[ii].end - cursor;
+			if(size > (1u << 30))
+				size = 1u << 30;
+			int written = _write(stream->fd, cursor, (unsigned) size);
+			if(written <= 0)
+			{
+				stream->failed = 1;
+				return;
+			}
+			cursor += written;
+			stream->size += written;
+		}
+	}
+#else
+	struct iovec vectors[4];
+	assert(spanCount <= 4);
+
+	int vectorCount = 0;
+	for(int ii = 0; ii < spanCount; ii++)
+	{
+		if(spans[ii].begin == spans[ii].end)
+			continue;
+		vectors[vectorCount].iov_base = (void*) spans[ii].begin;
+		vectors[vectorCount].iov_len = spans[ii].end - spans[ii].begin;
+		vectorCount++;
+	}
+
+	struct iovec* vector = vectors;
+	while(vectorCount)
+	{
+		ssize_t written = writev(stream->fd, vector, vectorCount);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			stream->failed = 1;
+			return;
+		}
+		stream->size += written;
+
+		size_t remaining = (size_t) written;
+		while(vectorCount && remaining >= vector->iov_len)
+		{
+			remaining -= vector->iov_len;
+			vector++;
+			vectorCount--;
+		}
+		if(vectorCount)
+		{
+			vector->iov_base = (char*) vector->iov_base + remaining;
+			vector->iov_len -= remaining;
+		}
+	}
+#endif
+}
+
+/*
+
+`divergeOutputStream()` is called once the output no
+longer matches the baseline. It writes out the part of
+the baseline that did match, along with `spans`.
+
+*/
+static void divergeOutputStream(
+	OutputStream*	stream,
+	StringSpan*		spans,
+	int				spanCount)
+{
+	StringSpan allSpans[4];
+	assert(spanCount < 4);
+
+	allSpans[0].begin = stream->baseline.begin;
+	allSpans[0].end = stream->baseline.begin + stream->matched;
+	for(int ii = 0; ii < spanCount; ii++)
+		allSpans[ii + 1] = spans[ii];
+
+	stream->diverged = 1;
+	writeStreamFile(stream, allSpans, spanCount + 1);
+}
+
+static void writeStreamSpans(
+	OutputStream*	stream,
+	StringSpan*		spans,
+	int				spanCount)
+{
+	for(int ii = 0; ii < spanCount; ii++)
+		stream->outputSize += spans[ii].end - spans[ii].begin;
+
+	if(stream->diverged)
+	{
+		writeStreamFile(stream, spans, spanCount);
+		return;
+	}
+
+	size_t offset = stream->matched;
+	size_t baselineSize = stream->baseline.end - stream->baseline.begin;
+	for(int ii = 0; ii < spanCount; ii++)
+	{
+		size_t size = spans[ii].end - spans[ii].begin;
+		if(size > baselineSize - offset
+			|| memcmp(stream->baseline.begin + offset, spans[ii].begin, size) != 0)
+		{
+			divergeOutputStream(stream, spans, spanCount);
+			return;
+		}
+		offset += size;
+	}
+	stream->matched = offset;
+}
+
+/*
+
+`discardOutputStream()` abandons a stream, removing the
+temporary file if it was created.
+
+*/
+static void discardOutputStream(
+	OutputStream*	stream)
+{
+	if(stream->fd < 0)
+		return;
+#ifdef _WIN32
+	_close(stream->fd);
+#else
+	close(stream->fd);
+#endif
+	stream->fd = -1;
+	remove(stream->path);
+}
+
+/*
+
+`outputStreamMatches()` tells whether everything written
+to the stream so far is exactly its baseline.
+
+*/
+static int outputStreamMatches(
+	OutputStream*	stream)
+{
+	return stream->hasBaseline
+		&& !stream->diverged
+		&& stream->matched == (size_t)(stream->baseline.end - stream->baseline.begin);
+}
+
+typedef enum OutputStreamResult
+{
+	kOutputStream_Failed,
+	kOutputStream_Unchanged,
+	kOutputStream_Written,
+} OutputStreamResult;
+
+/*
+
+`closeOutputStream()` finishes the stream, and tells
+whether the temporary file was written (and so should
+replace the output).
+
+*/
+static OutputStreamResult closeOutputStream(
+	OutputStream*	stream)
+{
+	if(!stream->diverged)
+	{
+		if(stream->matched == (size_t)(stream->baseline.end - stream->baseline.begin))
+			return kOutputStream_Unchanged;
+		divergeOutputStream(stream, NULL, 0);
+	}
+
+	/* An empty output still needs its (empty) file */
+	if(stream->fd < 0 && !stream->failed)
+		openOutputStreamFile(stream);
+	if(stream->fd < 0)
+		return kOutputStream_Failed;
+
+	int ok = !stream->failed;
+#ifdef _WIN32
+	if(ok && gFsync)
+		ok = _commit(stream->fd) == 0;
+	ok = (_close(stream->fd) == 0) && ok;
+#else
+	if(ok && gFsync)
+		ok = fsync(stream->fd) == 0;
+	ok = (close(stream->fd) == 0) && ok;
+#endif
+	stream->fd = -1;
+	return ok ? kOutputStream_Written : kOutputStream_Failed;
+}
+
+/*
+
+A `SkubWriter` either grows its buffer as needed, or (if
+it has a `stream`) flushes the buffer to the stream
+whenever it fills up.
+
+*/
+typedef struct SkubWriter
+{
+	char* cursor;
+	char* begin;
+	char* end;
+
+	OutputStream* stream;
+} SkubWriter;
+
+static void flushWriter(
+	SkubWriter*	writer)
+{
+	if(!writer->stream || writer->cursor == writer->begin)
+		return;
+
+	StringSpan span;
+	span.begin = writer->begin;
+	span.end = writer->cursor;
+	writeStreamSpans(writer->stream, &span, 1);
+	writer->cursor = writer->begin;
+}
+
+/*
+
+`reserveWriter()` makes sure there is room for at least
+`size` more bytes, so that callers can append a whole
+span with a single capacity check.
+
+*/
+static void reserveWriter(
+	SkubWriter*	writer,
+	size_t		size)
+{
+	if((size_t)(writer->end - writer->cursor) >= size)
+		return;
+
+	if(writer->stream)
+	{
+		flushWriter(writer);
+		if((size_t)(writer->end - writer->cursor) >= size)
+			return;
+	}
+
+	char* b = writer->begin;
+	size_t oldOffset = writer->cursor - b;
+	size_t oldSize = writer->end - b;
+	size_t newSize = oldSize ? oldSize * 2 : 1024;
+	if(newSize < oldOffset + size)
+		newSize = oldOffset + size;
+
+	char* n = (char*) realloc(b, newSize);
+	if(!n)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+
+	writer->begin = n;
+	writer->cursor = n + oldOffset;
+	writer->end = n + newSize;
+}
+
+/*
+
+`writeBytes()` appends a span verbatim.
+
+*/
+static void writeBytes(
+	SkubWriter*	writer,
+	char const* begin,
+	char const* end)
+{
+	size_t size = end - begin;
+	if((size_t)(writer->end - writer->cursor) < size
+		&& writer->stream
+		&& size >= (size_t)(writer->end - writer->begin))
+	{
+		/*
+
+		A span that is larger than the whole buffer
+		goes straight to the stream, together with
+		whatever was buffered before it.
+
+		*/
+		StringSpan spans[2];
+		spans[0].begin = writer->begin;
+		spans[0].end = writer->cursor;
+		spans[1].begin = begin;
+		spans[1].end = end;
+		writeStreamSpans(writer->stream, spans, 2);
+		writer->cursor = writer->begin;
+		return;
+	}
+
+	reserveWriter(writer, size);
+	memcpy(writer->cursor, begin, size);
+	writer->cursor += size;
+}
+
+/*
+
+`findCarriageReturn()` returns a pointer to the first
+`'\r'` in the range, or `end` if there is none.
+
+*/
+static char const* findCarriageReturn(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_AVX2
+	{
+		__m256i const cr = _mm256_set1_epi8('\r');
+		while(end - cursor >= 32)
+		{
+			__m256i v = _mm256_loadu_si256((__m256i const*) cursor);
+			unsigned mask = (unsigned) _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, cr));
+			if(mask)
+				return cursor + countTrailingZeros(mask);
+			cursor += 32;
+		}
+	}
+#endif
+#if FIDDLE_USE_SSE2
+	{
+		__m128i const cr = _mm_set1_epi8('\r');
+		while(end - cursor >= 16)
+		{
+			__m128i v = _mm_loadu_si128((__m128i const*) cursor);
+			unsigned mask = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, cr));
+			if(mask)
+				return cursor + countTrailingZeros(mask);
+			cursor += 16;
+		}
+	}
+#endif
+	char const* found = (char const*) memchr(cursor, '\r', end - cursor);
+	return found ? found : end;
+}
+
+/*
+
+`writeRaw()` appends a span while normalizing every line
+break (`\r`, `\n`, `\r\n` or `\n\r`) to a single `\n`.
+
+Text without any `\r` needs no normalization at all,
+so we copy each run up to the next `\r` in bulk, and
+only handle the carriage returns individually.
+
+*/
+static void writeRaw(
+	SkubWriter*	writer,
+	char const* begin,
+	char const* end)
+{
+	char const* cc = begin;
+	while(cc != end)
+	{
+		char const* cr = findCarriageReturn(cc, end);
+		writeBytes(writer, cc, cr);
+
+		if(cr == end)
+			break;
+		/*
+
+		A `\r` directly after a `\n` from the run
+		completes a `\n\r` pair, which has already
+		been written as a single `\n`.
+
+		*/
+		if(cr != cc && cr[-1] == '\n')
+		{
+			cc = cr + 1;
+			continue;
+		}
+
+		writeBytes(writer, "\n", "\n" + 1);
+		cc = cr + 1;
+		if(cc != end && *cc == '\n')
+			cc++;
+	}
+}
+
+/*
+
+`writeRawT()` appends a NUL-terminated string literal.
+The literals we generate never contain `\r`, so they
+can be copied verbatim.
+
+*/
+static void writeRawT(
+	SkubWriter*	writer,
+	char const* begin)
+{
+	writeBytes(writer, begin, begin + strlen(begin));
+}
+
+/*
+
+`writeRawLineBreaks()` is like `writeRaw()`, but normalizes
+every line break to `lineBreak` (`\r\n` or `\r`) instead.
+
+*/
+static void writeRawLineBreaks(
+	SkubWriter*	writer,
+	char const* begin,
+	char const* end,
+	char const*	lineBreak)
+{
+	char const* lineBreakEnd = lineBreak + strlen(lineBreak);
+	char const* cc = begin;
+	for(;;)
+	{
+		char const* lineEnd = findLineBreak(cc, end);
+		writeBytes(writer, cc, lineEnd);
+		if(lineEnd == end)
+			break;
+
+		cc = lineEnd;
+		char c = *cc++;
+		if(cc != end)
+		{
+			char d = *cc;
+			if((c ^ d) == ('\r' ^ '\n'))
+				cc++;
+		}
+		writeBytes(writer, lineBreak, lineBreakEnd);
+	}
+}
+
+static void writeNewlines(
+	SkubWriter*	writer,
+	size_t		count)
+{
+	while(count)
+	{
+		size_t size = count < 4096 ? count : 4096;
+		reserveWriter(writer, size);
+		memset(writer->cursor, '\n', size);
+		writer->cursor += size;
+		count -= size;
+	}
+}
+
+/*
+
+`writeQuotedContents()` writes text as the contents of a
+double-quoted Lua string literal. Template text never
+contains line breaks, so only backslashes and quotes
+need to be escaped.
+
+*/
+static void writeQuotedContents(
+	SkubWriter*	writer,
+	char const* begin,
+	char const* end)
+{
+	char const* cursor = begin;
+	char const* runBegin = begin;
+	while(cursor != end)
+	{
+		char c = *cursor;
+		if(c == '\\' || c == '"')
+		{
+			writeBytes(writer, runBegin, cursor);
+			char escaped[2] = { '\\', c };
+			writeBytes(writer, escaped, escaped + 2);
+			runBegin = cursor + 1;
+		}
+		cursor++;
+	}
+	writeBytes(writer, runBegin, end);
+}
+
+/*
+
+`emitStaticRun()` emits a single `_RAW` call for a run of
+adjacent text nodes, merging their text (and the line
+breaks after full lines) into one string literal. A loop
+body made of plain lines thus costs one call per
+iteration, rather than two per line.
+
+The literal becomes a constant of the generated function,
+so it is loaded without any allocation each time the
+call is made.
+
+Each line break is written as a backslash followed by a
+real newline, so the generated code keeps one line per
+template line, and error messages keep pointing at the
+right line of the input.
+
+A very long run is split into several calls, once the
+literal reaches `kGeneratedBlockSize` bytes, so that the
+code we generate comes in pieces of bounded size.
+
+It returns a pointer to the first node after the run.
+
+*/
+enum
+{
+	kGeneratedBlockSize = 64 * 1024,
+};
+
+static TemplateNode* emitStaticRun(
+	SkubWriter*		writer,
+	TemplateNode*	nodes,
+	TemplateNode*	end)
+{
+	writeRawT(writer, " _RAW(\"");
+	size_t runStart = writer->cursor - writer->begin;
+
+	TemplateNode* nn = nodes;
+	for(; nn != end; nn++)
+	{
+		if((size_t)(writer->cursor - writer->begin) - runStart >= kGeneratedBlockSize)
+			break;
+
+		if(nn->flavor == kTemplateNodeFlavor_Text)
+		{
+			writeQuotedContents(writer, nn->text.begin, nn->text.end);
+		}
+		else if(nn->flavor == kTemplateNodeFlavor_TextAndNewline)
+		{
+			writeQuotedContents(writer, nn->text.begin, nn->text.end);
+			writeRawT(writer, "\\\n");
+		}
+		else
+		{
+			break;
+		}
+	}
+
+	writeRawT(writer, "\");");
+	return nn;
+}
+
+static int isEmpty(StringSpan span)
+{
+	return span.begin == span.end;
+}
+
+static void emitSpliceExpr(
+	SkubWriter*		writer,
+	TemplateNode*	nodes,
+	size_t			nodeCount)
+{
+	TemplateNode* end = nodes + nodeCount;
+	for(TemplateNode* nn = nodes; nn != end; nn++)
+	{
+		switch(nn->flavor)
+		{
+		case kTemplateNodeFlavor_Text:
+			writeRaw(
+				writer,
+				nn->text.begin,
+				nn->text.end);
+			break;
+
+		case kTemplateNodeFlavor_TextAndNewline:
+			writeRaw(
+				writer,
+				nn->text.begin,
+				nn->text.end);
+			writeRawT(
+				writer,
+				"\n");
+			break;
+
+		default:
+			assert(!"unimplemented");
+			break;
+		}
+	}
+}
+
+/*
+
+`emitTemplateItem()` emits the code for one item of a
+template: a run of static text, a line of Lua code, or
+a splice. It returns a pointer to the first node after
+the item.
+
+*/
+static TemplateNode* emitTemplateItem(
+	SkubWriter*		writer,
+	TemplateNode*	nn,
+	TemplateNode*	end)
+{
+	switch(nn->flavor)
+	{
+	case kTemplateNodeFlavor_Text:
+	case kTemplateNodeFlavor_TextAndNewline:
+		return emitStaticRun(
+			writer,
+			nn,
+			end);
+
+	case kTemplateNodeFlavor_Escape:
+		writeRaw(
+			writer,
+			nn->text.begin,
+			nn->text.end);
+		writeRawT(
+			writer,
+			"\n");
+		break;
+
+	case kTemplateNodeFlavor_EscapeExpr:
+		writeRawT(writer, "_SPLICE(");
+		emitSpliceExpr(writer, nn + 1, nn->childCount);
+		writeRawT(writer, "); ");
+		nn += nn->childCount;
+		break;
+
+	default:
+		assert(!"unimplemented");
+		break;
+	}
+	return nn + 1;
+}
+
+/*
+
+`countChunkLines()` records how many lines of input
+each chunk skips before and after its template source
+(the latter including the old template output).
+
+*/
+static void countChunkLines(
+	ParsedFile*	file)
+{
+	for(size_t ii = 0; ii < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		chunk->prefixLineCount = countLineBreaks(chunk->prefix.begin, chunk->code.begin);
+		chunk->suffixLineCount = countLineBreaks(chunk->code.end, chunk->prefix.end)
+			+ countLineBreaks(chunk->outputSpan.begin, chunk->outputSpan.end);
+	}
+}
+
+/*
+
+### Generating Lua Code
+
+The Lua code for a file is generated incrementally, as
+the Lua parser asks for more input: `luaGenerateCallback()`
+is a `lua_Reader` that produces the next block of code
+each time it is called, so the generated program never
+exists as a whole in memory.
+
+The text of the file outside of templates (including the
+template source and the marker lines) is never handed to
+Lua. Instead, each chunk starts with a `_PASS(n)` call,
+which copies the chunk's prefix straight from the input
+buffer into the output, byte for byte. The previous
+output of each template is simply dropped.
+
+We still emit one newline for every line we skip, so
+that line numbers in Lua error messages match the
+lines of the input file.
+
+*/
+typedef enum GeneratorPhase
+{
+	kGeneratorPhase_Prologue,
+	kGeneratorPhase_ChunkBegin,
+	kGeneratorPhase_PrefixLines,
+	kGeneratorPhase_Template,
+	kGeneratorPhase_SuffixLines,
+	kGeneratorPhase_Done,
+} GeneratorPhase;
+
+typedef struct LuaGenerator
+{
+	ParsedFile*		file;
+	SkubWriter		writer;
+	GeneratorPhase	phase;
+	size_t			chunkIndex;
+	TemplateNode*	node;
+	size_t			pendingLines;
+
+	/* For `--stats` */
+	uint64_t		generatedSize;
+	uint64_t		generateTime;
+} LuaGenerator;
+
+static void initLuaGenerator(
+	LuaGenerator*	generator,
+	ParsedFile*		file)
+{
+	memset(generator, 0, sizeof(LuaGenerator));
+	generator->file = file;
+	generator->phase = kGeneratorPhase_Prologue;
+	reserveWriter(&generator->writer, 2 * kGeneratedBlockSize);
+}
+
+static void freeLuaGenerator(
+	LuaGenerator*	generator)
+{
+	free(generator->writer.begin);
+}
+
+/*
+
+`generateStep()` emits the next piece of code into the
+generator's writer, and returns zero once all of the
+code has been generated.
+
+*/
+static int generateStep(
+	LuaGenerator*	generator)
+{
+	SkubWriter* writer = &generator->writer;
+	ParsedFile* file = generator->file;
+	Chunk* chunk = &file->chunks[generator->chunkIndex];
+
+	switch(generator->phase)
+	{
+	case kGeneratorPhase_Prologue:
+		writeRawT(writer,
+			"local _OUT, _RAW, _SPLICE, _PASS = ...; ");
+		writeRawT(writer,
+			"fiddle_write = _RAW; fiddle_output = _OUT; ");
+		generator->phase = kGeneratorPhase_ChunkBegin;
+		break;
+
+	case kGeneratorPhase_ChunkBegin:
+		if(generator->chunkIndex == file->chunkCount)
+		{
+			generator->phase = kGeneratorPhase_Done;
+			return 0;
+		}
+		if(chunk->prefix.begin != chunk->prefix.end)
+		{
+			char buffer[64];
+			snprintf(buffer, sizeof(buffer), " _PASS(%u);", (unsigned) generator->chunkIndex);
+			writeRawT(writer, buffer);
+		}
+		generator->pendingLines = chunk->prefixLineCount;
+		generator->node = file->nodes + chunk->firstNode;
+		generator->phase = kGeneratorPhase_PrefixLines;
+		break;
+
+	case kGeneratorPhase_PrefixLines:
+	case kGeneratorPhase_SuffixLines:
+		if(generator->pendingLines)
+		{
+			size_t count = generator->pendingLines;
+			if(count > kGeneratedBlockSize)
+				count = kGeneratedBlockSize;
+			writeNewlines(writer, count);
+			generator->pendingLines -= count;
+		}
+		else if(generator->phase == kGeneratorPhase_PrefixLines)
+		{
+			generator->phase = kGeneratorPhase_Template;
+		}
+		else
+		{
+			generator->chunkIndex++;
+			generator->phase = kGeneratorPhase_ChunkBegin;
+		}
+		break;
+
+	case kGeneratorPhase_Template:
+		{
+			TemplateNode* end = file->nodes + chunk->firstNode + chunk->nodeCount;
+			if(generator->node != end)
+			{
+				generator->node = emitTemplateItem(writer, generator->node, end);
+			}
+			else
+			{
+				generator->pendingLines = chunk->suffixLineCount;
+				generator->phase = kGeneratorPhase_SuffixLines;
+			}
+		}
+		break;
+
+	case kGeneratorPhase_Done:
+		return 0;
+	}
+	return 1;
+}
+
+static char const* luaGenerateCallback(
+	lua_State*	L,
+	void*		userData,
+	size_t*		size)
+{
+	(void) L;
+	LuaGenerator* generator = (LuaGenerator*) userData;
+	SkubWriter* writer = &generator->writer;
+	uint64_t start = tFileStats ? readClock() : 0;
+
+	writer->cursor = writer->begin;
+	while((size_t)(writer->cursor - writer->begin) < kGeneratedBlockSize)
+	{
+		if(!generateStep(generator))
+			break;
+	}
+
+	*size = writer->cursor - writer->begin;
+	generator->generatedSize += *size;
+	if(tFileStats)
+		generator->generateTime += readClock() - start;
+	return writer->begin;
+}
+
+static char const* luaReadCallback(
+	lua_State* L,
+	void* userData,
+	size_t*	size)
+{
+	StringSpan* spanPtr = (StringSpan*) userData;
+	StringSpan span = *spanPtr;
+
+	spanPtr->begin = NULL;
+	spanPtr->end = NULL;
+
+	*size = span.end - span.begin;
+	return span.begin;
+}
+
+/*
+
+The line break style of an input file. Text produced
+by templates follows the style of the file's first
+line break.
+
+*/
+typedef enum LineEnding
+{
+	kLineEnding_LF,
+	kLineEnding_CRLF,
+	kLineEnding_CR,
+} LineEnding;
+
+/*
+
+A `TemplateOutput` is where the generated code for a
+file sends its output. Text produced by templates has
+its line breaks normalized to the style used by the
+input file, while `_PASS` copies input text verbatim.
+
+*/
+typedef struct TemplateOutput
+{
+	SkubWriter	writer;
+	ParsedFile*	parsed;
+	LineEnding	lineEnding;
+
+	/* When stamping, where each chunk's `_PASS()` began */
+	size_t*		passOffsets;
+	size_t		passCount;
+
+	/* For `--stats` */
+	uint64_t	rawCallCount;
+	uint64_t	spliceCallCount;
+} TemplateOutput;
+
+/*
+
+`detectLineEnding()` returns the style of the first line
+break in the text, which is `\n` if there is none.
+
+*/
+static LineEnding detectLineEnding(
+	StringSpan	text)
+{
+	char const* lineBreak = findLineBreak(text.begin, text.end);
+	if(lineBreak == text.end || lineBreak[0] == '\n')
+		return kLineEnding_LF;
+	if(lineBreak + 1 != text.end && lineBreak[1] == '\n')
+		return kLineEnding_CRLF;
+	return kLineEnding_CR;
+}
+
+static void writeTemplateText(
+	TemplateOutput*	output,
+	char const*		begin,
+	char const*		end)
+{
+	switch(output->lineEnding)
+	{
+	case kLineEnding_LF:
+		writeRaw(&output->writer, begin, end);
+		break;
+	case kLineEnding_CRLF:
+		writeRawLineBreaks(&output->writer, begin, end, "\r\n");
+		break;
+	case kLineEnding_CR:
+		writeRawLineBreaks(&output->writer, begin, end, "\r");
+		break;
+	}
+}
+
+/*
+
+### Output Buffer
+
+The generated code for a file receives its output buffer
+as a userdata object, which templates can also reach as
+the global `fiddle_output`. Besides the `_RAW`, `_SPLICE`
+and `_PASS` functions (which are bound to the buffer as
+locals of the generated code) it offers bulk methods:
+
+* `fiddle_output:write(...)` writes each of its arguments.
+* `fiddle_output:writef(format, ...)` writes the result
+  of `string.format(format, ...)`.
+* `fiddle_output:writeint(i)` and `:writenumber(n)` write
+  a number.
+
+Strings and numbers are written without creating any
+new Lua strings, and produce the same text that
+`tostring()` would. Other values go through `tostring()`
+semantics (including `__tostring`).
+
+The userdata only holds a pointer to the `TemplateOutput`,
+which is cleared once the file is done, so that a
+template that holds on to the buffer gets an error
+rather than a crash.
+
+*/
+static char const kOutputBufferTypeName[] = "fiddle.output";
+
+static TemplateOutput* getOutputFromSlot(
+	lua_State*			L,
+	TemplateOutput**	slot)
+{
+	if(!slot || !*slot)
+		luaL_error(L, "output buffer is no longer valid");
+	return *slot;
+}
+
+static TemplateOutput* checkTemplateOutput(
+	lua_State*	L,
+	int			index)
+{
+	return getOutputFromSlot(L,
+		(TemplateOutput**) luaL_checkudata(L, index, kOutputBufferTypeName));
+}
+
+static TemplateOutput* getUpvalueTemplateOutput(
+	lua_State*	L)
+{
+	return getOutputFromSlot(L,
+		(TemplateOutput**) lua_touserdata(L, lua_upvalueindex(1)));
+}
+
+static void writeLuaInteger(
+	TemplateOutput*	output,
+	lua_Integer		value)
+{
+	char buffer[32];
+	char* end = buffer + sizeof(buffer);
+	char* cursor = end;
+
+	lua_Unsigned magnitude = value < 0
+		? (lua_Unsigned) 0 - (lua_Unsigned) value
+		: (lua_Unsigned) value;
+	do
+	{
+		*--cursor = (char)('0' + (magnitude % 10));
+		magnitude /= 10;
+	} while(magnitude);
+
+	if(value < 0)
+		*--cursor = '-';
+
+	writeBytes(&output->writer, cursor, end);
+}
+
+/*
+
+Floats are formatted the way Lua's `tostring()` does it,
+including adding `.0` to values that would otherwise
+look like integers.
+
+*/
+static void writeLuaFloat(
+	TemplateOutput*	output,
+	lua_Number		value)
+{
+	char buffer[64];
+	int size = lua_number2str(buffer, sizeof(buffer) - 2, value);
+	if(size < 0)
+		return;
+	if((size_t) size > sizeof(buffer) - 3)
+		size = sizeof(buffer) - 3;
+
+	if(buffer[strspn(buffer, "-0123456789")] == '\0')
+	{
+		buffer[size++] = lua_getlocaledecpoint();
+		buffer[size++] = '0';
+	}
+
+	writeBytes(&output->writer, buffer, buffer + size);
+}
+
+static void writeLuaValue(
+	lua_State*		L,
+	TemplateOutput*	output,
+	int				index)
+{
+	size_t len = 0;
+	char const* text;
+	switch(lua_type(L, index))
+	{
+	case LUA_TSTRING:
+		text = lua_tolstring(L, index, &len);
+		writeTemplateText(output, text, text + len);
+		break;
+
+	case LUA_TNUMBER:
+		if(lua_isinteger(L, index))
+			writeLuaInteger(output, lua_tointeger(L, index));
+		else
+			writeLuaFloat(output, lua_tonumber(L, index));
+		break;
+
+	default:
+		text = luaL_tolstring(L, index, &len);
+		writeTemplateText(output, text, text + len);
+		lua_pop(L, 1);
+		break;
+	}
+}
+
+static int luaRawCallback(lua_State* L)
+{
+	TemplateOutput* output = getUpvalueTemplateOutput(L);
+	output->rawCallCount++;
+	writeLuaValue(L, output, 1);
+	return 0;
+}
+
+static int luaSpliceCallback(lua_State* L)
+{
+	TemplateOutput* output = getUpvalueTemplateOutput(L);
+	output->spliceCallCount++;
+	writeLuaValue(L, output, 1);
+	return 0;
+}
+
+static int luaPassCallback(lua_State* L)
+{
+	TemplateOutput* output = getUpvalueTemplateOutput(L);
+
+	lua_Integer index = luaL_checkinteger(L, 1);
+	luaL_argcheck(L,
+		index >= 0 && (size_t) index < output->parsed->chunkCount,
+		1, "chunk index out of range");
+
+	if(output->passOffsets)
+	{
+		if((size_t) index == output->passCount)
+			output->passOffsets[output->passCount++] = output->writer.cursor - output->writer.begin;
+		else
+			output->passCount = output->parsed->chunkCount + 1;
+	}
+
+	Chunk* chunk = &output->parsed->chunks[index];
+	writeBytes(&output->writer, chunk->prefix.begin, chunk->prefix.end);
+
+	return 0;
+}
+
+static int luaOutputWrite(lua_State* L)
+{
+	TemplateOutput* output = checkTemplateOutput(L, 1);
+	int top = lua_gettop(L);
+	for(int ii = 2; ii <= top; ii++)
+		writeLuaValue(L, output, ii);
+	return 0;
+}
+
+static int luaOutputWritef(lua_State* L)
+{
+	TemplateOutput* output = checkTemplateOutput(L, 1);
+	luaL_checkstring(L, 2);
+
+	/* Call `string.format`, which we keep as an upvalue */
+	int argCount = lua_gettop(L) - 1;
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_rotate(L, 2, 1);
+	lua_call(L, argCount, 1);
+
+	size_t len = 0;
+	char const* text = lua_tolstring(L, -1, &len);
+	writeTemplateText(output, text, text + len);
+	return 0;
+}
+
+static int luaOutputWriteInt(lua_State* L)
+{
+	TemplateOutput* output = checkTemplateOutput(L, 1);
+	writeLuaInteger(output, luaL_checkinteger(L, 2));
+	return 0;
+}
+
+static int luaOutputWriteNumber(lua_State* L)
+{
+	TemplateOutput* output = checkTemplateOutput(L, 1);
+	luaL_checknumber(L, 2);
+	if(lua_isinteger(L, 2))
+		writeLuaInteger(output, lua_tointeger(L, 2));
+	else
+		writeLuaFloat(output, lua_tonumber(L, 2));
+	return 0;
+}
+
+static luaL_Reg const kOutputBufferMethods[] =
+{
+	{ "write",			&luaOutputWrite },
+	{ "writeint",		&luaOutputWriteInt },
+	{ "writenumber",	&luaOutputWriteNumber },
+	{ NULL, NULL },
+};
+
+/*
+
+`pushOutputBuffer()` pushes a new output buffer object
+for `output`, and returns the slot that must be cleared
+once the output is no longer valid.
+
+*/
+static TemplateOutput** pushOutputBuffer(
+	lua_State*		L,
+	TemplateOutput*	output)
+{
+	TemplateOutput** slot = (TemplateOutput**) lua_newuserdata(L, sizeof(TemplateOutput*));
+	*slot = output;
+
+	if(luaL_newmetatable(L, kOutputBufferTypeName))
+	{
+		lua_newtable(L);
+		luaL_setfuncs(L, kOutputBufferMethods, 0);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+		lua_getfield(L, -1, LUA_STRLIBNAME);
+		lua_getfield(L, -1, "format");
+		lua_pushcclosure(L, &luaOutputWritef, 1);
+		lua_setfield(L, -4, "writef");
+		lua_pop(L, 2);
+
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+
+	return slot;
+}
+
+/*
+
+### Dependencies
+
+With `-MD`, Fiddle writes a dependency file (in the
+format of Make, which Ninja also understands) next to
+each output, named by appending `.d` to the output path.
+With `-MF <path>` the dependency file for a single input
+goes to the given path instead, and `-MP` adds an empty
+rule for every dependency, so that Make doesn't fail
+when one of them is deleted.
+
+The dependencies of an output are its input, plus every
+file the templates read: Lua modules loaded through
+`require` (wherever `package.path` found them), files
+run or loaded with `dofile` and `loadfile`, and files
+opened for reading with `io.open`, `io.lines` or
+`io.input`. We find these by wrapping those functions
+when we create a Lua state.
+
+While a file is being processed, the registry holds a
+table of its dependencies, with the paths both in its
+array part (in the order they were first used) and as
+keys (so that each is only recorded once). We also note
+files that a template looked for but couldn't read,
+with `false` as their value. They don't belong in a
+dependency file, but the output cache needs to know
+about them.
+
+A module that has already been loaded (perhaps while
+processing an earlier file) is never searched for again,
+so we also remember the path each module was loaded
+from. Separately, keyed by the file's absolute path, we
+keep the modification time and size of the file at the
+time, so that a server can tell when a module it has
+loaded is out of date, even from another directory.
+
+*/
+static int gWriteDepfiles = 0;
+static char const* gDepfilePath = NULL;
+static int gPhonyDependencies = 0;
+
+static char const kDependenciesKey[] = "fiddle.dependencies";
+static char const kModulePathsKey[] = "fiddle.modulePaths";
+static char const kModuleStampsKey[] = "fiddle.moduleStamps";
+
+static int gTrackReads = 0;
+
+static char const kReadsKey[] = "fiddle.reads";
+static char const kReadRootsKey[] = "fiddle.readRoots";
+static char const kDirectFilesKey[] = "fiddle.directFiles";
+static char const kModuleDependenciesKey[] = "fiddle.moduleDependencies";
+static char const kReadProxiesKey[] = "fiddle.readProxies";
+static char const kReadProxyMetatableKey[] = "fiddle.readProxy";
+
+/* Read tracking (see below) hooks into `require` */
+static int luaTrackedRequireWithReads(lua_State* L);
+static void installReadTracking(
+	lua_State*	L);
+
+/*
+
+`pushAbsolutePath()` pushes the real path of an existing
+file, or `path` itself if it can't be resolved.
+
+*/
+static void pushAbsolutePath(
+	lua_State*	L,
+	char const*	path)
+{
+#ifdef _WIN32
+	char* absolutePath = _fullpath(NULL, path, 0);
+#else
+	char* absolutePath = realpath(path, NULL);
+#endif
+	lua_pushstring(L, absolutePath ? absolutePath : path);
+	free(absolutePath);
+}
+
+/*
+
+`readFileStamp()` reads the modification time and size
+of the file at `path`, which change whenever the file is
+modified. It returns zero if there is no such file.
+`pushFileStamp()` pushes the same as a string (or `nil`).
+
+*/
+typedef struct FileStamp
+{
+	int64_t	seconds;
+	long	nanoseconds;
+	int64_t	size;
+} FileStamp;
+
+static int readFileStamp(
+	char const*	path,
+	FileStamp*	stamp)
+{
+#ifdef _WIN32
+	struct _stat64 info;
+	if(_stat64(path, &info) != 0)
+		return 0;
+	stamp->nanoseconds = 0;
+#else
+	struct stat info;
+	if(stat(path, &info) != 0)
+		return 0;
+#if defined(__APPLE__)
+	stamp->nanoseconds = (long) info.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+	stamp->nanoseconds = (long) info.st_mtim.tv_nsec;
+#else
+	stamp->nanoseconds = 0;
+#endif
+#endif
+	stamp->seconds = (int64_t) info.st_mtime;
+	stamp->size = (int64_t) info.st_size;
+	return 1;
+}
+
+static void pushFileStamp(
+	lua_State*	L,
+	char const*	path)
+{
+	FileStamp stamp;
+	if(!readFileStamp(path, &stamp))
+	{
+		lua_pushnil(L);
+		return;
+	}
+	lua_pushfstring(L, "%I.%d:%I",
+		(lua_Integer) stamp.seconds,
+		(int) stamp.nanoseconds,
+		(lua_Integer) stamp.size);
+}
+
+static void addDependencyToTable(
+	lua_State*	L,
+	int			tableIndex,
+	char const*	path,
+	int			exists)
+{
+	tableIndex = lua_absindex(L, tableIndex);
+	int type = lua_getfield(L, tableIndex, path);
+	if(type == LUA_TNIL || (exists && !lua_toboolean(L, -1)))
+	{
+		lua_pushboolean(L, exists);
+		lua_setfield(L, tableIndex, path);
+	}
+	if(type == LUA_TNIL)
+	{
+		lua_pushstring(L, path);
+		lua_rawseti(L, tableIndex, (lua_Integer) lua_rawlen(L, tableIndex) + 1);
+	}
+	lua_pop(L, 1);
+}
+
+static void recordDependency(
+	lua_State*	L,
+	char const*	path,
+	int			exists)
+{
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kDependenciesKey) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	addDependencyToTable(L, -1, path, exists);
+	lua_pop(L, 1);
+
+	if(gTrackReads)
+	{
+		if(lua_getfield(L, LUA_REGISTRYINDEX, kDirectFilesKey) == LUA_TTABLE)
+		{
+			lua_pushboolean(L, 1);
+			lua_setfield(L, -2, path);
+		}
+		lua_pop(L, 1);
+	}
+}
+
+/*
+
+`mergeDependencyTable()` records all of the dependencies
+in the table at `index` (which has the same layout as
+the one in the registry).
+
+*/
+static void mergeDependencyTable(
+	lua_State*	L,
+	int			index)
+{
+	index = lua_absindex(L, index);
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kDependenciesKey) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	size_t count = lua_rawlen(L, index);
+	for(size_t ii = 0; ii < count; ii++)
+	{
+		lua_rawgeti(L, index, (lua_Integer) ii + 1);
+		char const* path = lua_tostring(L, -1);
+		lua_getfield(L, index, path);
+		addDependencyToTable(L, -3, path, lua_toboolean(L, -1));
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+
+Each wrapper calls the original function (its first
+upvalue) with all of its arguments, and then records
+a dependency (or a missing file, if the call failed).
+
+*/
+static int callWrappedFunction(
+	lua_State*	L)
+{
+	int argCount = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	for(int ii = 1; ii <= argCount; ii++)
+		lua_pushvalue(L, ii);
+	lua_call(L, argCount, LUA_MULTRET);
+	return lua_gettop(L) - argCount;
+}
+
+static int luaTrackedRequire(lua_State* L)
+{
+	if(gTrackReads)
+		return luaTrackedRequireWithReads(L);
+
+	char const* name = luaL_checkstring(L, 1);
+	int resultCount = callWrappedFunction(L);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, kModulePathsKey);
+	if(lua_getfield(L, -1, name) == LUA_TSTRING)
+		recordDependency(L, lua_tostring(L, -1), 1);
+	lua_pop(L, 2);
+
+	return resultCount;
+}
+
+static int luaTrackedSearcher(lua_State* L)
+{
+	char const* name = luaL_checkstring(L, 1);
+	int argCount = lua_gettop(L);
+	lua_pushvalue(L, lua_upvalueindex(1));
+	for(int ii = 1; ii <= argCount; ii++)
+		lua_pushvalue(L, ii);
+	if(lua_pcall(L, argCount, LUA_MULTRET, 0) != LUA_OK)
+	{
+		/* A module that fails to load (with a syntax error, say) was still read */
+		lua_getglobal(L, "package");
+		lua_getfield(L, -1, "searchpath");
+		lua_pushvalue(L, 1);
+		lua_getfield(L, -3, "path");
+		if(lua_pcall(L, 2, 1, 0) == LUA_OK && lua_type(L, -1) == LUA_TSTRING)
+			recordDependency(L, lua_tostring(L, -1), 1);
+		lua_settop(L, argCount + 1);
+		return lua_error(L);
+	}
+	int resultCount = lua_gettop(L) - argCount;
+
+	int first = lua_gettop(L) - resultCount + 1;
+	if(resultCount >= 2
+		&& lua_isfunction(L, first)
+		&& lua_type(L, first + 1) == LUA_TSTRING)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, kModulePathsKey);
+		lua_pushvalue(L, first + 1);
+		lua_setfield(L, -2, name);
+		lua_pop(L, 1);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, kModuleStampsKey);
+		pushAbsolutePath(L, lua_tostring(L, first + 1));
+		pushFileStamp(L, lua_tostring(L, first + 1));
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+
+		/* Record it now, so that it comes before any modules it requires */
+		recordDependency(L, lua_tostring(L, first + 1), 1);
+	}
+	return resultCount;
+}
+
+/*
+
+`dofile`, `loadfile`, `io.lines` and `io.input` all take
+a path as their first argument (and use standard input
+or output without one), and either fail with an error or
+return `nil` as their first result.
+
+*/
+static int luaTrackedPathFunction(lua_State* L)
+{
+	/* If the call fails with an error, the file may still be a dependency */
+	int hasPath = lua_type(L, 1) == LUA_TSTRING;
+	if(hasPath)
+		recordDependency(L, lua_tostring(L, 1), 0);
+	int resultCount = callWrappedFunction(L);
+
+	int first = lua_gettop(L) - resultCount + 1;
+	if(hasPath && (resultCount == 0 || !lua_isnil(L, first)))
+		recordDependency(L, lua_tostring(L, 1), 1);
+	return resultCount;
+}
+
+static int luaTrackedOpen(lua_State* L)
+{
+	int hasPath = lua_type(L, 1) == LUA_TSTRING;
+	char const* mode = luaL_optstring(L, 2, "r");
+	int resultCount = callWrappedFunction(L);
+
+	int first = lua_gettop(L) - resultCount + 1;
+	int isRead = strpbrk(mode, "wa+") == NULL;
+	if(hasPath && isRead)
+		recordDependency(L, lua_tostring(L, 1), resultCount && !lua_isnil(L, first));
+	return resultCount;
+}
+
+static void wrapFunction(
+	lua_State*		L,
+	int				tableIndex,
+	char const*		name,
+	lua_CFunction	wrapper)
+{
+	tableIndex = lua_absindex(L, tableIndex);
+	if(lua_getfield(L, tableIndex, name) != LUA_TFUNCTION)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushcclosure(L, wrapper, 1);
+	lua_setfield(L, tableIndex, name);
+}
+
+static void installDependencyTracking(
+	lua_State*	L)
+{
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kModulePathsKey);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kModuleStampsKey);
+	installReadTracking(L);
+
+	lua_pushglobaltable(L);
+	wrapFunction(L, -1, "require", &luaTrackedRequire);
+	wrapFunction(L, -1, "dofile", &luaTrackedPathFunction);
+	wrapFunction(L, -1, "loadfile", &luaTrackedPathFunction);
+	lua_pop(L, 1);
+
+	/* Only the searcher for Lua files tells us a path we care about */
+	lua_getglobal(L, "package");
+	if(lua_getfield(L, -1, "searchers") == LUA_TTABLE)
+	{
+		if(lua_rawgeti(L, -1, 2) == LUA_TFUNCTION)
+		{
+			lua_pushcclosure(L, &luaTrackedSearcher, 1);
+			lua_rawseti(L, -2, 2);
+		}
+		else
+		{
+			lua_pop(L, 1);
+		}
+	}
+	lua_pop(L, 2);
+
+	lua_getglobal(L, "io");
+	if(lua_istable(L, -1))
+	{
+		wrapFunction(L, -1, "open", &luaTrackedOpen);
+		wrapFunction(L, -1, "lines", &luaTrackedPathFunction);
+		wrapFunction(L, -1, "input", &luaTrackedPathFunction);
+	}
+	lua_pop(L, 1);
+}
+
+static void beginDependencyTracking(
+	lua_State*	L)
+{
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kDependenciesKey);
+}
+
+/*
+
+`writeDependencyPath()` escapes a path the way Make
+expects in a rule.
+
+*/
+static void writeDependencyPath(
+	SkubWriter*	writer,
+	char const*	path)
+{
+	for(char const* cc = path; *cc; cc++)
+	{
+		switch(*cc)
+		{
+		case ' ':
+		case '\t':
+		case '#':
+			writeBytes(writer, "\\", "\\" + 1);
+			break;
+
+		case '$':
+			writeBytes(writer, "$", "$" + 1);
+			break;
+
+		default:
+			break;
+		}
+		writeBytes(writer, cc, cc + 1);
+	}
+}
+
+/*
+
+`endDependencyTracking()` stops recording dependencies,
+and moves the ones recorded into `dependencies`.
+
+*/
+typedef struct Dependency
+{
+	char*		path;
+	int			exists;
+	uint64_t	hash;
+
+	/* Whether the read set covers it (with `--track-reads`) */
+	int			covered;
+} Dependency;
+
+typedef struct DependencyList
+{
+	Dependency*	items;
+	size_t		count;
+	size_t		capacity;
+} DependencyList;
+
+static void freeDependencyList(
+	DependencyList*	dependencies)
+{
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+		free(dependencies->items[ii].path);
+	free(dependencies->items);
+	dependencies->items = NULL;
+	dependencies->count = 0;
+	dependencies->capacity = 0;
+}
+
+static char* copyString(
+	char const*	text,
+	size_t		size)
+{
+	char* copy = (char*) malloc(size + 1);
+	if(!copy)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(copy, text, size);
+	copy[size] = 0;
+	return copy;
+}
+
+static Dependency* addDependency(
+	DependencyList*	dependencies,
+	char const*		path,
+	size_t			pathSize)
+{
+	if(dependencies->count == dependencies->capacity)
+	{
+		size_t capacity = dependencies->capacity ? dependencies->capacity * 2 : 16;
+		Dependency* items = (Dependency*) realloc(dependencies->items, capacity * sizeof(Dependency));
+		if(!items)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		dependencies->items = items;
+		dependencies->capacity = capacity;
+	}
+
+	Dependency* dependency = &dependencies->items[dependencies->count++];
+	dependency->path = copyString(path, pathSize);
+	dependency->exists = 0;
+	dependency->hash = 0;
+	dependency->covered = 0;
+	return dependency;
+}
+
+static void endDependencyTracking(
+	lua_State*		L,
+	DependencyList*	dependencies)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, kDependenciesKey);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kDependenciesKey);
+	if(!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		return;
+	}
+
+	size_t count = lua_rawlen(L, -1);
+	for(size_t ii = 0; ii < count; ii++)
+	{
+		size_t size = 0;
+		lua_rawgeti(L, -1, (lua_Integer) ii + 1);
+		char const* path = lua_tolstring(L, -1, &size);
+
+		Dependency* dependency = addDependency(dependencies, path, size);
+		dependency->exists = lua_getfield(L, -2, path) == LUA_TBOOLEAN && lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+}
+
+/*
+
+A prelude (`--prelude`) runs once, before any template,
+so everything it read is a dependency of every file.
+`mergeDependencies()` adds those of `more` that aren't
+already in `dependencies`.
+
+*/
+static char const* gPreludePath = NULL;
+static DependencyList gPreludeDependencies;
+
+static void mergeDependencies(
+	DependencyList*			dependencies,
+	DependencyList const*	more)
+{
+	for(size_t ii = 0; ii < more->count; ii++)
+	{
+		Dependency const* item = &more->items[ii];
+		Dependency* existing = NULL;
+		for(size_t jj = 0; jj < dependencies->count && !existing; jj++)
+		{
+			if(strcmp(dependencies->items[jj].path, item->path) == 0)
+				existing = &dependencies->items[jj];
+		}
+		if(!existing)
+			existing = addDependency(dependencies, item->path, strlen(item->path));
+		existing->exists |= item->exists;
+
+		/* Nothing tracked what the prelude read */
+		existing->covered = 0;
+	}
+}
+
+/*
+
+`writeDependencyFile()` writes the dependency file for
+`outputPath`, listing the files in `dependencies` that
+were actually read.
+
+*/
+static void writeDependencyFile(
+	char const*		inputPath,
+	char const*		outputPath,
+	DependencyList*	dependencies)
+{
+	SkubWriter writer = { 0 };
+	writeDependencyPath(&writer, outputPath);
+	writeRawT(&writer, ":");
+
+	/* A file that is updated in place doesn't depend on itself */
+	int inPlace = strcmp(inputPath, outputPath) == 0;
+	if(!inPlace)
+	{
+		writeRawT(&writer, " ");
+		writeDependencyPath(&writer, inputPath);
+	}
+
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		if(!dependencies->items[ii].exists)
+			continue;
+		writeRawT(&writer, " \\\n  ");
+		writeDependencyPath(&writer, dependencies->items[ii].path);
+	}
+	writeRawT(&writer, "\n");
+
+	if(gPhonyDependencies)
+	{
+		for(size_t ii = 0; ii < dependencies->count; ii++)
+		{
+			if(!dependencies->items[ii].exists)
+				continue;
+			writeRawT(&writer, "\n");
+			writeDependencyPath(&writer, dependencies->items[ii].path);
+			writeRawT(&writer, ":\n");
+		}
+	}
+
+	char* allocatedPath = NULL;
+	char const* depfilePath = gDepfilePath;
+	if(!depfilePath)
+	{
+		size_t size = strlen(outputPath);
+		allocatedPath = (char*) malloc(size + 3);
+		if(!allocatedPath)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		memcpy(allocatedPath, outputPath, size);
+		memcpy(allocatedPath + size, ".d", 3);
+		depfilePath = allocatedPath;
+	}
+
+	if(!writeFileAtomically(depfilePath, writer.begin, writer.cursor))
+		reportError("cannot write '%s'", depfilePath);
+
+	free(allocatedPath);
+	free(writer.begin);
+}
+
+/*
+
+### Bytecode Cache
+
+When a cache directory is given (with `--cache-dir`, or
+the `FIDDLE_CACHE_DIR` environment variable) we store
+the compiled bytecode of the Lua code generated for each
+file, and on later runs load it instead of generating
+and compiling the source again.
+
+All of the templates in a file are compiled into a single
+Lua function (they can share locals), so that is what we
+cache. The key is a hash of everything that determines
+the generated code: the source of each template, the
+number of lines around it (which ends up in the debug
+info), and the chunk name used in error messages, along
+with the versions of Fiddle and Lua.
+
+Entries are written with `writeFileAtomically()`, so
+concurrent Fiddle processes can share a cache directory:
+at worst two processes compile the same file, and the
+last rename wins. Bytecode is loaded without being
+verified, so the cache directory must only be writable
+by trusted users.
+
+*/
+/*
+
+`FIDDLE_VERSION` is part of every cache key, so it must
+be bumped whenever the generated code changes.
+
+*/
+#define FIDDLE_VERSION "0.4"
+
+char const* gIncludePath;
+char const* gOutputPath;
+char const* gCacheDir;
+
+/* Number of files to process in parallel (`-j`), if given */
+int gJobCount = 0;
+
+/* Whether to stamp marker lines (`--stamp`), or check files (`--check`) */
+static int gStampOutputs = 0;
+static int gCheckOutputs = 0;
+
+/* Whether templates need to record the files they read */
+static int gTrackDependencies = 0;
+
+/* Whether we are running as a server (`--server`) */
+static int gServing = 0;
+
+/*
+
+Whether Lua states (and the templates they have loaded)
+are kept from one run to the next, as they are while
+serving or watching (`--watch`)
+
+*/
+static int gKeepLuaStates = 0;
+
+static char const kBytecodeMagic[8] = { 'F', 'I', 'D', 'D', 'L', 'E', 'B', 'C' };
+enum { kBytecodeHeaderSize = 24 };
+
+static uint64_t hashGeneratedCode(
+	ParsedFile*	file,
+	char const*	chunkName)
+{
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashString(&hasher, "fiddle-bytecode " FIDDLE_VERSION " " LUA_RELEASE);
+	hashInteger(&hasher, sizeof(lua_Integer));
+	hashInteger(&hasher, sizeof(lua_Number));
+	hashString(&hasher, chunkName);
+
+	for(size_t ii = 0; ii < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		hashInteger(&hasher, chunk->prefix.begin != chunk->prefix.end);
+		hashInteger(&hasher, chunk->prefixLineCount);
+		hashSpan(&hasher, chunk->code);
+		hashInteger(&hasher, chunk->linePrefix.end - chunk->linePrefix.begin);
+		hashInteger(&hasher, chunk->suffixLineCount);
+		/*
+
+		A whole-file template has no `code` span, so its
+		static text only reaches the generated code through
+		the nodes, and we hash those as well.
+
+		*/
+		hashInteger(&hasher, chunk->nodeCount);
+		for(size_t jj = 0; jj < chunk->nodeCount; jj++)
+		{
+			TemplateNode* node = &file->nodes[chunk->firstNode + jj];
+			hashInteger(&hasher, node->flavor);
+			hashSpan(&hasher, node->text);
+		}
+	}
+	return finishHasher(&hasher);
+}
+
+static char* pickBytecodeCachePath(
+	uint64_t	key)
+{
+	char hex[17];
+	formatHash(key, hex);
+
+	size_t size = strlen(gCacheDir) + 32;
+	char* path = (char*) malloc(size);
+	if(path)
+		snprintf(path, size, "%s/%s.luac", gCacheDir, hex);
+	return path;
+}
+
+/*
+
+`loadCachedBytecode()` tries to load the cache entry at
+`path` onto the Lua stack. It returns zero, leaving the
+stack unchanged, if there is no usable entry.
+
+*/
+static int loadCachedBytecode(
+	lua_State*	L,
+	char const*	path,
+	uint64_t	key,
+	char const*	chunkName)
+{
+	InputFile file;
+	memset(&file, 0, sizeof(InputFile));
+	if(!mapInputFile(&file, path))
+		return 0;
+
+	int ok = 0;
+	uint8_t const* header = (uint8_t const*) file.text.begin;
+	size_t fileSize = file.text.end - file.text.begin;
+	if(fileSize >= kBytecodeHeaderSize
+		&& memcmp(header, kBytecodeMagic, sizeof(kBytecodeMagic)) == 0
+		&& readLittleEndian64(header + 8) == key
+		&& readLittleEndian64(header + 16) == fileSize - kBytecodeHeaderSize)
+	{
+		StringSpan readerState;
+		readerState.begin = file.text.begin + kBytecodeHeaderSize;
+		readerState.end = file.text.end;
+		if(lua_load(L, &luaReadCallback, &readerState, chunkName, "b") == LUA_OK)
+			ok = 1;
+		else
+			lua_pop(L, 1);
+	}
+
+	closeInputFile(&file);
+	return ok;
+}
+
+static int luaDumpCallback(
+	lua_State*	L,
+	void const*	data,
+	size_t		size,
+	void*		userData)
+{
+	(void) L;
+	SkubWriter* writer = (SkubWriter*) userData;
+	writeBytes(writer, (char const*) data, (char const*) data + size);
+	return 0;
+}
+
+/*
+
+`storeCachedBytecode()` dumps the function on top of the
+Lua stack into the cache entry at `path`. Failing to
+write the cache is not an error.
+
+*/
+static void storeCachedBytecode(
+	lua_State*	L,
+	char const*	path,
+	uint64_t	key)
+{
+	SkubWriter writer = { 0 };
+	reserveWriter(&writer, kBytecodeHeaderSize);
+	writer.cursor += kBytecodeHeaderSize;
+
+	lua_dump(L, &luaDumpCallback, &writer, 0);
+
+	uint64_t fields[2];
+	fields[0] = key;
+	fields[1] = (writer.cursor - writer.begin) - kBytecodeHeaderSize;
+	memcpy(writer.begin, kBytecodeMagic, sizeof(kBytecodeMagic));
+	for(int ff = 0; ff < 2; ff++)
+	{
+		for(int bb = 0; bb < 8; bb++)
+			writer.begin[8 + ff * 8 + bb] = (char)(fields[ff] >> (bb * 8));
+	}
+
+	writeFileAtomically(path, writer.begin, writer.cursor);
+	free(writer.begin);
+}
+
+/*
+
+A server (or `--watch`) also keeps the compiled
+function for each file it runs, in the Lua state that
+ran it, under the same key as in the bytecode cache.
+Entries for old versions of a template are never used
+again, so once there are too many we just start over.
+
+*/
+static char const kResidentTemplatesKey[] = "fiddle.residentTemplates";
+enum { kMaxResidentTemplates = 4096 };
+
+static int loadResidentTemplate(
+	lua_State*	L,
+	uint64_t	key)
+{
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kResidentTemplatesKey) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	char hex[17];
+	formatHash(key, hex);
+	if(lua_getfield(L, -1, hex) != LUA_TFUNCTION)
+	{
+		lua_pop(L, 2);
+		return 0;
+	}
+	lua_remove(L, -2);
+	return 1;
+}
+
+static void storeResidentTemplate(
+	lua_State*	L,
+	uint64_t	key)
+{
+	lua_Integer count = 0;
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kResidentTemplatesKey) == LUA_TTABLE)
+	{
+		lua_getfield(L, -1, "count");
+		count = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
+	if(!lua_istable(L, -1) || count >= kMaxResidentTemplates)
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, kResidentTemplatesKey);
+		count = 0;
+	}
+
+	char hex[17];
+	formatHash(key, hex);
+	lua_pushvalue(L, -2);
+	lua_setfield(L, -2, hex);
+	lua_pushinteger(L, count + 1);
+	lua_setfield(L, -2, "count");
+	lua_pop(L, 1);
+}
+
+/*
+
+### Output Cache
+
+With `--output-cache <dir>` (or the `FIDDLE_OUTPUT_CACHE`
+environment variable), Fiddle remembers the output it
+generated for each input, and hands it back without
+running any templates for as long as nothing the
+templates read has changed.
+
+We can't know which files the templates will read
+until they have run, so each entry comes in two parts,
+both named by a hash of their key:
+
+* A manifest, keyed by the input: its path and text,
+  the versions of Fiddle and Lua, and the options that
+  change how templates run. It lists the dependencies
+  recorded the last time the input was processed (the
+  same ones `-MD` reports, plus files the templates
+  looked for and didn't find), each with a hash of its
+  contents.
+
+* The output, keyed by the input key together with the
+  dependencies and their hashes.
+
+To look up an input we read its manifest and hash the
+files it lists as they are now. If they all match, the
+output key leads us to the output, which we write out
+just as if the templates had produced it.
+
+Both parts are written with `writeFileAtomically()`, so
+any number of Fiddle processes (on one machine, or on
+several sharing a file system) can use the same cache
+directory. Dependencies are stored with the paths the
+templates used, so checkouts in different places can
+share a cache as long as those paths are relative.
+
+Using an entry updates the modification time of its
+files. After a run that added entries, we delete the
+least recently used files until the cache is back under
+its size limit (set with `--output-cache-size`).
+
+Anything else a template looks at isn't part of the key:
+environment variables, the time, the output of programs
+run with `io.popen`, or globals left behind by other
+files. Templates that depend on those shouldn't be used
+with the output cache.
+
+*/
+static char const* gOutputCacheDir = NULL;
+static uint64_t gOutputCacheLimit = (uint64_t) 1 << 30;
+static unsigned long volatile gOutputCacheStoreCount = 0;
+
+static char const kManifestMagic[8] = { 'F', 'I', 'D', 'D', 'L', 'E', 'M', 'F' };
+static char const kCachedOutputMagic[8] = { 'F', 'I', 'D', 'D', 'L', 'E', 'O', 'U' };
+enum { kOutputCacheHeaderSize = 24 };
+
+static char const kManifestSuffix[] = ".fmf";
+static char const kCachedOutputSuffix[] = ".fout";
+
+static uint64_t hashOutputCacheInput(
+	char const*	inputPath,
+	StringSpan	text)
+{
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashString(&hasher, "fiddle-output " FIDDLE_VERSION " " LUA_RELEASE);
+	hashInteger(&hasher, sizeof(lua_Integer));
+	hashInteger(&hasher, sizeof(lua_Number));
+	hashInteger(&hasher, gIncludePath != NULL);
+	hashString(&hasher, gIncludePath ? gIncludePath : "");
+	hashInteger(&hasher, gStampOutputs);
+	if(gPreludePath)
+		hashString(&hasher, gPreludePath);
+	hashString(&hasher, inputPath);
+	hashSpan(&hasher, text);
+	return finishHasher(&hasher);
+}
+
+static uint64_t hashOutputCacheDependencies(
+	uint64_t		inputKey,
+	DependencyList*	dependencies)
+{
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashInteger(&hasher, inputKey);
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		hashString(&hasher, dependency->path);
+		hashInteger(&hasher, dependency->exists);
+		hashInteger(&hasher, dependency->hash);
+	}
+	return finishHasher(&hasher);
+}
+
+/*
+
+`hashDependencyFile()` hashes the contents of a file as
+they are now, and returns zero if it can't be read.
+
+*/
+static int hashDependencyFile(
+	char const*	path,
+	uint64_t*	outHash)
+{
+	InputFile file;
+	char const* failure = NULL;
+	*outHash = 0;
+	if(!tryOpenInputFile(&file, path, &failure))
+		return 0;
+
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashSpan(&hasher, file.text);
+	*outHash = finishHasher(&hasher);
+	closeInputFile(&file);
+	return 1;
+}
+
+/*
+
+`refreshDependencyHashes()` hashes each dependency as it
+is now. It returns zero if any of them has appeared or
+disappeared since it was recorded.
+
+*/
+static int refreshDependencyHashes(
+	DependencyList*	dependencies)
+{
+	int unchanged = 1;
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		int exists = hashDependencyFile(dependency->path, &dependency->hash);
+		if(exists != dependency->exists)
+			unchanged = 0;
+		dependency->exists = exists;
+	}
+	return unchanged;
+}
+
+static char* pickOutputCachePath(
+	uint64_t	key,
+	char const*	suffix)
+{
+	char hex[17];
+	formatHash(key, hex);
+
+	size_t size = strlen(gOutputCacheDir) + strlen(suffix) + 32;
+	char* path = (char*) malloc(size);
+	if(!path)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	snprintf(path, size, "%s/%s%s", gOutputCacheDir, hex, suffix);
+	return path;
+}
+
+static void writeLittleEndian64(
+	char*		bytes,
+	uint64_t	value)
+{
+	for(int bb = 0; bb < 8; bb++)
+		bytes[bb] = (char)(value >> (bb * 8));
+}
+
+static void writeCacheHeader(
+	char*		header,
+	char const*	magic,
+	uint64_t	key,
+	uint64_t	count)
+{
+	memcpy(header, magic, 8);
+	writeLittleEndian64(header + 8, key);
+	writeLittleEndian64(header + 16, count);
+}
+
+static int checkCacheHeader(
+	StringSpan	text,
+	char const*	magic,
+	uint64_t	key,
+	uint64_t*	outCount)
+{
+	uint8_t const* header = (uint8_t const*) text.begin;
+	if((size_t)(text.end - text.begin) < kOutputCacheHeaderSize
+		|| memcmp(header, magic, 8) != 0
+		|| readLittleEndian64(header + 8) != key)
+	{
+		return 0;
+	}
+	*outCount = readLittleEndian64(header + 16);
+	return 1;
+}
+
+/*
+
+Reading a cache file counts as using it, so we bump its
+modification time, which is what eviction goes by.
+
+*/
+static void touchCacheFile(
+	char const*	path)
+{
+#ifdef _WIN32
+	_utime(path, NULL);
+#else
+	utime(path, NULL);
+#endif
+}
+
+/*
+
+`readManifest()` parses the dependencies listed in a
+manifest. Each one is stored as its hash, whether it
+existed, and the size of its path (each as 64 bits),
+followed by the path.
+
+*/
+static int readManifest(
+	StringSpan		text,
+	uint64_t		inputKey,
+	DependencyList*	dependencies)
+{
+	uint64_t count = 0;
+	if(!checkCacheHeader(text, kManifestMagic, inputKey, &count))
+		return 0;
+
+	uint8_t const* cursor = (uint8_t const*) text.begin + kOutputCacheHeaderSize;
+	uint8_t const* end = (uint8_t const*) text.end;
+	if(count > (uint64_t)(end - cursor) / 24)
+		return 0;
+
+	for(uint64_t ii = 0; ii < count; ii++)
+	{
+		if(end - cursor < 24)
+			return 0;
+		uint64_t hash = readLittleEndian64(cursor);
+		uint64_t exists = readLittleEndian64(cursor + 8);
+		uint64_t pathSize = readLittleEndian64(cursor + 16);
+		cursor += 24;
+		if(pathSize > (uint64_t)(end - cursor) || memchr(cursor, 0, (size_t) pathSize))
+			return 0;
+
+		Dependency* dependency = addDependency(dependencies, (char const*) cursor, (size_t) pathSize);
+		dependency->exists = exists != 0;
+		dependency->hash = hash;
+		cursor += pathSize;
+	}
+	return cursor == end;
+}
+
+/*
+
+`lookUpCachedOutput()` looks for a valid entry for the
+input with the given key. On a hit, it maps the cached
+output into `entry` and points `output` at the text
+inside it, and fills in the dependencies that the
+output was generated from.
+
+*/
+static int lookUpCachedOutput(
+	uint64_t		inputKey,
+	InputFile*		entry,
+	StringSpan*		output,
+	DependencyList*	dependencies)
+{
+	char* manifestPath = pickOutputCachePath(inputKey, kManifestSuffix);
+	InputFile manifest;
+	memset(&manifest, 0, sizeof(InputFile));
+	if(!mapInputFile(&manifest, manifestPath))
+	{
+		free(manifestPath);
+		return 0;
+	}
+
+	int hit = readManifest(manifest.text, inputKey, dependencies);
+	closeInputFile(&manifest);
+
+	for(size_t ii = 0; hit && ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		uint64_t hash = 0;
+		int exists = hashDependencyFile(dependency->path, &hash);
+		hit = exists == dependency->exists && hash == dependency->hash;
+	}
+
+	char* outputPath = NULL;
+	if(hit)
+	{
+		uint64_t outputKey = hashOutputCacheDependencies(inputKey, dependencies);
+		outputPath = pickOutputCachePath(outputKey, kCachedOutputSuffix);
+
+		uint64_t size = 0;
+		memset(entry, 0, sizeof(InputFile));
+		hit = mapInputFile(entry, outputPath);
+		if(hit
+			&& !(checkCacheHeader(entry->text, kCachedOutputMagic, outputKey, &size)
+				&& size == (uint64_t)(entry->text.end - entry->text.begin) - kOutputCacheHeaderSize))
+		{
+			closeInputFile(entry);
+			hit = 0;
+		}
+	}
+
+	if(hit)
+	{
+		output->begin = entry->text.begin + kOutputCacheHeaderSize;
+		output->end = entry->text.end;
+		touchCacheFile(manifestPath);
+		touchCacheFile(outputPath);
+	}
+	else
+	{
+		freeDependencyList(dependencies);
+	}
+	free(outputPath);
+	free(manifestPath);
+	return hit;
+}
+
+/*
+
+`storeCachedOutput()` adds an entry for the output that
+the templates just wrote to `outputPath`. If one of the
+dependencies changed while the templates ran, we can't
+tell which version they saw, so we leave it out.
+Failing to write the cache is not an error.
+
+*/
+static void storeCachedOutput(
+	uint64_t		inputKey,
+	DependencyList*	dependencies,
+	char const*		outputPath)
+{
+	if(!refreshDependencyHashes(dependencies))
+		return;
+
+	InputFile output;
+	char const* failure = NULL;
+	if(!tryOpenInputFile(&output, outputPath, &failure))
+		return;
+
+	uint64_t outputKey = hashOutputCacheDependencies(inputKey, dependencies);
+	char* entryPath = pickOutputCachePath(outputKey, kCachedOutputSuffix);
+
+	char header[kOutputCacheHeaderSize];
+	writeCacheHeader(header, kCachedOutputMagic, outputKey, output.text.end - output.text.begin);
+
+	StringSpan spans[2];
+	spans[0].begin = header;
+	spans[0].end = header + kOutputCacheHeaderSize;
+	spans[1] = output.text;
+	int stored = writeSpansAtomically(entryPath, spans, 2);
+	closeInputFile(&output);
+	free(entryPath);
+
+	/* The manifest goes last, so that it never leads to a missing output */
+	if(!stored)
+		return;
+
+	SkubWriter writer = { 0 };
+	reserveWriter(&writer, kOutputCacheHeaderSize);
+	writeCacheHeader(writer.cursor, kManifestMagic, inputKey, dependencies->count);
+	writer.cursor += kOutputCacheHeaderSize;
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		size_t pathSize = strlen(dependency->path);
+		char fields[24];
+		writeLittleEndian64(fields, dependency->hash);
+		writeLittleEndian64(fields + 8, dependency->exists);
+		writeLittleEndian64(fields + 16, pathSize);
+		writeBytes(&writer, fields, fields + 24);
+		writeBytes(&writer, dependency->path, dependency->path + pathSize);
+	}
+
+	char* manifestPath = pickOutputCachePath(inputKey, kManifestSuffix);
+	if(writeFileAtomically(manifestPath, writer.begin, writer.cursor))
+		atomicIncrement(&gOutputCacheStoreCount);
+	free(manifestPath);
+	free(writer.begin);
+}
+
+/*
+
+### Read Tracking
+
+Every template depends on the file that holds the model,
+so with file dependencies alone any change to the model
+means running all of them again. With `--track-reads`,
+we also record what the templates read from the model:
+
+* A table that a template gets from `require` is wrapped
+  in a proxy, and so are the tables it reaches through
+  that proxy. Each proxy knows the module it came from
+  (its root) and the keys that lead to it (its path).
+
+* Every key read through a proxy is recorded with a hash
+  of the value read, and so are `#t` and the set of keys
+  that `pairs()` visits. Together these are the read set
+  of the output.
+
+* While a module loads, the files it reads go into a list
+  of its own (and from there into the dependencies of the
+  file that required it), so we know which files each
+  root was built from.
+
+A file that only went into building roots whose reads we
+could all hash is covered by the read set: as long as
+those reads give the same values, it doesn't matter that
+the file changed. Anything we can't hash (a function, a
+table with a metatable, a write to a proxy) stops the
+root from covering its files, and so does a template
+reading a file directly, or requiring a module that
+isn't a plain table. The files that aren't covered are
+compared by their contents, as usual.
+
+Proxies are ordinary tables with a metatable, so that
+`type()`, `ipairs()`, `pairs()` and `#` all work. The
+state of each is kept in a table of its own, found
+through a registry table with weak keys: the table it
+stands for, its root and its path, and the proxies of
+the tables it has handed out (so that reading the same
+key twice gives the same proxy). Paths are strings that
+encode each key with a tag for its type.
+
+*/
+enum
+{
+	kReadProxy_Table = 1,
+	kReadProxy_Root,
+	kReadProxy_Path,
+	kReadProxy_Children,
+};
+
+typedef enum ReadKind
+{
+	kReadKind_Value = 'v',
+	kReadKind_Length = 'n',
+	kReadKind_Keys = 'k',
+} ReadKind;
+
+/*
+
+`hashReadValue()` hashes the value at `index`, and
+returns zero if it is something we can't hash. A table
+is only hashed by whether it has a metatable, since
+reads from it are recorded on their own.
+
+*/
+static int hashReadValue(
+	lua_State*	L,
+	int			index,
+	Hasher*		hasher)
+{
+	int type = lua_type(L, index);
+	hashInteger(hasher, (uint64_t) type);
+	switch(type)
+	{
+	case LUA_TNIL:
+		return 1;
+
+	case LUA_TBOOLEAN:
+		hashInteger(hasher, (uint64_t) lua_toboolean(L, index));
+		return 1;
+
+	case LUA_TNUMBER:
+		if(lua_isinteger(L, index))
+		{
+			hashInteger(hasher, 0);
+			hashInteger(hasher, (uint64_t) lua_tointeger(L, index));
+		}
+		else
+		{
+			double number = (double) lua_tonumber(L, index);
+			uint64_t bits = 0;
+			memcpy(&bits, &number, sizeof(bits));
+			hashInteger(hasher, 1);
+			hashInteger(hasher, bits);
+		}
+		return 1;
+
+	case LUA_TSTRING:
+		{
+			StringSpan span;
+			size_t size = 0;
+			span.begin = lua_tolstring(L, index, &size);
+			span.end = span.begin + size;
+			hashSpan(hasher, span);
+		}
+		return 1;
+
+	case LUA_TTABLE:
+		{
+			int hasMetatable = lua_getmetatable(L, index);
+			if(hasMetatable)
+				lua_pop(L, 1);
+			hashInteger(hasher, (uint64_t) hasMetatable);
+		}
+		return 1;
+
+	case LUA_TLIGHTUSERDATA:
+		/* `fiddle.null` */
+		return lua_touserdata(L, index) == NULL;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+
+`pushReadKey()` pushes the encoding of the key at `index`
+(as it appears in a path), and returns zero (pushing
+nothing) if it is a key we can't encode. Lua converts
+float keys with an integer value to integers, and so do
+we.
+
+*/
+static int pushReadKey(
+	lua_State*	L,
+	int			index)
+{
+	char bytes[9];
+	switch(lua_type(L, index))
+	{
+	case LUA_TBOOLEAN:
+		bytes[0] = 'b';
+		bytes[1] = (char) lua_toboolean(L, index);
+		lua_pushlstring(L, bytes, 2);
+		return 1;
+
+	case LUA_TNUMBER:
+		{
+			int isInteger = 0;
+			lua_Integer integer = lua_tointegerx(L, index, &isInteger);
+			if(isInteger)
+			{
+				bytes[0] = 'i';
+				writeLittleEndian64(bytes + 1, (uint64_t) integer);
+			}
+			else
+			{
+				double number = (double) lua_tonumber(L, index);
+				uint64_t bits = 0;
+				memcpy(&bits, &number, sizeof(bits));
+				bytes[0] = 'f';
+				writeLittleEndian64(bytes + 1, bits);
+			}
+			lua_pushlstring(L, bytes, 9);
+		}
+		return 1;
+
+	case LUA_TSTRING:
+		{
+			size_t size = 0;
+			char const* text = lua_tolstring(L, index, &size);
+			bytes[0] = 's';
+			writeLittleEndian64(bytes + 1, size);
+			luaL_Buffer buffer;
+			luaL_buffinit(L, &buffer);
+			luaL_addlstring(&buffer, bytes, 9);
+			luaL_addlstring(&buffer, text, size);
+			luaL_pushresult(&buffer);
+		}
+		return 1;
+
+	default:
+		return 0;
+	}
+}
+
+/*
+
+`hashReadKeys()` hashes the set of keys of the table at
+`index`, and returns zero if one of them is a key we
+can't encode. The order `next()` visits keys in changes
+from one run to the next (Lua seeds its string hashes
+randomly), so we add up a hash of each key instead.
+
+*/
+static int hashReadKeys(
+	lua_State*	L,
+	int			index,
+	Hasher*		hasher)
+{
+	index = lua_absindex(L, index);
+	uint64_t sum = 0;
+	uint64_t count = 0;
+	lua_pushnil(L);
+	while(lua_next(L, index))
+	{
+		if(!pushReadKey(L, -2))
+		{
+			lua_pop(L, 2);
+			return 0;
+		}
+		StringSpan span;
+		size_t size = 0;
+		span.begin = lua_tolstring(L, -1, &size);
+		span.end = span.begin + size;
+
+		Hasher keyHasher;
+		initHasher(&keyHasher, 0);
+		hashSpan(&keyHasher, span);
+		sum += finishHasher(&keyHasher);
+		count++;
+		lua_pop(L, 2);
+	}
+	hashInteger(hasher, count);
+	hashInteger(hasher, sum);
+	return 1;
+}
+
+/*
+
+The reads of the file being processed are kept in the
+registry, keyed by the kind of read, the root and the
+path, with the hash of what was read as their value.
+The registry also holds the roots the file has used,
+each with whether it still covers its files. Outside of
+a file, or while a module loads, nothing is recorded.
+
+*/
+static int isTrackingReads(
+	lua_State*	L)
+{
+	int tracking = lua_getfield(L, LUA_REGISTRYINDEX, kReadsKey) == LUA_TTABLE;
+	lua_pop(L, 1);
+	return tracking;
+}
+
+/*
+
+`noteReadRoot()` records that the file used the root at
+`rootIndex`, and (the first time) that it depends on the
+files the module was built from.
+
+*/
+static void noteReadRoot(
+	lua_State*	L,
+	int			rootIndex,
+	int			covers)
+{
+	rootIndex = lua_absindex(L, rootIndex);
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kReadRootsKey) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pushvalue(L, rootIndex);
+	int type = lua_rawget(L, -2);
+	if(type == LUA_TNIL || (!covers && lua_toboolean(L, -1)))
+	{
+		lua_pushvalue(L, rootIndex);
+		lua_pushboolean(L, covers);
+		lua_rawset(L, -4);
+	}
+	lua_pop(L, 2);
+
+	if(type == LUA_TNIL)
+	{
+		lua_getfield(L, LUA_REGISTRYINDEX, kModuleDependenciesKey);
+		lua_pushvalue(L, rootIndex);
+		if(lua_rawget(L, -2) == LUA_TTABLE)
+			mergeDependencyTable(L, -1);
+		lua_pop(L, 2);
+	}
+}
+
+static void recordRead(
+	lua_State*	L,
+	ReadKind	kind,
+	int			rootIndex,
+	int			pathIndex,
+	uint64_t	hash)
+{
+	rootIndex = lua_absindex(L, rootIndex);
+	pathIndex = lua_absindex(L, pathIndex);
+	if(lua_getfield(L, LUA_REGISTRYINDEX, kReadsKey) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		return;
+	}
+	noteReadRoot(L, rootIndex, 1);
+
+	size_t rootSize = 0;
+	char const* root = lua_tolstring(L, rootIndex, &rootSize);
+	char header[9];
+	header[0] = (char) kind;
+	writeLittleEndian64(header + 1, rootSize);
+
+	luaL_Buffer buffer;
+	luaL_buffinit(L, &buffer);
+	luaL_addlstring(&buffer, header, 9);
+	luaL_addlstring(&buffer, root, rootSize);
+	lua_pushvalue(L, pathIndex);
+	luaL_addvalue(&buffer);
+	luaL_pushresult(&buffer);
+
+	lua_pushvalue(L, -1);
+	if(lua_rawget(L, -3) == LUA_TNIL)
+	{
+		lua_pop(L, 1);
+		lua_pushinteger(L, (lua_Integer) hash);
+		lua_rawset(L, -3);
+		lua_pop(L, 1);
+		return;
+	}
+	lua_pop(L, 3);
+}
+
+static void pushReadProxy(
+	lua_State*	L,
+	int			tableIndex,
+	int			rootIndex,
+	int			pathIndex)
+{
+	tableIndex = lua_absindex(L, tableIndex);
+	rootIndex = lua_absindex(L, rootIndex);
+	pathIndex = lua_absindex(L, pathIndex);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, kReadProxiesKey);
+	lua_newtable(L);
+	luaL_setmetatable(L, kReadProxyMetatableKey);
+
+	lua_createtable(L, 4, 0);
+	lua_pushvalue(L, tableIndex);
+	lua_rawseti(L, -2, kReadProxy_Table);
+	lua_pushvalue(L, rootIndex);
+	lua_rawseti(L, -2, kReadProxy_Root);
+	lua_pushvalue(L, pathIndex);
+	lua_rawseti(L, -2, kReadProxy_Path);
+
+	lua_pushvalue(L, -2);
+	lua_insert(L, -2);
+	lua_rawset(L, -4);
+	lua_remove(L, -2);
+}
+
+static void pushReadProxyState(
+	lua_State*	L,
+	int			proxyIndex)
+{
+	proxyIndex = lua_absindex(L, proxyIndex);
+	lua_getfield(L, LUA_REGISTRYINDEX, kReadProxiesKey);
+	lua_pushvalue(L, proxyIndex);
+	if(lua_rawget(L, -2) != LUA_TTABLE)
+		luaL_error(L, "not a model table");
+	lua_remove(L, -2);
+}
+
+static void markReadRootUncovered(
+	lua_State*	L,
+	int			stateIndex)
+{
+	lua_rawgeti(L, stateIndex, kReadProxy_Root);
+	noteReadRoot(L, -1, 0);
+	lua_pop(L, 1);
+}
+
+/*
+
+`pushReadValue()` records that the value at `valueIndex`
+was read with the key at `keyIndex` through the proxy
+whose state is at `stateIndex`, and pushes what the
+template should see: the value itself, or a proxy for
+it if it is a table.
+
+*/
+static void pushReadValue(
+	lua_State*	L,
+	int			stateIndex,
+	int			keyIndex,
+	int			valueIndex)
+{
+	stateIndex = lua_absindex(L, stateIndex);
+	keyIndex = lua_absindex(L, keyIndex);
+	valueIndex = lua_absindex(L, valueIndex);
+	int top = lua_gettop(L);
+
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	if(!pushReadKey(L, keyIndex) || !hashReadValue(L, valueIndex, &hasher))
+	{
+		lua_settop(L, top);
+		markReadRootUncovered(L, stateIndex);
+		lua_pushvalue(L, valueIndex);
+		return;
+	}
+	int keyStringIndex = lua_gettop(L);
+
+	lua_rawgeti(L, stateIndex, kReadProxy_Root);
+	lua_rawgeti(L, stateIndex, kReadProxy_Path);
+	lua_pushvalue(L, keyStringIndex);
+	lua_concat(L, 2);
+	recordRead(L, kReadKind_Value, -2, -1, finishHasher(&hasher));
+
+	if(!lua_istable(L, valueIndex))
+	{
+		lua_settop(L, top);
+		lua_pushvalue(L, valueIndex);
+		return;
+	}
+	if(lua_getmetatable(L, valueIndex))
+	{
+		lua_settop(L, top);
+		markReadRootUncovered(L, stateIndex);
+		lua_pushvalue(L, valueIndex);
+		return;
+	}
+
+	/* Reuse the proxy we handed out for this key, unless the value has changed */
+	if(lua_rawgeti(L, stateIndex, kReadProxy_Children) != LUA_TTABLE)
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, stateIndex, kReadProxy_Children);
+	}
+	int childrenIndex = lua_gettop(L);
+	lua_pushvalue(L, keyStringIndex);
+	if(lua_rawget(L, childrenIndex) == LUA_TTABLE)
+	{
+		pushReadProxyState(L, -1);
+		lua_rawgeti(L, -1, kReadProxy_Table);
+		if(lua_rawequal(L, -1, valueIndex))
+		{
+			lua_pop(L, 2);
+			lua_replace(L, top + 1);
+			lua_settop(L, top + 1);
+			return;
+		}
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+
+	pushReadProxy(L, valueIndex, keyStringIndex + 1, keyStringIndex + 2);
+	lua_pushvalue(L, keyStringIndex);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, childrenIndex);
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+}
+
+static int luaReadProxyIndex(lua_State* L)
+{
+	pushReadProxyState(L, 1);
+	lua_rawgeti(L, 3, kReadProxy_Table);
+	lua_pushvalue(L, 2);
+	lua_gettable(L, 4);
+	pushReadValue(L, 3, 2, 5);
+	return 1;
+}
+
+static int luaReadProxyNewIndex(lua_State* L)
+{
+	/* The template may no longer see what the model says */
+	pushReadProxyState(L, 1);
+	markReadRootUncovered(L, 4);
+	lua_rawgeti(L, 4, kReadProxy_Table);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	lua_settable(L, -3);
+	return 0;
+}
+
+static int luaReadProxyLength(lua_State* L)
+{
+	/* `__len` gets its operand twice */
+	lua_settop(L, 1);
+	pushReadProxyState(L, 1);
+	lua_rawgeti(L, 2, kReadProxy_Table);
+	lua_len(L, 3);
+
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	if(hashReadValue(L, 4, &hasher))
+	{
+		lua_rawgeti(L, 2, kReadProxy_Root);
+		lua_rawgeti(L, 2, kReadProxy_Path);
+		recordRead(L, kReadKind_Length, -2, -1, finishHasher(&hasher));
+		lua_pop(L, 2);
+	}
+	else
+	{
+		markReadRootUncovered(L, 2);
+	}
+	return 1;
+}
+
+static int luaReadProxyNext(lua_State* L)
+{
+	lua_settop(L, 2);
+	pushReadProxyState(L, 1);
+	lua_rawgeti(L, 3, kReadProxy_Table);
+	lua_pushvalue(L, 2);
+	if(!lua_next(L, 4))
+		return 0;
+	pushReadValue(L, 3, 5, 6);
+	lua_pushvalue(L, 5);
+	lua_insert(L, -2);
+	return 2;
+}
+
+static int luaReadProxyPairs(lua_State* L)
+{
+	lua_settop(L, 1);
+	pushReadProxyState(L, 1);
+	lua_rawgeti(L, 2, kReadProxy_Table);
+
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	if(hashReadKeys(L, 3, &hasher))
+	{
+		lua_rawgeti(L, 2, kReadProxy_Root);
+		lua_rawgeti(L, 2, kReadProxy_Path);
+		recordRead(L, kReadKind_Keys, -2, -1, finishHasher(&hasher));
+		lua_pop(L, 2);
+	}
+	else
+	{
+		markReadRootUncovered(L, 2);
+	}
+
+	lua_pushcfunction(L, &luaReadProxyNext);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static void pushProxiedTable(
+	lua_State*	L,
+	int			index)
+{
+	index = lua_absindex(L, index);
+	lua_getfield(L, LUA_REGISTRYINDEX, kReadProxiesKey);
+	lua_pushvalue(L, index);
+	if(lua_rawget(L, -2) == LUA_TTABLE)
+		lua_rawgeti(L, -1, kReadProxy_Table);
+	else
+		lua_pushvalue(L, index);
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+}
+
+static int luaReadProxyEquals(lua_State* L)
+{
+	pushProxiedTable(L, 1);
+	pushProxiedTable(L, 2);
+	lua_pushboolean(L, lua_rawequal(L, -1, -2));
+	return 1;
+}
+
+static void installReadTracking(
+	lua_State*	L)
+{
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kModuleDependenciesKey);
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "k");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setfield(L, LUA_REGISTRYINDEX, kReadProxiesKey);
+
+	static luaL_Reg const kMetamethods[] =
+	{
+		{ "__index", &luaReadProxyIndex },
+		{ "__newindex", &luaReadProxyNewIndex },
+		{ "__len", &luaReadProxyLength },
+		{ "__pairs", &luaReadProxyPairs },
+		{ "__eq", &luaReadProxyEquals },
+		{ NULL, NULL },
+	};
+	luaL_newmetatable(L, kReadProxyMetatableKey);
+	luaL_setfuncs(L, kMetamethods, 0);
+	lua_pushboolean(L, 0);
+	lua_setfield(L, -2, "__metatable");
+	lua_pop(L, 1);
+}
+
+/*
+
+With `--track-reads`, `require` loads a module with the
+dependencies (and reads) of the file set aside, so that
+it gets a list of the files it was built from, which is
+recorded as a dependency of every file that requires the
+module. Modules that a module loads get plain tables.
+Templates (and code they call) get a proxy.
+
+*/
+static int luaTrackedRequireWithReads(lua_State* L)
+{
+	char const* name = luaL_checkstring(L, 1);
+	int argCount = lua_gettop(L);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, kModuleDependenciesKey);
+	int modulesIndex = lua_gettop(L);
+	int known = lua_getfield(L, modulesIndex, name) == LUA_TTABLE;
+	lua_getfield(L, LUA_REGISTRYINDEX, LUA_LOADED_TABLE);
+	known = known && lua_getfield(L, -1, name) != LUA_TNIL;
+	lua_settop(L, modulesIndex);
+
+	if(known)
+	{
+		lua_pushvalue(L, lua_upvalueindex(1));
+		for(int ii = 1; ii <= argCount; ii++)
+			lua_pushvalue(L, ii);
+		lua_call(L, argCount, 1);
+		lua_getfield(L, modulesIndex, name);
+		mergeDependencyTable(L, -1);
+		lua_pop(L, 1);
+	}
+	else
+	{
+		static char const* const kSetAsideKeys[] = { kDependenciesKey, kDirectFilesKey, kReadsKey, kReadRootsKey };
+		int const setAsideCount = (int) (sizeof(kSetAsideKeys) / sizeof(kSetAsideKeys[0]));
+		int setAsideIndex = lua_gettop(L) + 1;
+		for(int ii = 0; ii < setAsideCount; ii++)
+		{
+			lua_getfield(L, LUA_REGISTRYINDEX, kSetAsideKeys[ii]);
+			lua_pushnil(L);
+			lua_setfield(L, LUA_REGISTRYINDEX, kSetAsideKeys[ii]);
+		}
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, kDependenciesKey);
+
+		lua_pushvalue(L, lua_upvalueindex(1));
+		for(int ii = 1; ii <= argCount; ii++)
+			lua_pushvalue(L, ii);
+		int err = lua_pcall(L, argCount, 1, 0);
+
+		lua_getfield(L, LUA_REGISTRYINDEX, kDependenciesKey);
+		for(int ii = 0; ii < setAsideCount; ii++)
+		{
+			lua_pushvalue(L, setAsideIndex + ii);
+			lua_setfield(L, LUA_REGISTRYINDEX, kSetAsideKeys[ii]);
+		}
+		if(err == LUA_OK)
+		{
+			lua_pushvalue(L, -1);
+			lua_setfield(L, modulesIndex, name);
+		}
+		mergeDependencyTable(L, -1);
+		lua_pop(L, 1);
+		if(err != LUA_OK)
+			return lua_error(L);
+	}
+
+	int resultIndex = lua_gettop(L);
+	if(!isTrackingReads(L))
+		return 1;
+
+	lua_pushvalue(L, 1);
+	if(!lua_istable(L, resultIndex) || lua_getmetatable(L, resultIndex))
+	{
+		lua_settop(L, resultIndex + 1);
+		noteReadRoot(L, -1, 0);
+		lua_settop(L, resultIndex);
+		return 1;
+	}
+	noteReadRoot(L, -1, 1);
+	lua_pushliteral(L, "");
+	pushReadProxy(L, resultIndex, -2, -1);
+	return 1;
+}
+
+/*
+
+### Read Sets
+
+With `--track-reads`, Fiddle keeps the read set of each
+output (see Read Tracking, above) in a file next to it,
+named by appending `.reads` to the output's path. After
+a header keyed by the input (just like an output cache
+manifest), it holds a hash of the output, the
+dependencies (each marked with whether the read set
+covers it), and the reads of every root that covers its
+files, each as its hash and its key.
+
+The next time the input is processed, the output is up
+to date if it hasn't changed since we wrote it, the
+files that aren't covered have the same contents, and
+loading the roots again gives the same values for every
+read. Then we don't run the templates at all.
+
+*/
+static uint64_t hashOutputText(
+	char const*	begin,
+	char const*	end);
+
+static char const kReadSetMagic[8] = { 'F', 'I', 'D', 'D', 'L', 'E', 'R', 'S' };
+static char const kReadSetSuffix[] = ".reads";
+
+typedef struct Read
+{
+	char*		key;
+	size_t		keySize;
+	uint64_t	hash;
+} Read;
+
+typedef struct ReadSet
+{
+	Read*	items;
+	size_t	count;
+	size_t	capacity;
+} ReadSet;
+
+static void freeReadSet(
+	ReadSet*	reads)
+{
+	for(size_t ii = 0; ii < reads->count; ii++)
+		free(reads->items[ii].key);
+	free(reads->items);
+	reads->items = NULL;
+	reads->count = 0;
+	reads->capacity = 0;
+}
+
+static void addRead(
+	ReadSet*	reads,
+	char const*	key,
+	size_t		keySize,
+	uint64_t	hash)
+{
+	if(reads->count == reads->capacity)
+	{
+		size_t capacity = reads->capacity ? reads->capacity * 2 : 64;
+		Read* items = (Read*) realloc(reads->items, capacity * sizeof(Read));
+		if(!items)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		reads->items = items;
+		reads->capacity = capacity;
+	}
+
+	Read* read = &reads->items[reads->count++];
+	read->key = copyString(key, keySize);
+	read->keySize = keySize;
+	read->hash = hash;
+}
+
+static void beginReadTracking(
+	lua_State*	L)
+{
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kReadsKey);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kReadRootsKey);
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kDirectFilesKey);
+}
+
+/*
+
+`endReadTracking()` stops recording reads, moves those
+of the roots that cover their files into `reads`, and
+marks the covered files in `dependencies`. A file is
+covered if a root that covers its files was built from
+it, and no other root (or template) read it.
+
+*/
+static void endReadTracking(
+	lua_State*		L,
+	ReadSet*		reads,
+	DependencyList*	dependencies)
+{
+	int top = lua_gettop(L);
+	int readsIndex = top + 1;
+	int rootsIndex = top + 2;
+	int directIndex = top + 3;
+	int modulesIndex = top + 4;
+	int coverageIndex = top + 5;
+
+	lua_getfield(L, LUA_REGISTRYINDEX, kReadsKey);
+	lua_getfield(L, LUA_REGISTRYINDEX, kReadRootsKey);
+	lua_getfield(L, LUA_REGISTRYINDEX, kDirectFilesKey);
+	lua_getfield(L, LUA_REGISTRYINDEX, kModuleDependenciesKey);
+	lua_newtable(L);
+
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kReadsKey);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kReadRootsKey);
+	lua_pushnil(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, kDirectFilesKey);
+
+	if(!lua_istable(L, readsIndex) || !lua_istable(L, rootsIndex)
+		|| !lua_istable(L, directIndex) || !lua_istable(L, modulesIndex))
+	{
+		lua_settop(L, top);
+		return;
+	}
+
+	lua_pushnil(L);
+	while(lua_next(L, rootsIndex))
+	{
+		int covers = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		lua_pushvalue(L, -1);
+		if(lua_rawget(L, modulesIndex) == LUA_TTABLE)
+		{
+			size_t count = lua_rawlen(L, -1);
+			for(size_t ii = 0; ii < count; ii++)
+			{
+				lua_rawgeti(L, -1, (lua_Integer) ii + 1);
+				lua_pushvalue(L, -1);
+				if(lua_rawget(L, coverageIndex) == LUA_TNIL || !covers)
+				{
+					lua_pop(L, 1);
+					lua_pushboolean(L, covers);
+					lua_rawset(L, coverageIndex);
+				}
+				else
+				{
+					lua_pop(L, 2);
+				}
+			}
+		}
+		lua_pop(L, 1);
+	}
+
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		lua_getfield(L, coverageIndex, dependency->path);
+		lua_getfield(L, directIndex, dependency->path);
+		dependency->covered = lua_toboolean(L, -2) && !lua_toboolean(L, -1);
+		lua_pop(L, 2);
+	}
+
+	lua_pushnil(L);
+	while(lua_next(L, readsIndex))
+	{
+		size_t keySize = 0;
+		char const* key = lua_tolstring(L, -2, &keySize);
+		uint64_t rootSize = readLittleEndian64((uint8_t const*) key + 1);
+		lua_pushlstring(L, key + 9, (size_t) rootSize);
+		int covers = lua_rawget(L, rootsIndex) == LUA_TBOOLEAN && lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if(covers)
+			addRead(reads, key, keySize, (uint64_t) lua_tointeger(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_settop(L, top);
+}
+
+static char* pickReadSetPath(
+	char const*	outputPath)
+{
+	size_t size = strlen(outputPath);
+	char* path = (char*) malloc(size + sizeof(kReadSetSuffix));
+	if(!path)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(path, outputPath, size);
+	memcpy(path + size, kReadSetSuffix, sizeof(kReadSetSuffix));
+	return path;
+}
+
+/*
+
+`storeReadSet()` writes the read set of the output that
+the templates just wrote to `outputPath`. An output that
+is updated in place is the next input, so that is what
+its key comes from. If a file that isn't covered changed
+while the templates ran, we can't tell which version
+they saw, so we remove the read set instead.
+
+*/
+static void storeReadSet(
+	char const*		inputPath,
+	char const*		outputPath,
+	uint64_t		inputKey,
+	DependencyList*	dependencies,
+	ReadSet*		reads)
+{
+	char* path = pickReadSetPath(outputPath);
+
+	InputFile output;
+	char const* failure = NULL;
+	int ok = tryOpenInputFile(&output, outputPath, &failure);
+	uint64_t outputHash = 0;
+	if(ok)
+	{
+		outputHash = hashOutputText(output.text.begin, output.text.end);
+		if(strcmp(inputPath, outputPath) == 0)
+			inputKey = hashOutputCacheInput(inputPath, output.text);
+		closeInputFile(&output);
+	}
+
+	for(size_t ii = 0; ok && ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		if(!dependency->covered)
+			ok = hashDependencyFile(dependency->path, &dependency->hash) == dependency->exists;
+	}
+	if(!ok)
+	{
+		remove(path);
+		free(path);
+		return;
+	}
+
+	SkubWriter writer = { 0 };
+	reserveWriter(&writer, kOutputCacheHeaderSize);
+	writeCacheHeader(writer.cursor, kReadSetMagic, inputKey, dependencies->count);
+	writer.cursor += kOutputCacheHeaderSize;
+
+	char fields[24];
+	writeLittleEndian64(fields, outputHash);
+	writeBytes(&writer, fields, fields + 8);
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		size_t pathSize = strlen(dependency->path);
+		writeLittleEndian64(fields, dependency->covered ? 0 : dependency->hash);
+		writeLittleEndian64(fields + 8, (uint64_t) dependency->exists | ((uint64_t) dependency->covered << 1));
+		writeLittleEndian64(fields + 16, pathSize);
+		writeBytes(&writer, fields, fields + 24);
+		writeBytes(&writer, dependency->path, dependency->path + pathSize);
+	}
+
+	writeLittleEndian64(fields, reads->count);
+	writeBytes(&writer, fields, fields + 8);
+	for(size_t ii = 0; ii < reads->count; ii++)
+	{
+		Read* read = &reads->items[ii];
+		writeLittleEndian64(fields, read->hash);
+		writeLittleEndian64(fields + 8, read->keySize);
+		writeBytes(&writer, fields, fields + 16);
+		writeBytes(&writer, read->key, read->key + read->keySize);
+	}
+
+	if(!writeFileAtomically(path, writer.begin, writer.cursor))
+		reportError("cannot write '%s'", path);
+	free(writer.begin);
+	free(path);
+}
+
+static int readReadSet(
+	StringSpan		text,
+	uint64_t		inputKey,
+	uint64_t*		outOutputHash,
+	DependencyList*	dependencies,
+	ReadSet*		reads)
+{
+	uint64_t count = 0;
+	if(!checkCacheHeader(text, kReadSetMagic, inputKey, &count))
+		return 0;
+
+	uint8_t const* cursor = (uint8_t const*) text.begin + kOutputCacheHeaderSize;
+	uint8_t const* end = (uint8_t const*) text.end;
+	if(end - cursor < 8 || count > (uint64_t)(end - cursor) / 24)
+		return 0;
+	*outOutputHash = readLittleEndian64(cursor);
+	cursor += 8;
+
+	for(uint64_t ii = 0; ii < count; ii++)
+	{
+		if(end - cursor < 24)
+			return 0;
+		uint64_t hash = readLittleEndian64(cursor);
+		uint64_t flags = readLittleEndian64(cursor + 8);
+		uint64_t pathSize = readLittleEndian64(cursor + 16);
+		cursor += 24;
+		if(pathSize > (uint64_t)(end - cursor) || memchr(cursor, 0, (size_t) pathSize))
+			return 0;
+
+		Dependency* dependency = addDependency(dependencies, (char const*) cursor, (size_t) pathSize);
+		dependency->exists = (flags & 1) != 0;
+		dependency->covered = (flags & 2) != 0;
+		dependency->hash = hash;
+		cursor += pathSize;
+	}
+
+	if(end - cursor < 8)
+		return 0;
+	uint64_t readCount = readLittleEndian64(cursor);
+	cursor += 8;
+	if(readCount > (uint64_t)(end - cursor) / 16)
+		return 0;
+	for(uint64_t ii = 0; ii < readCount; ii++)
+	{
+		if(end - cursor < 16)
+			return 0;
+		uint64_t hash = readLittleEndian64(cursor);
+		uint64_t keySize = readLittleEndian64(cursor + 8);
+		cursor += 16;
+		if(keySize < 9 || keySize > (uint64_t)(end - cursor))
+			return 0;
+		addRead(reads, (char const*) cursor, (size_t) keySize, hash);
+		cursor += keySize;
+	}
+	return cursor == end;
+}
+
+static int pushDecodedReadKey(
+	lua_State*		L,
+	uint8_t const**	ioCursor,
+	uint8_t const*	end)
+{
+	uint8_t const* cursor = *ioCursor;
+	size_t available = (size_t)(end - cursor);
+	if(available >= 2 && cursor[0] == 'b')
+	{
+		lua_pushboolean(L, cursor[1]);
+		*ioCursor = cursor + 2;
+		return 1;
+	}
+	if(available < 9)
+		return 0;
+
+	uint64_t bits = readLittleEndian64(cursor + 1);
+	switch(cursor[0])
+	{
+	case 'i':
+		lua_pushinteger(L, (lua_Integer) bits);
+		break;
+
+	case 'f':
+		{
+			double number;
+			memcpy(&number, &bits, sizeof(number));
+			lua_pushnumber(L, (lua_Number) number);
+		}
+		break;
+
+	case 's':
+		if(bits > available - 9)
+			return 0;
+		lua_pushlstring(L, (char const*) cursor + 9, (size_t) bits);
+		*ioCursor = cursor + 9 + bits;
+		return 1;
+
+	default:
+		return 0;
+	}
+	*ioCursor = cursor + 9;
+	return 1;
+}
+
+static int isPlainTable(
+	lua_State*	L,
+	int			index)
+{
+	if(!lua_istable(L, index))
+		return 0;
+	if(!lua_getmetatable(L, index))
+		return 1;
+	lua_pop(L, 1);
+	return 0;
+}
+
+/*
+
+`luaCheckReads()` loads the roots of the read set it is
+given (as a light userdata), and returns whether every
+read still gives the same value. It runs in a protected
+call, since loading a module (or a read) may fail.
+
+*/
+static int luaCheckReads(lua_State* L)
+{
+	ReadSet* reads = (ReadSet*) lua_touserdata(L, 1);
+	lua_newtable(L);
+	int rootsIndex = lua_gettop(L);
+	int unchanged = 1;
+	for(size_t ii = 0; unchanged && ii < reads->count; ii++)
+	{
+		Read* read = &reads->items[ii];
+		uint8_t const* cursor = (uint8_t const*) read->key;
+		uint8_t const* end = cursor + read->keySize;
+		ReadKind kind = (ReadKind) cursor[0];
+		uint64_t rootSize = readLittleEndian64(cursor + 1);
+		cursor += 9;
+		if(rootSize > (uint64_t)(end - cursor))
+		{
+			unchanged = 0;
+			break;
+		}
+
+		lua_pushlstring(L, (char const*) cursor, (size_t) rootSize);
+		cursor += rootSize;
+		lua_pushvalue(L, -1);
+		if(lua_rawget(L, rootsIndex) == LUA_TNIL)
+		{
+			lua_pop(L, 1);
+			lua_getglobal(L, "require");
+			lua_pushvalue(L, -2);
+			lua_call(L, 1, 1);
+			lua_pushvalue(L, -2);
+			lua_pushvalue(L, -2);
+			lua_rawset(L, rootsIndex);
+		}
+
+		/* Every table on the path was a proxy, so it must still be a plain table */
+		int found = 1;
+		while(found && cursor != end)
+		{
+			found = isPlainTable(L, -1) && pushDecodedReadKey(L, &cursor, end);
+			if(found)
+			{
+				lua_rawget(L, -2);
+				lua_remove(L, -2);
+			}
+		}
+
+		Hasher hasher;
+		initHasher(&hasher, 0);
+		int hashed = 0;
+		if(found && kind == kReadKind_Value)
+		{
+			hashed = hashReadValue(L, -1, &hasher);
+		}
+		else if(found && kind == kReadKind_Length && isPlainTable(L, -1))
+		{
+			lua_len(L, -1);
+			hashed = hashReadValue(L, -1, &hasher);
+		}
+		else if(found && kind == kReadKind_Keys && isPlainTable(L, -1))
+		{
+			hashed = hashReadKeys(L, -1, &hasher);
+		}
+		unchanged = hashed && finishHasher(&hasher) == read->hash;
+		lua_settop(L, rootsIndex);
+	}
+	lua_pushboolean(L, unchanged);
+	return 1;
+}
+
+/*
+
+`checkReadSet()` returns whether the output of the
+input with the given key (whose current text is
+`output`) is up to date according to its read set. If
+it is, `dependencies` receives the dependencies it was
+generated from.
+
+*/
+static int checkReadSet(
+	lua_State*		L,
+	char const*		outputPath,
+	uint64_t		inputKey,
+	StringSpan		output,
+	DependencyList*	dependencies)
+{
+	char* path = pickReadSetPath(outputPath);
+	InputFile file;
+	memset(&file, 0, sizeof(InputFile));
+	if(!mapInputFile(&file, path))
+	{
+		free(path);
+		return 0;
+	}
+	free(path);
+
+	ReadSet reads;
+	memset(&reads, 0, sizeof(ReadSet));
+	uint64_t outputHash = 0;
+	int unchanged = readReadSet(file.text, inputKey, &outputHash, dependencies, &reads);
+	closeInputFile(&file);
+
+	unchanged = unchanged && outputHash == hashOutputText(output.begin, output.end);
+	for(size_t ii = 0; unchanged && ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		if(dependency->covered)
+			continue;
+		uint64_t hash = 0;
+		int exists = hashDependencyFile(dependency->path, &hash);
+		unchanged = exists == dependency->exists && hash == dependency->hash;
+	}
+
+	if(unchanged)
+	{
+		lua_pushcfunction(L, &luaCheckReads);
+		lua_pushlightuserdata(L, &reads);
+		unchanged = lua_pcall(L, 1, 1, 0) == LUA_OK && lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+
+	freeReadSet(&reads);
+	if(!unchanged)
+		freeDependencyList(dependencies);
+	return unchanged;
+}
+
+/*
+
+### Stamps
+
+With `--stamp`, Fiddle records hashes on the marker
+lines of embedded templates, so that `--check` can tell
+whether a file is up to date without running any Lua:
+
+    // FIDDLE OUTPUT: [fiddle:8c1f0e4a2b7d9c13 model.lua]
+    ...
+    // FIDDLE END [fiddle:0f3e5d2c1b4a6978]
+
+The stamp on an `OUTPUT` line is a hash of the templates
+in the file (all of which run as a single Lua function),
+along with the contents of every file they read (or
+looked for and didn't find). The first `OUTPUT` line also
+lists those files, so that we can hash them again. The
+stamp on an `END` line is a hash of the output above it.
+
+A stamp goes right after the marker keyword (and its `:`,
+if it has one), replacing any stamp that is already
+there, and the rest of the line is left alone. Paths are
+escaped with `%XX` sequences, so that they can't contain
+spaces, `]`, or anything that would end a comment.
+
+*/
+static char const kStampPrefix[] = "[fiddle:";
+enum { kStampPrefixSize = sizeof(kStampPrefix) - 1 };
+
+static uint64_t hashTemplateInputs(
+	ParsedFile*		file,
+	LineEnding		lineEnding,
+	DependencyList*	dependencies)
+{
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashString(&hasher, "fiddle-stamp " FIDDLE_VERSION " " LUA_RELEASE);
+	hashInteger(&hasher, gIncludePath != NULL);
+	hashString(&hasher, gIncludePath ? gIncludePath : "");
+	hashInteger(&hasher, lineEnding);
+
+	for(size_t ii = 0; ii < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		hashSpan(&hasher, chunk->code);
+		hashInteger(&hasher, chunk->linePrefix.end - chunk->linePrefix.begin);
+	}
+	for(size_t ii = 0; ii < dependencies->count; ii++)
+	{
+		Dependency* dependency = &dependencies->items[ii];
+		hashString(&hasher, dependency->path);
+		hashInteger(&hasher, dependency->exists);
+		hashInteger(&hasher, dependency->hash);
+	}
+	return finishHasher(&hasher);
+}
+
+static uint64_t hashOutputText(
+	char const*	begin,
+	char const*	end)
+{
+	StringSpan span;
+	span.begin = begin;
+	span.end = end;
+
+	Hasher hasher;
+	initHasher(&hasher, 0);
+	hashSpan(&hasher, span);
+	return finishHasher(&hasher);
+}
+
+/*
+
+Each chunk of a file with embedded templates (but the
+first) starts with the `END` line of the template
+before it, and each chunk (but the last) ends with the
+`OUTPUT` line of its own template. We find those lines
+without their line breaks.
+
+*/
+static StringSpan firstLineOf(
+	StringSpan	span)
+{
+	span.end = findLineBreak(span.begin, span.end);
+	return span;
+}
+
+static StringSpan lastLineOf(
+	StringSpan	span)
+{
+	char const* end = span.end;
+	if(end != span.begin && (end[-1] == '\r' || end[-1] == '\n'))
+	{
+		end--;
+		if(end != span.begin && (end[-1] ^ end[0]) == ('\r' ^ '\n'))
+			end--;
+	}
+	span.begin = findLineStart(span.begin, end);
+	span.end = end;
+	return span;
+}
+
+/*
+
+`findStampSite()` finds where the stamp goes in a marker
+line: `outBegin` is just past the keyword, and `outEnd`
+just past any stamp that is already there.
+
+*/
+static int findStampSite(
+	StringSpan		line,
+	MarkerKind		kind,
+	char const**	outBegin,
+	char const**	outEnd)
+{
+	char const* cursor = line.begin;
+	char const* marker = NULL;
+	for(;;)
+	{
+		MarkerKind found;
+		marker = findMarker(cursor, line.end, &found);
+		if(!marker)
+			return 0;
+		if(found == kind)
+			break;
+		cursor = marker + kMarkerPrefixSize;
+	}
+
+	char const* site = marker + kMarkerPrefixSize + (kind == kMarkerKind_Output ? 6 : 3);
+	if(site != line.end && *site == ':')
+		site++;
+
+	char const* stampEnd = site;
+	char const* stamp = site;
+	while(stamp != line.end && *stamp == ' ')
+		stamp++;
+	if(matchesAt(stamp, line.end, kStampPrefix, kStampPrefixSize))
+	{
+		char const* close = (char const*) memchr(stamp, ']', line.end - stamp);
+		if(close)
+			stampEnd = close + 1;
+	}
+
+	*outBegin = site;
+	*outEnd = stampEnd;
+	return 1;
+}
+
+static void writeStamp(
+	SkubWriter*		writer,
+	uint64_t		hash,
+	DependencyList*	dependencies)
+{
+	char hex[17];
+	formatHash(hash, hex);
+	writeRawT(writer, " ");
+	writeRawT(writer, kStampPrefix);
+	writeRawT(writer, hex);
+
+	for(size_t ii = 0; dependencies && ii < dependencies->count; ii++)
+	{
+		writeRawT(writer, " ");
+		for(char const* cc = dependencies->items[ii].path; *cc; cc++)
+		{
+			unsigned char c = (unsigned char) *cc;
+			if(c <= ' ' || c >= 0x7F || c == '%' || c == ']' || c == '*')
+			{
+				char escape[4];
+				snprintf(escape, sizeof(escape), "%%%02X", c);
+				writeBytes(writer, escape, escape + 3);
+			}
+			else
+			{
+				writeBytes(writer, cc, cc + 1);
+			}
+		}
+	}
+	writeRawT(writer, "]");
+}
+
+static int readHexDigit(
+	char	c)
+{
+	if(c >= '0' && c <= '9') return c - '0';
+	if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+/*
+
+`readStamp()` reads the stamp on a marker line, along
+with the dependencies it lists if `dependencies` isn't
+`NULL`. It returns zero if there is no valid stamp.
+
+*/
+static int readStamp(
+	StringSpan		line,
+	MarkerKind		kind,
+	uint64_t*		outHash,
+	DependencyList*	dependencies)
+{
+	char const* site = NULL;
+	char const* stampEnd = NULL;
+	if(!findStampSite(line, kind, &site, &stampEnd) || stampEnd == site)
+		return 0;
+
+	char const* cursor = (char const*) memchr(site, '[', stampEnd - site) + kStampPrefixSize;
+	char const* end = stampEnd - 1;
+
+	uint64_t hash = 0;
+	for(int ii = 0; ii < 16; ii++)
+	{
+		int digit = cursor != end ? readHexDigit(*cursor++) : -1;
+		if(digit < 0)
+			return 0;
+		hash = (hash << 4) | (uint64_t) digit;
+	}
+	*outHash = hash;
+
+	while(cursor != end)
+	{
+		if(*cursor++ != ' ' || !dependencies)
+			return 0;
+
+		char const* pathEnd = (char const*) memchr(cursor, ' ', end - cursor);
+		if(!pathEnd)
+			pathEnd = end;
+
+		Dependency* dependency = addDependency(dependencies, cursor, pathEnd - cursor);
+		char* output = dependency->path;
+		for(char const* cc = cursor; cc != pathEnd; cc++)
+		{
+			char c = *cc;
+			if(c == '%')
+			{
+				int high = pathEnd - cc > 2 ? readHexDigit(cc[1]) : -1;
+				int low = pathEnd - cc > 2 ? readHexDigit(cc[2]) : -1;
+				if(high < 0 || low < 0 || (high | low) == 0)
+					return 0;
+				c = (char)(high * 16 + low);
+				cc += 2;
+			}
+			*output++ = c;
+		}
+		*output = 0;
+		cursor = pathEnd;
+	}
+	return 1;
+}
+
+/*
+
+`checkStamps()` checks whether a file with embedded
+templates has stamps everywhere, and all of them still
+match. If so, running its templates would change nothing.
+
+*/
+static int checkStamps(
+	ParsedFile*	file,
+	LineEnding	lineEnding)
+{
+	if(file->chunkCount < 2)
+		return 0;
+
+	DependencyList dependencies;
+	memset(&dependencies, 0, sizeof(DependencyList));
+
+	int ok = 1;
+	uint64_t inputHash = 0;
+	for(size_t ii = 0; ok && ii + 1 < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		uint64_t hash = 0;
+		ok = readStamp(lastLineOf(chunk->prefix), kMarkerKind_Output, &hash,
+			ii == 0 ? &dependencies : NULL);
+		if(ii == 0)
+			inputHash = hash;
+		ok = ok && hash == inputHash;
+
+		ok = ok && chunk->outputSpan.begin <= chunk->outputSpan.end
+			&& readStamp(firstLineOf(file->chunks[ii + 1].prefix), kMarkerKind_End, &hash, NULL)
+			&& hash == hashOutputText(chunk->outputSpan.begin, chunk->outputSpan.end);
+	}
+
+	if(ok)
+	{
+		refreshDependencyHashes(&dependencies);
+		ok = hashTemplateInputs(file, lineEnding, &dependencies) == inputHash;
+	}
+	freeDependencyList(&dependencies);
+	return ok;
+}
+
+/*
+
+When stamping, the expansion of a file is collected in
+memory, with the offset of each `_PASS()` call noted, so
+that we can find the marker lines (and the output of each
+template) once every dependency is known.
+
+`writeStampedMarkerLine()` writes a marker line to the
+stream with a new stamp.
+
+*/
+static void writeStreamText(
+	OutputStream*	stream,
+	char const*		begin,
+	char const*		end)
+{
+	StringSpan span;
+	span.begin = begin;
+	span.end = end;
+	writeStreamSpans(stream, &span, 1);
+}
+
+static void writeStampedMarkerLine(
+	OutputStream*	stream,
+	StringSpan		line,
+	MarkerKind		kind,
+	uint64_t		hash,
+	DependencyList*	dependencies)
+{
+	char const* site = NULL;
+	char const* stampEnd = NULL;
+	if(!findStampSite(line, kind, &site, &stampEnd))
+	{
+		writeStreamText(stream, line.begin, line.end);
+		return;
+	}
+
+	SkubWriter stamp = { 0 };
+	writeStamp(&stamp, hash, dependencies);
+
+	StringSpan spans[3];
+	spans[0].begin = line.begin;
+	spans[0].end = site;
+	spans[1].begin = stamp.begin;
+	spans[1].end = stamp.cursor;
+	spans[2].begin = stampEnd;
+	spans[2].end = line.end;
+	writeStreamSpans(stream, spans, 3);
+	free(stamp.begin);
+}
+
+/*
+
+`writeStampedOutput()` writes the expansion collected in
+`output` to the stream, adding stamps to the marker lines.
+If the templates didn't call `_PASS()` exactly once for
+each chunk, in order, we can't tell where the marker lines
+ended up, and write the expansion without stamps.
+
+*/
+static void writeStampedOutput(
+	OutputStream*	stream,
+	TemplateOutput*	output,
+	DependencyList*	dependencies)
+{
+	ParsedFile* file = output->parsed;
+	char const* text = output->writer.begin;
+	char const* textEnd = output->writer.cursor;
+
+	int canStamp = output->passCount == file->chunkCount;
+	for(size_t ii = 0; canStamp && ii < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		size_t prefixEnd = output->passOffsets[ii] + (chunk->prefix.end - chunk->prefix.begin);
+		size_t nextPass = ii + 1 < file->chunkCount
+			? output->passOffsets[ii + 1]
+			: (size_t)(textEnd - text);
+		canStamp = prefixEnd <= nextPass && chunk->outputSpan.begin <= chunk->outputSpan.end;
+	}
+	if(!canStamp)
+	{
+		writeStreamText(stream, text, textEnd);
+		return;
+	}
+
+	refreshDependencyHashes(dependencies);
+	uint64_t inputHash = hashTemplateInputs(file, output->lineEnding, dependencies);
+
+	uint64_t outputHash = 0;
+	for(size_t ii = 0; ii < file->chunkCount; ii++)
+	{
+		Chunk* chunk = &file->chunks[ii];
+		StringSpan prefix = chunk->prefix;
+		char const* cursor = prefix.begin;
+		if(ii > 0)
+		{
+			StringSpan line = firstLineOf(prefix);
+			writeStampedMarkerLine(stream, line, kMarkerKind_End, outputHash, NULL);
+			cursor = line.end;
+		}
+		if(ii + 1 < file->chunkCount)
+		{
+			StringSpan line = lastLineOf(prefix);
+			writeStreamText(stream, cursor, line.begin);
+			writeStampedMarkerLine(stream, line, kMarkerKind_Output, inputHash,
+				ii == 0 ? dependencies : NULL);
+			cursor = line.end;
+		}
+		writeStreamText(stream, cursor, prefix.end);
+
+		char const* generated = text + output->passOffsets[ii] + (prefix.end - prefix.begin);
+		char const* generatedEnd = ii + 1 < file->chunkCount
+			? text + output->passOffsets[ii + 1]
+			: textEnd;
+		writeStreamText(stream, generated, generatedEnd);
+		outputHash = hashOutputText(generated, generatedEnd);
+	}
+}
+
+/*
+
+### Watching
+
+With `--watch`, Fiddle keeps running once it has
+processed its inputs, and processes a file again
+whenever it (or any file its templates read) changes.
+To know which files those are, we remember every file we
+process, along with the files its templates read.
+
+Paths reach us in many forms (relative to the current
+directory, or to the include path), so we compare them
+by a key: the real path of the directory holding the
+file, followed by the file's name. This works even for
+files that don't exist (yet).
+
+We also remember the modification time and size of each
+file once we are done with it, so that we can ignore the
+change we made ourselves when updating a file in place.
+
+*/
+static int gWatching = 0;
+
+typedef struct WatchedFile
+{
+	char*		path;
+	char*		key;
+	FileStamp	stamp;
+	int			hasStamp;
+
+	char**		dependencyKeys;
+	size_t		dependencyCount;
+
+	/* Whether the loop still has to watch the directories of these files */
+	int			unwatched;
+	int			affected;
+} WatchedFile;
+
+static FiddleMutex gWatchLock;
+static WatchedFile* gWatchedFiles = NULL;
+static size_t gWatchedFileCount = 0;
+static size_t gWatchedFileCapacity = 0;
+
+static char* makeWatchKey(
+	char const*	path)
+{
+	char const* name = path;
+	for(char const* cursor = path; *cursor; cursor++)
+	{
+		if(*cursor == '/' || *cursor == '\\')
+			name = cursor + 1;
+	}
+	if(!*name || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return NULL;
+
+	char* directory = copyString(path, name - path);
+#ifdef _WIN32
+	char* realDirectory = _fullpath(NULL, *directory ? directory : ".", 0);
+#else
+	char* realDirectory = realpath(*directory ? directory : ".", NULL);
+#endif
+	free(directory);
+	if(!realDirectory)
+		return NULL;
+
+	size_t directorySize = strlen(realDirectory);
+	size_t nameSize = strlen(name);
+	char* key = (char*) malloc(directorySize + nameSize + 2);
+	if(!key)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(key, realDirectory, directorySize);
+	if(directorySize && realDirectory[directorySize - 1] != '/')
+		key[directorySize++] = '/';
+	memcpy(key + directorySize, name, nameSize + 1);
+	free(realDirectory);
+	return key;
+}
+
+static WatchedFile* findWatchedFile(
+	char const*	key)
+{
+	for(size_t ii = 0; ii < gWatchedFileCount; ii++)
+	{
+		if(strcmp(gWatchedFiles[ii].key, key) == 0)
+			return &gWatchedFiles[ii];
+	}
+	return NULL;
+}
+
+/*
+
+`recordWatchedFile()` remembers that we processed the
+file at `path`, and which files its templates read (if
+`dependencies` isn't `NULL`). It can be called from any
+worker.
+
+*/
+static void recordWatchedFile(
+	char const*		path,
+	DependencyList*	dependencies)
+{
+	char* key = makeWatchKey(path);
+	if(!key)
+		return;
+
+	char** dependencyKeys = NULL;
+	size_t dependencyCount = 0;
+	if(dependencies && dependencies->count)
+	{
+		dependencyKeys = (char**) calloc(dependencies->count, sizeof(char*));
+		if(!dependencyKeys)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		for(size_t ii = 0; ii < dependencies->count; ii++)
+		{
+			char* dependencyKey = makeWatchKey(dependencies->items[ii].path);
+			if(dependencyKey)
+				dependencyKeys[dependencyCount++] = dependencyKey;
+		}
+	}
+
+	FileStamp stamp;
+	int hasStamp = readFileStamp(path, &stamp);
+
+	lockMutex(&gWatchLock);
+	WatchedFile* file = findWatchedFile(key);
+	if(!file)
+	{
+		if(gWatchedFileCount == gWatchedFileCapacity)
+		{
+			size_t capacity = gWatchedFileCapacity ? gWatchedFileCapacity * 2 : 64;
+			WatchedFile* files = (WatchedFile*) realloc(gWatchedFiles, capacity * sizeof(WatchedFile));
+			if(!files)
+			{
+				fprintf(stderr, "fiddle: memory allocation failed\n");
+				exit(1);
+			}
+			gWatchedFiles = files;
+			gWatchedFileCapacity = capacity;
+		}
+		file = &gWatchedFiles[gWatchedFileCount++];
+		memset(file, 0, sizeof(WatchedFile));
+		file->path = copyString(path, strlen(path));
+		file->key = key;
+		key = NULL;
+	}
+	for(size_t ii = 0; ii < file->dependencyCount; ii++)
+		free(file->dependencyKeys[ii]);
+	free(file->dependencyKeys);
+	file->dependencyKeys = dependencyKeys;
+	file->dependencyCount = dependencyCount;
+	file->stamp = stamp;
+	file->hasStamp = hasStamp;
+	file->unwatched = 1;
+	unlockMutex(&gWatchLock);
+
+	free(key);
+}
+
+/*
+
+Files don't share globals: the templates of each file
+run with a fresh table of their own as `_ENV`, which
+falls back to the real globals for anything it doesn't
+define. The standard libraries, modules loaded with
+`require`, and whatever a prelude defined all stay
+visible, without the cost of a new Lua state per file.
+Within the file, `_G` is the file's own table too.
+
+Tables reachable from the real globals (a module, say)
+are still shared, so changes made to them are seen by
+later files.
+
+*/
+static char const kEnvironmentMetatableKey[] = "fiddle.environmentMetatable";
+
+static void pushFileEnvironment(
+	lua_State*	L)
+{
+	lua_newtable(L);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "_G");
+	if(luaL_newmetatable(L, kEnvironmentMetatableKey))
+	{
+		lua_pushglobaltable(L);
+		lua_setfield(L, -2, "__index");
+	}
+	lua_setmetatable(L, -2);
+}
+
+/*
+
+`runTemplates()` runs the templates of a parsed file,
+writing their expansion to `templateOutput`. If
+`dependencies` isn't `NULL`, it receives the files the
+templates read, and if `reads` isn't `NULL` either, it
+receives their read set. It returns zero if the
+templates failed.
+
+*/
+static int runTemplates(
+	lua_State*		L,
+	char const*		inputPath,
+	TemplateOutput*	templateOutput,
+	DependencyList*	dependencies,
+	ReadSet*		reads)
+{
+	ParsedFile* parsed = templateOutput->parsed;
+	FileStats* stats = tFileStats;
+	uint64_t phaseStart = stats ? readClock() : 0;
+
+	char* luaFileName = (char*)
+		malloc(strlen(inputPath) + 2);
+	luaFileName[0] = '@';
+	memcpy(luaFileName + 1, inputPath, strlen(inputPath) + 1);
+	/*
+
+	If we have a cached compilation of the code for
+	this file, we can skip straight to running it.
+
+	*/
+	uint64_t cacheKey = 0;
+	char* cachePath = NULL;
+	int loaded = 0;
+	int resident = 0;
+	if(gCacheDir || gKeepLuaStates)
+		cacheKey = hashGeneratedCode(parsed, luaFileName);
+	if(gKeepLuaStates)
+		loaded = resident = loadResidentTemplate(L, cacheKey);
+	if(gCacheDir && !loaded)
+	{
+		cachePath = pickBytecodeCachePath(cacheKey);
+		if(cachePath)
+			loaded = loadCachedBytecode(L, cachePath, cacheKey, luaFileName);
+	}
+	int err = LUA_OK;
+	if(!loaded)
+	{
+		/*
+
+		Otherwise, we will generate Lua source code
+		to perform the actual code generation logic
+		for this file.
+
+		*/
+		LuaGenerator generator;
+		initLuaGenerator(&generator, parsed);
+		err = lua_load(
+			L,
+			&luaGenerateCallback,
+			(void*) &generator,
+			luaFileName,
+			"t");
+		freeLuaGenerator(&generator);
+
+		/* The code is generated as `lua_load()` asks for it */
+		if(stats)
+		{
+			stats->phaseTimes[kStatsPhase_Generate] += generator.generateTime;
+			stats->counts[kStatsCounter_LuaBytes] += generator.generatedSize;
+			phaseStart += generator.generateTime;
+		}
+
+		if(err == LUA_OK && cachePath)
+			storeCachedBytecode(L, cachePath, cacheKey);
+	}
+	if(err == LUA_OK && gKeepLuaStates && !resident)
+		storeResidentTemplate(L, cacheKey);
+	free(cachePath);
+	free(luaFileName);
+	endStatsPhase(stats, kStatsPhase_Load, phaseStart);
+	if(err != LUA_OK)
+	{
+		reportError("%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	/*
+
+	The generated code takes the output buffer, along
+	with the `_RAW`, `_SPLICE` and `_PASS` functions
+	bound to it. We keep a reference to the buffer
+	below the function, so that we can invalidate it
+	once the code has run.
+
+	*/
+	TemplateOutput** outputSlot = pushOutputBuffer(L, templateOutput);
+	lua_insert(L, -2);
+	int outputIndex = lua_gettop(L) - 1;
+
+	/*
+
+	A resident template runs again for a later file, so
+	we also keep the function, to detach this file's
+	environment from it afterwards.
+
+	*/
+	int functionIndex = lua_gettop(L);
+
+	/*
+
+	The prologue of the generated code only sets
+	`fiddle_write` and `fiddle_output` in the file's own
+	environment, which module code can't see. We also
+	set them in the real globals while the file runs,
+	and keep their old values to restore afterwards.
+
+	*/
+	int savedIndex = lua_gettop(L) + 1;
+	lua_getglobal(L, "fiddle_write");
+	lua_getglobal(L, "fiddle_output");
+
+	lua_pushvalue(L, functionIndex);
+	pushFileEnvironment(L);
+	lua_setupvalue(L, -2, 1);
+
+	lua_pushvalue(L, outputIndex);
+	lua_pushvalue(L, -1);
+	lua_setglobal(L, "fiddle_output");
+
+	lua_pushvalue(L, outputIndex);
+	lua_pushcclosure(L, &luaRawCallback, 1);
+	lua_pushvalue(L, -1);
+	lua_setglobal(L, "fiddle_write");
+
+	lua_pushvalue(L, outputIndex);
+	lua_pushcclosure(L, &luaSpliceCallback, 1);
+
+	lua_pushvalue(L, outputIndex);
+	lua_pushcclosure(L, &luaPassCallback, 1);
+
+	if(dependencies)
+		beginDependencyTracking(L);
+	if(dependencies && reads)
+		beginReadTracking(L);
+
+	phaseStart = stats ? readClock() : 0;
+	err = lua_pcall(L, 4, 0, 0);
+	endStatsPhase(stats, kStatsPhase_Run, phaseStart);
+	*outputSlot = NULL;
+
+	if(dependencies)
+		endDependencyTracking(L, dependencies);
+	if(dependencies && reads)
+		endReadTracking(L, reads, dependencies);
+
+	if(err != LUA_OK)
+	{
+		reportError("%s", lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+	lua_pushvalue(L, savedIndex);
+	lua_setglobal(L, "fiddle_write");
+	lua_pushvalue(L, savedIndex + 1);
+	lua_setglobal(L, "fiddle_output");
+
+	lua_pushglobaltable(L);
+	lua_setupvalue(L, functionIndex, 1);
+	lua_pop(L, 4);
+	return err == LUA_OK;
+}
+
+static void processInput(
+	lua_State* 	L,
+	char const* inputPath,
+	InputFile*	input,
+	MemoryArena* arena)
+{
+	StringSpan span = input->text;
+	char const* outputPath = 0;
+	char* allocatedOutputPath = 0;
+	FileStats* stats = tFileStats;
+	uint64_t phaseStart = stats ? readClock() : 0;
+	/*
+
+	The input file will need tobe parsed
+	differently based on whether it is a
+	template file, or a source file with
+	embedded templates. This will also
+	determine how we derive a default
+	output path.
+
+	*/
+	ParsedFile parsed;
+	initParsedFile(&parsed, arena);
+
+	int hasTemplates = 0;
+	int isEmbedded = 0;
+	char const* templateSuffix = ".fiddle";
+	char const* literateSuffix = ".md";
+	if(stringEndsWith(inputPath, templateSuffix))
+	{
+		// Need to trim the end of the path
+		allocatedOutputPath = pickOutputPath(inputPath, templateSuffix);
+		outputPath = allocatedOutputPath;
+
+		hasTemplates = parseTemplateFile(&parsed, span.begin, span.end);
+	}
+	else if(stringEndsWith(inputPath, literateSuffix))
+	{
+		allocatedOutputPath = pickOutputPath(inputPath, literateSuffix);
+		outputPath = allocatedOutputPath;
+		assert(!"literate mode not implemented");
+	}
+	else
+	{
+		/*
+
+		If the input is a source file, then by
+		default output will be written to the
+		same file.
+
+		*/
+		outputPath = inputPath;
+		/*
+
+		We need to parse the input text into
+		an AST representing the file and any
+		embedded templates.
+
+		*/
+		hasTemplates = parseSourceFile(&parsed, span.begin, span.end);
+		isEmbedded = 1;
+	}
+	/*
+
+	If we encountered any errors parsing the source
+	file, or if there were no embedded templates found
+	in a source file, then `hasTemplates` will be zero.
+	In that case there is nothing to be done with
+	this file, and we skip the output generation steps.
+
+	*/
+	if(!hasTemplates)
+	{
+		endStatsPhase(stats, kStatsPhase_Parse, phaseStart);
+		if(gWatching)
+			recordWatchedFile(inputPath, NULL);
+		free(allocatedOutputPath);
+		return;
+	}
+	/*
+
+	Regardless of the output path we would choose
+	by default, the user can override it with the `-o`
+	command line option, which sets `gOutputPath`
+
+	*/
+	if(gOutputPath)
+	{
+		outputPath = gOutputPath;
+	}
+	countChunkLines(&parsed);
+	endStatsPhase(stats, kStatsPhase_Parse, phaseStart);
+	if(stats)
+	{
+		stats->counts[kStatsCounter_Chunks] += parsed.chunkCount;
+		stats->counts[kStatsCounter_Nodes] += parsed.nodeCount;
+	}
+
+	LineEnding lineEnding = detectLineEnding(span);
+	int inPlace = strcmp(outputPath, inputPath) == 0;
+
+	/*
+
+	With `--check`, a file updated in place whose stamps
+	all match needs nothing more from us.
+
+	*/
+	if(gCheckOutputs && isEmbedded && inPlace && checkStamps(&parsed, lineEnding))
+	{
+		free(allocatedOutputPath);
+		return;
+	}
+
+	/*
+
+	The expansion is streamed to a temporary file next
+	to the output, through a fixed-size buffer, but only
+	once it differs from what the output file already
+	holds. When a source file is updated in place, that
+	is the input text itself.
+
+	*/
+	InputFile existingOutput;
+	memset(&existingOutput, 0, sizeof(InputFile));
+	StringSpan* baseline = NULL;
+	if(inPlace)
+	{
+		baseline = &input->text;
+	}
+	else
+	{
+		char const* failure = NULL;
+		if(tryOpenInputFile(&existingOutput, outputPath, &failure))
+			baseline = &existingOutput.text;
+	}
+
+	/* Without a path, the stream only compares (for `--check`) */
+	char* tempPath = NULL;
+	if(!gCheckOutputs)
+	{
+		tempPath = makeTemporaryPath(outputPath);
+		if(!tempPath)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+	}
+	OutputStream stream;
+	initOutputStream(&stream, tempPath, outputPath, baseline);
+
+	/*
+
+	If the output cache has an entry for this input that
+	is still valid, we can use its output instead of
+	running the templates.
+
+	*/
+	DependencyList dependencies;
+	memset(&dependencies, 0, sizeof(DependencyList));
+	uint64_t outputCacheKey = 0;
+	int cacheHit = 0;
+	if(gOutputCacheDir)
+	{
+		InputFile cachedOutput;
+		StringSpan cachedText;
+		outputCacheKey = hashOutputCacheInput(inputPath, span);
+		cacheHit = lookUpCachedOutput(outputCacheKey, &cachedOutput, &cachedText, &dependencies);
+		if(cacheHit)
+		{
+			writeStreamSpans(&stream, &cachedText, 1);
+			closeInputFile(&cachedOutput);
+		}
+	}
+
+	/*
+
+	With `--track-reads`, the output is up to date if
+	nothing in its read set has changed, and then there
+	is nothing to write.
+
+	*/
+	int tracksReads = gTrackReads && !gCheckOutputs;
+	uint64_t readSetKey = 0;
+	int readsUnchanged = 0;
+	ReadSet reads;
+	memset(&reads, 0, sizeof(ReadSet));
+	if(tracksReads && !cacheHit)
+	{
+		readSetKey = hashOutputCacheInput(inputPath, span);
+		readsUnchanged = baseline
+			&& checkReadSet(L, outputPath, readSetKey, *baseline, &dependencies);
+	}
+
+	/*
+
+	Stamps depend on every file the templates read, so
+	when stamping we collect the whole expansion before
+	writing any of it.
+
+	*/
+	int ok = cacheHit || readsUnchanged;
+	phaseStart = stats ? readClock() : 0;
+	if(!ok)
+	{
+		int stamping = gStampOutputs && isEmbedded;
+
+		TemplateOutput templateOutput;
+		memset(&templateOutput, 0, sizeof(TemplateOutput));
+		templateOutput.parsed = &parsed;
+		templateOutput.lineEnding = lineEnding;
+		if(stamping)
+		{
+			templateOutput.passOffsets = (size_t*) calloc(parsed.chunkCount, sizeof(size_t));
+			if(!templateOutput.passOffsets)
+			{
+				fprintf(stderr, "fiddle: memory allocation failed\n");
+				exit(1);
+			}
+		}
+		else
+		{
+			templateOutput.writer.stream = &stream;
+		}
+		reserveWriter(&templateOutput.writer, kOutputBlockSize);
+
+		ok = runTemplates(L, inputPath, &templateOutput,
+			gTrackDependencies ? &dependencies : NULL,
+			tracksReads ? &reads : NULL);
+		if(stats)
+		{
+			phaseStart = readClock();
+			stats->counts[kStatsCounter_RawCalls] += templateOutput.rawCallCount;
+			stats->counts[kStatsCounter_SpliceCalls] += templateOutput.spliceCallCount;
+		}
+		if(gPreludePath && gTrackDependencies)
+			mergeDependencies(&dependencies, &gPreludeDependencies);
+
+		flushWriter(&templateOutput.writer);
+		if(ok && stamping)
+			writeStampedOutput(&stream, &templateOutput, &dependencies);
+
+		free(templateOutput.passOffsets);
+		free(templateOutput.writer.begin);
+	}
+
+	/*
+
+	With `--check`, we only report whether the output
+	would have changed.
+
+	*/
+	if(gCheckOutputs)
+	{
+		if(ok && !outputStreamMatches(&stream))
+			reportError("'%s' is out of date", outputPath);
+		endStatsPhase(stats, kStatsPhase_Write, phaseStart);
+		if(stats)
+			stats->counts[kStatsCounter_OutputBytes] += stream.outputSize;
+
+		closeInputFile(&existingOutput);
+		closeInputFile(input);
+		freeReadSet(&reads);
+		freeDependencyList(&dependencies);
+		free(allocatedOutputPath);
+		return;
+	}
+
+	/*
+
+	If the template code fails, the output is left as
+	it was.
+
+	*/
+	OutputStreamResult result = kOutputStream_Unchanged;
+	if(ok && !readsUnchanged)
+		result = closeOutputStream(&stream);
+	else
+		discardOutputStream(&stream);
+
+	/*
+
+	The expansion no longer refers to the input text
+	(or the old output), so we can release them before
+	replacing the output. Some platforms refuse to
+	replace a mapped file.
+
+	*/
+	closeInputFile(&existingOutput);
+	closeInputFile(input);
+
+	if(result == kOutputStream_Failed
+		|| (result == kOutputStream_Written && !replaceFile(tempPath, outputPath)))
+	{
+		reportError("cannot write '%s'", outputPath);
+		remove(tempPath);
+		ok = 0;
+	}
+
+	if(ok && gWriteDepfiles)
+		writeDependencyFile(inputPath, outputPath, &dependencies);
+	if(ok && !cacheHit && gOutputCacheDir)
+		storeCachedOutput(outputCacheKey, &dependencies, outputPath);
+	if(ok && !cacheHit && !readsUnchanged && tracksReads)
+		storeReadSet(inputPath, outputPath, readSetKey, &dependencies, &reads);
+	endStatsPhase(stats, kStatsPhase_Write, phaseStart);
+	if(stats)
+		stats->counts[kStatsCounter_OutputBytes] += stream.outputSize;
+
+	/* Even if the templates failed, a change to what they read may fix them */
+	if(gWatching)
+		recordWatchedFile(inputPath, &dependencies);
+
+	freeReadSet(&reads);
+	freeDependencyList(&dependencies);
+	free(tempPath);
+	free(allocatedOutputPath);
+}
+
+/*
+
+`openInputFile()` is like `tryOpenInputFile()`, but
+prints a diagnostic when it fails.
+
+*/
+static int openInputFile(
+	InputFile*	file,
+	char const*	path)
+{
+	char const* failure = "";
+	if(tryOpenInputFile(file, path, &failure))
+		return 1;
+
+	reportError(failure, path);
+	return 0;
+}
+
+static void processFile(
+	lua_State* 	L,
+	char const* inputPath,
+	int			requireMarker)
+{
+	/*
+
+	We map (or, failing that, read) the whole input
+	file at once, so that we can process it in memory.
+	If we fail to read the file, then we bail out here
+	and now.
+
+	The mapping is released as soon as the file has
+	been processed, so that memory use stays flat no
+	matter how many files are passed in.
+
+	*/
+	FileStats* stats = tFileStats;
+	uint64_t start = stats ? readClock() : 0;
+	InputFile input;
+	if(!openInputFile(&input, inputPath))
+		return;
+	/*
+
+	Files we find while walking a directory are only
+	worth parsing if they contain a template marker,
+	which we can check for much faster than parsing.
+	A mapped file is only read as we first touch it,
+	so this counts as reading the file for `--stats`.
+
+	*/
+	if(requireMarker && !containsTemplateMarker(input.text))
+	{
+		closeInputFile(&input);
+		return;
+	}
+	if(stats)
+	{
+		stats->processed = 1;
+		stats->counts[kStatsCounter_InputBytes] += input.text.end - input.text.begin;
+		endStatsPhase(stats, kStatsPhase_Read, start);
+	}
+	/*
+
+	Everything we parse out of the file is allocated
+	from a single arena, which is released in one step
+	once we are done with the file.
+
+	*/
+	MemoryArena arena;
+	memset(&arena, 0, sizeof(MemoryArena));
+
+	processInput(L, inputPath, &input, &arena);
+
+	freeArena(&arena);
+	closeInputFile(&input);
+	if(stats)
+		stats->totalTime += readClock() - start;
+}
+
+static void* allocatorForLua(
+	void* userData,
+	void* ptr,
+	size_t oldSize,
+	size_t newSize)
+{
+	return realloc(ptr, newSize);
+}
+
+/*
+
+With several workers, `print()` would interleave the
+output of different files, so we replace it with a
+version that captures the output along with the rest
+of the diagnostics for the file.
+
+*/
+static int luaCapturedPrint(lua_State* L)
+{
+	Diagnostics* diagnostics = tDiagnostics;
+	int argCount = lua_gettop(L);
+	for(int ii = 1; ii <= argCount; ii++)
+	{
+		size_t size = 0;
+		char const* text = luaL_tolstring(L, ii, &size);
+		if(ii > 1)
+			appendText(&diagnostics->output, "\t", 1);
+		appendText(&diagnostics->output, text, size);
+		lua_pop(L, 1);
+	}
+	appendText(&diagnostics->output, "\n", 1);
+	return 0;
+}
+
+/*
+
+### Model Loaders
+
+Templates are often driven by a model kept in a JSON or
+CSV file, and parsing a big one in Lua can take longer
+than everything else Fiddle does. So we provide native
+loaders in a `fiddle` module (also available as a
+global):
+
+* `fiddle.load_json(path)` returns the value in a JSON
+  file. Objects and arrays become tables (arrays indexed
+  from 1), and `null` becomes `fiddle.null`, so that it
+  doesn't leave holes in arrays.
+
+* `fiddle.load_csv(path [, options])` returns an array
+  with a table for each record in a CSV file. By default
+  the first record names the fields of the others, and
+  each record is keyed by those names; with `header =
+  false` in `options`, records are arrays instead. Set
+  `separator` to use a character other than `,`. Fields
+  are always strings, and blank lines are skipped.
+
+Both map the file, and make a quick first pass over it
+to count the elements of each table, so that every table
+is created at its final size and never has to grow (and
+the garbage collector is paused while they load). The
+loaded file is recorded as a dependency, like any other
+file the templates read.
+
+*/
+enum
+{
+	kMaxJsonDepth = 1000,
+};
+
+/*
+
+`findJsonStructure()` returns a pointer to the next
+character that the counting pass cares about: a quote,
+a comma, or a bracket or brace. With SSE2, we test 16
+characters at a time; setting bit 5 (`0x20`) turns `[`
+and `]` into `{` and `}`, so four comparisons suffice.
+
+*/
+static char const* findJsonStructure(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_SSE2
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const comma = _mm_set1_epi8(',');
+	__m128i const open = _mm_set1_epi8('{');
+	__m128i const close = _mm_set1_epi8('}');
+	__m128i const caseBit = _mm_set1_epi8(0x20);
+	while(end - cursor >= 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const*) cursor);
+		__m128i folded = _mm_or_si128(v, caseBit);
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, comma)),
+			_mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close))));
+		if(mask)
+			return cursor + countTrailingZeros(mask);
+		cursor += 16;
+	}
+#endif
+	while(cursor != end)
+	{
+		char c = *cursor;
+		if(c == '"' || c == ',' || (c | 0x20) == '{' || (c | 0x20) == '}')
+			return cursor;
+		cursor++;
+	}
+	return end;
+}
+
+/*
+
+`findQuoteOrBackslash()` finds the end of the plain text
+at the start of a quoted string.
+
+*/
+static char const* findQuoteOrBackslash(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_SSE2
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const backslash = _mm_set1_epi8('\\');
+	while(end - cursor >= 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const*) cursor);
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, quote),
+			_mm_cmpeq_epi8(v, backslash)));
+		if(mask)
+			return cursor + countTrailingZeros(mask);
+		cursor += 16;
+	}
+#endif
+	while(cursor != end && *cursor != '"' && *cursor != '\\')
+		cursor++;
+	return cursor;
+}
+
+static int isJsonSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+/*
+
+`countJsonElements()` is the first pass: it records the
+number of elements of each array and object, in the
+order they are opened. It doesn't check that the text is
+valid JSON; the second pass does that, and only trusts
+the counts as a size hint.
+
+*/
+typedef struct ElementCounts
+{
+	uint32_t*	items;
+	size_t		count;
+	size_t		capacity;
+} ElementCounts;
+
+static void addElementCount(
+	ElementCounts*	counts,
+	uint32_t		value)
+{
+	if(counts->count == counts->capacity)
+	{
+		size_t capacity = counts->capacity ? counts->capacity * 2 : 256;
+		uint32_t* items = (uint32_t*) realloc(counts->items, capacity * sizeof(uint32_t));
+		if(!items)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		counts->items = items;
+		counts->capacity = capacity;
+	}
+	counts->items[counts->count++] = value;
+}
+
+static void countJsonElements(
+	StringSpan		text,
+	ElementCounts*	counts)
+{
+	size_t open[kMaxJsonDepth];
+	size_t depth = 0;
+
+	char const* cursor = text.begin;
+	char const* end = text.end;
+	for(;;)
+	{
+		cursor = findJsonStructure(cursor, end);
+		if(cursor == end)
+			break;
+
+		char c = *cursor++;
+		switch(c)
+		{
+		case '"':
+			for(;;)
+			{
+				cursor = findQuoteOrBackslash(cursor, end);
+				if(cursor == end)
+					return;
+				if(*cursor++ == '"')
+					break;
+				if(cursor != end)
+					cursor++;
+			}
+			break;
+
+		case '[':
+		case '{':
+			{
+				char const* next = cursor;
+				while(next != end && isJsonSpace(*next))
+					next++;
+				int isEmpty = next != end && (*next | 0x20) == '}';
+				if(depth < kMaxJsonDepth)
+					open[depth] = counts->count;
+				depth++;
+				addElementCount(counts, isEmpty ? 0 : 1);
+			}
+			break;
+
+		case ',':
+			if(depth && depth <= kMaxJsonDepth)
+				counts->items[open[depth - 1]]++;
+			break;
+
+		default:
+			if(depth)
+				depth--;
+			break;
+		}
+	}
+}
+
+/*
+
+The second pass builds the Lua value. Errors are raised
+as Lua errors, so the loader runs it in a protected call
+and cleans up before passing an error on.
+
+*/
+typedef struct JsonParser
+{
+	lua_State*		L;
+	char const*		path;
+	char const*		begin;
+	char const*		cursor;
+	char const*		end;
+	ElementCounts*	counts;
+	size_t			nextContainer;
+	int				depth;
+} JsonParser;
+
+static int countLinesBefore(
+	char const*	begin,
+	char const*	cursor)
+{
+	int line = 1;
+	for(char const* c = begin; c < cursor; c++)
+	{
+		if(*c == '\n')
+			line++;
+	}
+	return line;
+}
+
+static int jsonError(
+	JsonParser*	parser,
+	char const*	message)
+{
+	return luaL_error(parser->L, "%s:%d: %s", parser->path,
+		countLinesBefore(parser->begin, parser->cursor), message);
+}
+
+static void skipJsonSpace(
+	JsonParser*	parser)
+{
+	char const* cursor = parser->cursor;
+	while(cursor != parser->end && isJsonSpace(*cursor))
+		cursor++;
+	parser->cursor = cursor;
+}
+
+static int readHexQuad(
+	JsonParser*	parser,
+	unsigned*	outValue)
+{
+	if(parser->end - parser->cursor < 4)
+		return 0;
+	unsigned value = 0;
+	for(int ii = 0; ii < 4; ii++)
+	{
+		int digit = readHexDigit(*parser->cursor++);
+		if(digit < 0)
+			return 0;
+		value = (value << 4) | (unsigned) digit;
+	}
+	*outValue = value;
+	return 1;
+}
+
+static void addUtf8(
+	luaL_Buffer*	buffer,
+	unsigned		c)
+{
+	char bytes[4];
+	int size;
+	if(c < 0x80)
+	{
+		bytes[0] = (char) c;
+		size = 1;
+	}
+	else if(c < 0x800)
+	{
+		bytes[0] = (char) (0xC0 | (c >> 6));
+		bytes[1] = (char) (0x80 | (c & 0x3F));
+		size = 2;
+	}
+	else if(c < 0x10000)
+	{
+		bytes[0] = (char) (0xE0 | (c >> 12));
+		bytes[1] = (char) (0x80 | ((c >> 6) & 0x3F));
+		bytes[2] = (char) (0x80 | (c & 0x3F));
+		size = 3;
+	}
+	else
+	{
+		bytes[0] = (char) (0xF0 | (c >> 18));
+		bytes[1] = (char) (0x80 | ((c >> 12) & 0x3F));
+		bytes[2] = (char) (0x80 | ((c >> 6) & 0x3F));
+		bytes[3] = (char) (0x80 | (c & 0x3F));
+		size = 4;
+	}
+	luaL_addlstring(buffer, bytes, size);
+}
+
+/*
+
+`parseJsonString()` pushes the string that starts at the
+cursor (just after its opening quote). Strings without
+escapes, which are most of them, are pushed straight
+from the mapped file.
+
+*/
+static void parseJsonString(
+	JsonParser*	parser)
+{
+	lua_State* L = parser->L;
+	char const* start = parser->cursor;
+	char const* cursor = findQuoteOrBackslash(start, parser->end);
+	if(cursor != parser->end && *cursor == '"')
+	{
+		lua_pushlstring(L, start, cursor - start);
+		parser->cursor = cursor + 1;
+		return;
+	}
+
+	luaL_Buffer buffer;
+	luaL_buffinit(L, &buffer);
+	for(;;)
+	{
+		luaL_addlstring(&buffer, start, cursor - start);
+		parser->cursor = cursor;
+		if(cursor == parser->end)
+			jsonError(parser, "unterminated string");
+		if(*cursor++ == '"')
+			break;
+		if(cursor == parser->end)
+			jsonError(parser, "unterminated string");
+
+		char c = *cursor++;
+		switch(c)
+		{
+		case '"': case '\\': case '/': luaL_addchar(&buffer, c); break;
+		case 'b': luaL_addchar(&buffer, '\b'); break;
+		case 'f': luaL_addchar(&buffer, '\f'); break;
+		case 'n': luaL_addchar(&buffer, '\n'); break;
+		case 'r': luaL_addchar(&buffer, '\r'); break;
+		case 't': luaL_addchar(&buffer, '\t'); break;
+		case 'u':
+			{
+				unsigned code = 0;
+				parser->cursor = cursor;
+				if(!readHexQuad(parser, &code))
+					jsonError(parser, "invalid '\\u' escape");
+
+				/* A surrogate pair encodes a single character; one on its own, none */
+				if(code >= 0xD800 && code < 0xDC00
+					&& parser->end - parser->cursor >= 6
+					&& parser->cursor[0] == '\\' && parser->cursor[1] == 'u')
+				{
+					char const* saved = parser->cursor;
+					unsigned low = 0;
+					parser->cursor += 2;
+					if(readHexQuad(parser, &low) && low >= 0xDC00 && low < 0xE000)
+						code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+					else
+						parser->cursor = saved;
+				}
+				if(code >= 0xD800 && code < 0xE000)
+					code = 0xFFFD;
+				addUtf8(&buffer, code);
+				cursor = parser->cursor;
+			}
+			break;
+		default:
+			parser->cursor = cursor - 1;
+			jsonError(parser, "invalid escape in string");
+		}
+
+		start = cursor;
+		cursor = findQuoteOrBackslash(start, parser->end);
+	}
+	parser->cursor = cursor;
+	luaL_pushresult(&buffer);
+}
+
+static int isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+/*
+
+`parseJsonNumber()` pushes an integer when the number
+has no fraction or exponent (and fits), and a float
+otherwise, just as Lua would for the same text.
+
+*/
+static void parseJsonNumber(
+	JsonParser*	parser)
+{
+	char const* start = parser->cursor;
+	char const* cursor = start;
+	char const* end = parser->end;
+	int isNegative = cursor != end && *cursor == '-';
+	if(isNegative)
+		cursor++;
+
+	char const* digits = cursor;
+	if(cursor == end || !isDigit(*cursor))
+		jsonError(parser, "invalid number");
+	if(*cursor == '0')
+		cursor++;
+	else while(cursor != end && isDigit(*cursor))
+		cursor++;
+	size_t digitCount = cursor - digits;
+
+	int isInteger = 1;
+	if(cursor != end && *cursor == '.')
+	{
+		isInteger = 0;
+		cursor++;
+		if(cursor == end || !isDigit(*cursor))
+			jsonError(parser, "invalid number");
+		while(cursor != end && isDigit(*cursor))
+			cursor++;
+	}
+	if(cursor != end && (*cursor | 0x20) == 'e')
+	{
+		isInteger = 0;
+		cursor++;
+		if(cursor != end && (*cursor == '+' || *cursor == '-'))
+			cursor++;
+		if(cursor == end || !isDigit(*cursor))
+			jsonError(parser, "invalid number");
+		while(cursor != end && isDigit(*cursor))
+			cursor++;
+	}
+	parser->cursor = cursor;
+
+	/* Up to 18 digits always fit in a 64-bit integer */
+	if(isInteger && digitCount <= 18 && sizeof(lua_Integer) >= 8)
+	{
+		lua_Integer value = 0;
+		for(char const* c = digits; c != cursor; c++)
+			value = value * 10 + (*c - '0');
+		lua_pushinteger(parser->L, isNegative ? -value : value);
+		return;
+	}
+
+	char small[64];
+	size_t size = cursor - start;
+	char* text = size < sizeof(small) ? small : (char*) malloc(size + 1);
+	if(!text)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(text, start, size);
+	text[size] = 0;
+	size_t converted = lua_stringtonumber(parser->L, text);
+	if(text != small)
+		free(text);
+	if(!converted)
+		jsonError(parser, "invalid number");
+}
+
+static int takeElementCount(
+	JsonParser*	parser)
+{
+	size_t index = parser->nextContainer++;
+	if(index >= parser->counts->count)
+		return 0;
+	uint32_t count = parser->counts->items[index];
+	return count > INT32_MAX ? 0 : (int) count;
+}
+
+static int matchJsonWord(
+	JsonParser*	parser,
+	char const*	word,
+	size_t		size)
+{
+	if((size_t) (parser->end - parser->cursor) < size
+		|| memcmp(parser->cursor, word, size) != 0)
+	{
+		return 0;
+	}
+	parser->cursor += size;
+	return 1;
+}
+
+static void parseJsonValue(
+	JsonParser*	parser)
+{
+	lua_State* L = parser->L;
+	skipJsonSpace(parser);
+	if(parser->cursor == parser->end)
+		jsonError(parser, "expected a value");
+
+	switch(*parser->cursor)
+	{
+	case '"':
+		parser->cursor++;
+		parseJsonString(parser);
+		return;
+
+	case '[':
+		{
+			if(++parser->depth > kMaxJsonDepth)
+				jsonError(parser, "arrays and objects are nested too deeply");
+			luaL_checkstack(L, 4, "arrays and objects are nested too deeply");
+			lua_createtable(L, takeElementCount(parser), 0);
+			parser->cursor++;
+			skipJsonSpace(parser);
+			if(parser->cursor != parser->end && *parser->cursor == ']')
+			{
+				parser->cursor++;
+				parser->depth--;
+				return;
+			}
+			for(lua_Integer index = 1; ; index++)
+			{
+				parseJsonValue(parser);
+				lua_rawseti(L, -2, index);
+				skipJsonSpace(parser);
+				if(parser->cursor == parser->end)
+					jsonError(parser, "expected ',' or ']'");
+				char c = *parser->cursor++;
+				if(c == ']')
+					break;
+				if(c != ',')
+				{
+					parser->cursor--;
+					jsonError(parser, "expected ',' or ']'");
+				}
+			}
+			parser->depth--;
+		}
+		return;
+
+	case '{':
+		{
+			if(++parser->depth > kMaxJsonDepth)
+				jsonError(parser, "arrays and objects are nested too deeply");
+			luaL_checkstack(L, 4, "arrays and objects are nested too deeply");
+			lua_createtable(L, 0, takeElementCount(parser));
+			parser->cursor++;
+			skipJsonSpace(parser);
+			if(parser->cursor != parser->end && *parser->cursor == '}')
+			{
+				parser->cursor++;
+				parser->depth--;
+				return;
+			}
+			for(;;)
+			{
+				skipJsonSpace(parser);
+				if(parser->cursor == parser->end || *parser->cursor != '"')
+					jsonError(parser, "expected a string key");
+				parser->cursor++;
+				parseJsonString(parser);
+
+				skipJsonSpace(parser);
+				if(parser->cursor == parser->end || *parser->cursor != ':')
+					jsonError(parser, "expected ':'");
+				parser->cursor++;
+
+				parseJsonValue(parser);
+				lua_rawset(L, -3);
+
+				skipJsonSpace(parser);
+				if(parser->cursor == parser->end)
+					jsonError(parser, "expected ',' or '}'");
+				char c = *parser->cursor++;
+				if(c == '}')
+					break;
+				if(c != ',')
+				{
+					parser->cursor--;
+					jsonError(parser, "expected ',' or '}'");
+				}
+			}
+			parser->depth--;
+		}
+		return;
+
+	case 't':
+		if(!matchJsonWord(parser, "true", 4))
+			break;
+		lua_pushboolean(L, 1);
+		return;
+
+	case 'f':
+		if(!matchJsonWord(parser, "false", 5))
+			break;
+		lua_pushboolean(L, 0);
+		return;
+
+	case 'n':
+		if(!matchJsonWord(parser, "null", 4))
+			break;
+		lua_pushlightuserdata(L, NULL);
+		return;
+
+	default:
+		if(*parser->cursor == '-' || isDigit(*parser->cursor))
+		{
+			parseJsonNumber(parser);
+			return;
+		}
+		break;
+	}
+	jsonError(parser, "expected a value");
+}
+
+static int parseJsonDocument(lua_State* L)
+{
+	JsonParser* parser = (JsonParser*) lua_touserdata(L, 1);
+	lua_settop(L, 0);
+	parseJsonValue(parser);
+	skipJsonSpace(parser);
+	if(parser->cursor != parser->end)
+		jsonError(parser, "unexpected text after the value");
+	return 1;
+}
+
+/*
+
+`openModelFile()` maps the file for a loader, and records
+it as a dependency. It raises an error if there is no
+such file.
+
+*/
+static void openModelFile(
+	lua_State*	L,
+	char const*	path,
+	InputFile*	file)
+{
+	char const* failure = "";
+	int opened = tryOpenInputFile(file, path, &failure);
+	recordDependency(L, path, opened);
+	if(!opened)
+	{
+		lua_pushfstring(L, failure, path);
+		lua_error(L);
+	}
+}
+
+static int luaLoadJson(lua_State* L)
+{
+	char const* path = luaL_checkstring(L, 1);
+
+	InputFile file;
+	openModelFile(L, path, &file);
+
+	ElementCounts counts;
+	memset(&counts, 0, sizeof(ElementCounts));
+	countJsonElements(file.text, &counts);
+
+	JsonParser parser;
+	memset(&parser, 0, sizeof(JsonParser));
+	parser.L = L;
+	parser.path = path;
+	parser.begin = file.text.begin;
+	parser.cursor = file.text.begin;
+	parser.end = file.text.end;
+	parser.counts = &counts;
+
+	/* Everything we create stays reachable, so collecting meanwhile would be wasted */
+	int wasCollecting = lua_gc(L, LUA_GCISRUNNING, 0);
+	lua_gc(L, LUA_GCSTOP, 0);
+
+	lua_pushcfunction(L, &parseJsonDocument);
+	lua_pushlightuserdata(L, &parser);
+	int err = lua_pcall(L, 1, 1, 0);
+
+	if(wasCollecting)
+		lua_gc(L, LUA_GCRESTART, 0);
+
+	free(counts.items);
+	closeInputFile(&file);
+	if(err != LUA_OK)
+		return lua_error(L);
+	return 1;
+}
+
+/*
+
+The CSV loader works the same way: `countCsvRecords()`
+counts the records that aren't blank, so that we can
+size the array that holds them, and the second pass reads
+the fields. A quoted field can contain separators, line
+breaks, and quotes (written twice).
+
+*/
+static char const* findCsvStructure(
+	char const* cursor,
+	char const* end)
+{
+#if FIDDLE_USE_SSE2
+	__m128i const quote = _mm_set1_epi8('"');
+	__m128i const cr = _mm_set1_epi8('\r');
+	__m128i const lf = _mm_set1_epi8('\n');
+	while(end - cursor >= 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i const*) cursor);
+		unsigned mask = (unsigned) _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, quote),
+			_mm_or_si128(_mm_cmpeq_epi8(v, cr), _mm_cmpeq_epi8(v, lf))));
+		if(mask)
+			return cursor + countTrailingZeros(mask);
+		cursor += 16;
+	}
+#endif
+	while(cursor != end && *cursor != '"' && *cursor != '\r' && *cursor != '\n')
+		cursor++;
+	return cursor;
+}
+
+static size_t countCsvRecords(
+	StringSpan	text)
+{
+	size_t count = 0;
+	int isQuoted = 0;
+	char const* lineStart = text.begin;
+	char const* cursor = text.begin;
+	char const* end = text.end;
+	for(;;)
+	{
+		cursor = findCsvStructure(cursor, end);
+		if(cursor == end)
+			break;
+		if(*cursor == '"')
+		{
+			isQuoted = !isQuoted;
+		}
+		else if(!isQuoted)
+		{
+			if(cursor != lineStart)
+				count++;
+			lineStart = cursor + 1;
+		}
+		cursor++;
+	}
+	if(lineStart != end)
+		count++;
+	return count;
+}
+
+typedef struct CsvParser
+{
+	lua_State*	L;
+	char const*	path;
+	char const*	begin;
+	char const*	cursor;
+	char const*	end;
+	char		separator;
+} CsvParser;
+
+static int csvError(
+	CsvParser*	parser,
+	char const*	message)
+{
+	return luaL_error(parser->L, "%s:%d: %s", parser->path,
+		countLinesBefore(parser->begin, parser->cursor), message);
+}
+
+static int isCsvRecordEnd(
+	CsvParser*	parser)
+{
+	return parser->cursor == parser->end
+		|| *parser->cursor == '\r'
+		|| *parser->cursor == '\n';
+}
+
+/*
+
+`parseCsvField()` pushes the field at the cursor, and
+leaves the cursor on whatever follows it: a separator,
+a line break, or the end of the file.
+
+*/
+static void parseCsvField(
+	CsvParser*	parser)
+{
+	lua_State* L = parser->L;
+	char const* cursor = parser->cursor;
+	char const* end = parser->end;
+	char separator = parser->separator;
+	if(cursor == end || *cursor != '"')
+	{
+		char const* start = cursor;
+		while(cursor != end && *cursor != separator && *cursor != '\r' && *cursor != '\n')
+			cursor++;
+		lua_pushlstring(L, start, cursor - start);
+		parser->cursor = cursor;
+		return;
+	}
+
+	/* Most quoted fields don't contain any quotes */
+	cursor++;
+	char const* start = cursor;
+	char const* quote = memchr(cursor, '"', end - cursor);
+	if(quote && (quote + 1 == end || quote[1] != '"'))
+	{
+		lua_pushlstring(L, start, quote - start);
+		parser->cursor = quote + 1;
+	}
+	else
+	{
+		luaL_Buffer buffer;
+		luaL_buffinit(L, &buffer);
+		for(;;)
+		{
+			quote = memchr(cursor, '"', end - cursor);
+			if(!quote)
+			{
+				parser->cursor = start - 1;
+				csvError(parser, "unterminated quoted field");
+			}
+			luaL_addlstring(&buffer, cursor, quote - cursor);
+			if(quote + 1 == end || quote[1] != '"')
+				break;
+			luaL_addchar(&buffer, '"');
+			cursor = quote + 2;
+		}
+		luaL_pushresult(&buffer);
+		parser->cursor = quote + 1;
+	}
+
+	if(!isCsvRecordEnd(parser) && *parser->cursor != separator)
+		csvError(parser, "expected a separator after a quoted field");
+}
+
+/*
+
+`parseCsvRecord()` pushes the fields of the record at
+the cursor into the table on top of the stack, by name
+if there is a header table at `headerIndex` (or by
+position otherwise), and returns how many there were.
+
+*/
+static int parseCsvRecord(
+	CsvParser*	parser,
+	int			headerIndex)
+{
+	lua_State* L = parser->L;
+	int fieldCount = 0;
+	for(;;)
+	{
+		fieldCount++;
+		parseCsvField(parser);
+		if(headerIndex && lua_rawgeti(L, headerIndex, fieldCount) != LUA_TNIL)
+		{
+			lua_insert(L, -2);
+			lua_rawset(L, -3);
+		}
+		else
+		{
+			if(headerIndex)
+				lua_pop(L, 1);
+			lua_rawseti(L, -2, fieldCount);
+		}
+
+		if(isCsvRecordEnd(parser))
+			break;
+		parser->cursor++;
+	}
+
+	if(parser->cursor != parser->end && *parser->cursor == '\r')
+		parser->cursor++;
+	if(parser->cursor != parser->end && *parser->cursor == '\n')
+		parser->cursor++;
+	return fieldCount;
+}
+
+static void skipBlankCsvLines(
+	CsvParser*	parser)
+{
+	while(parser->cursor != parser->end
+		&& (*parser->cursor == '\r' || *parser->cursor == '\n'))
+	{
+		parser->cursor++;
+	}
+}
+
+static int parseCsvDocument(lua_State* L)
+{
+	CsvParser* parser = (CsvParser*) lua_touserdata(L, 1);
+	int hasHeader = lua_toboolean(L, 2);
+	size_t recordCount = (size_t) lua_tointeger(L, 3);
+	lua_settop(L, 0);
+
+	int headerIndex = 0;
+	int fieldCount = 0;
+	skipBlankCsvLines(parser);
+	if(hasHeader && parser->cursor != parser->end)
+	{
+		lua_newtable(L);
+		fieldCount = parseCsvRecord(parser, 0);
+		headerIndex = lua_gettop(L);
+		recordCount--;
+	}
+
+	lua_createtable(L, recordCount > INT32_MAX ? 0 : (int) recordCount, 0);
+	for(lua_Integer index = 1; ; index++)
+	{
+		skipBlankCsvLines(parser);
+		if(parser->cursor == parser->end)
+			break;
+		if(headerIndex)
+			lua_createtable(L, 0, fieldCount);
+		else
+			lua_createtable(L, fieldCount, 0);
+		int count = parseCsvRecord(parser, headerIndex);
+		if(!fieldCount)
+			fieldCount = count;
+		lua_rawseti(L, -2, index);
+	}
+	return 1;
+}
+
+static int luaLoadCsv(lua_State* L)
+{
+	char const* path = luaL_checkstring(L, 1);
+	int hasHeader = 1;
+	char separator = ',';
+	if(!lua_isnoneornil(L, 2))
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		if(lua_getfield(L, 2, "header") != LUA_TNIL)
+			hasHeader = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if(lua_getfield(L, 2, "separator") != LUA_TNIL)
+		{
+			size_t size = 0;
+			char const* text = lua_tolstring(L, -1, &size);
+			if(!text || size != 1 || text[0] == '"' || text[0] == '\r' || text[0] == '\n')
+				return luaL_argerror(L, 2, "'separator' must be a single character");
+			separator = text[0];
+		}
+		lua_pop(L, 1);
+	}
+
+	InputFile file;
+	openModelFile(L, path, &file);
+
+	CsvParser parser;
+	memset(&parser, 0, sizeof(CsvParser));
+	parser.L = L;
+	parser.path = path;
+	parser.begin = file.text.begin;
+	parser.cursor = file.text.begin;
+	parser.end = file.text.end;
+	parser.separator = separator;
+
+	lua_pushcfunction(L, &parseCsvDocument);
+	lua_pushlightuserdata(L, &parser);
+	lua_pushboolean(L, hasHeader);
+	lua_pushinteger(L, (lua_Integer) countCsvRecords(file.text));
+
+	int wasCollecting = lua_gc(L, LUA_GCISRUNNING, 0);
+	lua_gc(L, LUA_GCSTOP, 0);
+	int err = lua_pcall(L, 3, 1, 0);
+	if(wasCollecting)
+		lua_gc(L, LUA_GCRESTART, 0);
+
+	closeInputFile(&file);
+	if(err != LUA_OK)
+		return lua_error(L);
+	return 1;
+}
+
+/*
+
+### Snapshots
+
+Even a fast loader has to build every table of a model,
+while a template usually only looks at a small part of
+it. So `fiddle --snapshot model.lua -o model.fsnap` runs
+a script, and writes the value it returns to a snapshot:
+a binary file that `fiddle.open_snapshot(path)` maps and
+reads in place. Its tables appear as read-only userdata
+that decode an entry only when it is asked for (`t.x`,
+`#t`, `pairs(t)` and `ipairs(t)` all work). Opening a
+snapshot costs the same no matter how big the model is,
+and processes that use the same snapshot share its pages
+in the page cache.
+
+A snapshot starts with a header, which holds the root
+value. Everything else is addressed by its offset from
+the start of the file, and all numbers are 64-bit little
+endian (aligned to 8 bytes):
+
+    header:   "FIDDLESN" version(4) reserved(4) size reserved root(16)
+    value:    type(4) reserved(4) payload
+    string:   length bytes... 0 (padded)
+    table:    arrayCount hashCount array(16 each) entries(32 each)
+
+A value's payload is an integer, the bits of a float, or
+the offset of a string or table. The array part of a
+table holds its entries `1..#t`; its other entries are
+sorted by key, so they can be found with a binary
+search. Strings and tables that occur more than once are
+stored once. `fiddle.null` is kept as is, while values
+that can't be stored (functions, say) are an error.
+
+*/
+static char const kSnapshotMagic[8] = { 'F', 'I', 'D', 'D', 'L', 'E', 'S', 'N' };
+
+enum
+{
+	kSnapshotVersion = 1,
+	kSnapshotHeaderSize = 48,
+	kSnapshotValueSize = 16,
+	kSnapshotTableHeaderSize = 16,
+};
+
+typedef enum SnapshotType
+{
+	kSnapshotType_Nil,
+	kSnapshotType_False,
+	kSnapshotType_True,
+	kSnapshotType_Integer,
+	kSnapshotType_Float,
+	kSnapshotType_String,
+	kSnapshotType_Table,
+	kSnapshotType_Null,
+} SnapshotType;
+
+/*
+
+The writer builds the whole snapshot in memory. It keeps
+the offset of every string and table it has stored in a
+Lua table, and a queue of the tables whose space has
+been set aside but whose entries are yet to be written.
+
+*/
+typedef struct SnapshotWriter
+{
+	lua_State*	L;
+	char*		data;
+	size_t		size;
+	size_t		capacity;
+
+	int			offsetsIndex;
+	int			queueIndex;
+	lua_Integer	queueCount;
+} SnapshotWriter;
+
+static uint64_t reserveSnapshotBytes(
+	SnapshotWriter*	writer,
+	size_t			size)
+{
+	size = (size + 7) & ~(size_t) 7;
+	if(writer->capacity - writer->size < size)
+	{
+		size_t capacity = writer->capacity ? writer->capacity : 4096;
+		while(capacity - writer->size < size)
+			capacity *= 2;
+		char* data = (char*) realloc(writer->data, capacity);
+		if(!data)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		writer->data = data;
+		writer->capacity = capacity;
+	}
+	uint64_t offset = writer->size;
+	memset(writer->data + offset, 0, size);
+	writer->size += size;
+	return offset;
+}
+
+static void writeSnapshotValue(
+	SnapshotWriter*	writer,
+	uint64_t		slot,
+	SnapshotType	type,
+	uint64_t		payload)
+{
+	char* bytes = writer->data + slot;
+	bytes[0] = (char) type;
+	writeLittleEndian64(bytes + 8, payload);
+}
+
+/*
+
+`reserveSnapshotTable()` sets aside the space for the
+table at `index`, and queues it to be written.
+
+*/
+static uint64_t reserveSnapshotTable(
+	SnapshotWriter*	writer,
+	int				index)
+{
+	lua_State* L = writer->L;
+	index = lua_absindex(L, index);
+
+	lua_Integer arrayCount = (lua_Integer) lua_rawlen(L, index);
+	uint64_t hashCount = 0;
+	lua_pushnil(L);
+	while(lua_next(L, index))
+	{
+		lua_pop(L, 1);
+		if(lua_isinteger(L, -1))
+		{
+			lua_Integer key = lua_tointeger(L, -1);
+			if(key >= 1 && key <= arrayCount)
+				continue;
+		}
+		hashCount++;
+	}
+
+	uint64_t offset = reserveSnapshotBytes(writer, kSnapshotTableHeaderSize
+		+ (size_t) arrayCount * kSnapshotValueSize
+		+ (size_t) hashCount * kSnapshotValueSize * 2);
+	writeLittleEndian64(writer->data + offset, (uint64_t) arrayCount);
+	writeLittleEndian64(writer->data + offset + 8, hashCount);
+
+	lua_pushvalue(L, index);
+	lua_pushinteger(L, (lua_Integer) offset);
+	lua_rawset(L, writer->offsetsIndex);
+
+	lua_pushvalue(L, index);
+	lua_rawseti(L, writer->queueIndex, ++writer->queueCount);
+	return offset;
+}
+
+static void encodeSnapshotValue(
+	SnapshotWriter*	writer,
+	int				index,
+	uint64_t		slot)
+{
+	lua_State* L = writer->L;
+	index = lua_absindex(L, index);
+	switch(lua_type(L, index))
+	{
+	case LUA_TNIL:
+		writeSnapshotValue(writer, slot, kSnapshotType_Nil, 0);
+		return;
+
+	case LUA_TBOOLEAN:
+		writeSnapshotValue(writer, slot,
+			lua_toboolean(L, index) ? kSnapshotType_True : kSnapshotType_False, 0);
+		return;
+
+	case LUA_TNUMBER:
+		if(lua_isinteger(L, index))
+		{
+			writeSnapshotValue(writer, slot, kSnapshotType_Integer,
+				(uint64_t) lua_tointeger(L, index));
+		}
+		else
+		{
+			double number = (double) lua_tonumber(L, index);
+			uint64_t bits = 0;
+			memcpy(&bits, &number, sizeof(bits));
+			writeSnapshotValue(writer, slot, kSnapshotType_Float, bits);
+		}
+		return;
+
+	case LUA_TSTRING:
+	case LUA_TTABLE:
+		{
+			int isString = lua_type(L, index) == LUA_TSTRING;
+			lua_pushvalue(L, index);
+			uint64_t offset = 0;
+			if(lua_rawget(L, writer->offsetsIndex) == LUA_TNUMBER)
+			{
+				offset = (uint64_t) lua_tointeger(L, -1);
+			}
+			else if(isString)
+			{
+				size_t size = 0;
+				char const* text = lua_tolstring(L, index, &size);
+				offset = reserveSnapshotBytes(writer, 8 + size + 1);
+				writeLittleEndian64(writer->data + offset, size);
+				memcpy(writer->data + offset + 8, text, size);
+
+				lua_pushvalue(L, index);
+				lua_pushinteger(L, (lua_Integer) offset);
+				lua_rawset(L, writer->offsetsIndex);
+			}
+			else
+			{
+				offset = reserveSnapshotTable(writer, index);
+			}
+			lua_pop(L, 1);
+			writeSnapshotValue(writer, slot,
+				isString ? kSnapshotType_String : kSnapshotType_Table, offset);
+		}
+		return;
+
+	case LUA_TLIGHTUSERDATA:
+		if(!lua_touserdata(L, index))
+		{
+			writeSnapshotValue(writer, slot, kSnapshotType_Null, 0);
+			return;
+		}
+		break;
+
+	default:
+		break;
+	}
+	luaL_error(L, "cannot store a %s in a snapshot", luaL_typename(L, index));
+}
+
+/*
+
+Keys are ordered by type (booleans, then integers, then
+floats, then strings), and then by value. Lua never uses
+a float with an integer value as a key, so we don't need
+to compare integers with floats.
+
+*/
+static int rankSnapshotKey(
+	uint8_t const*	value)
+{
+	switch(value[0])
+	{
+	case kSnapshotType_False:	return 0;
+	case kSnapshotType_True:	return 1;
+	case kSnapshotType_Integer:	return 2;
+	case kSnapshotType_Float:	return 3;
+	default:					return 4;
+	}
+}
+
+static int compareSnapshotKeys(
+	uint8_t const*	left,
+	uint8_t const*	leftText,
+	uint64_t		leftSize,
+	uint8_t const*	right,
+	uint8_t const*	rightText,
+	uint64_t		rightSize)
+{
+	int leftRank = rankSnapshotKey(left);
+	int rightRank = rankSnapshotKey(right);
+	if(leftRank != rightRank)
+		return leftRank < rightRank ? -1 : 1;
+
+	uint64_t leftBits = readLittleEndian64(left + 8);
+	uint64_t rightBits = readLittleEndian64(right + 8);
+	if(left[0] == kSnapshotType_Integer)
+	{
+		int64_t l = (int64_t) leftBits;
+		int64_t r = (int64_t) rightBits;
+		return l < r ? -1 : l > r;
+	}
+	if(left[0] == kSnapshotType_Float)
+	{
+		double l, r;
+		memcpy(&l, &leftBits, sizeof(l));
+		memcpy(&r, &rightBits, sizeof(r));
+		return l < r ? -1 : l > r;
+	}
+	if(left[0] == kSnapshotType_String)
+	{
+		uint64_t size = leftSize < rightSize ? leftSize : rightSize;
+		int result = memcmp(leftText, rightText, (size_t) size);
+		if(result)
+			return result;
+		return leftSize < rightSize ? -1 : leftSize > rightSize;
+	}
+	return 0;
+}
+
+/* The data of the snapshot being written, for `compareSnapshotEntries()` */
+static char const* gSortedSnapshotData = NULL;
+
+static int compareSnapshotEntries(
+	void const*	left,
+	void const*	right)
+{
+	uint8_t const* l = (uint8_t const*) left;
+	uint8_t const* r = (uint8_t const*) right;
+	uint8_t const* data = (uint8_t const*) gSortedSnapshotData;
+	uint8_t const* leftText = NULL;
+	uint8_t const* rightText = NULL;
+	uint64_t leftSize = 0;
+	uint64_t rightSize = 0;
+	if(l[0] == kSnapshotType_String)
+	{
+		uint8_t const* record = data + readLittleEndian64(l + 8);
+		leftSize = readLittleEndian64(record);
+		leftText = record + 8;
+	}
+	if(r[0] == kSnapshotType_String)
+	{
+		uint8_t const* record = data + readLittleEndian64(r + 8);
+		rightSize = readLittleEndian64(record);
+		rightText = record + 8;
+	}
+	return compareSnapshotKeys(l, leftText, leftSize, r, rightText, rightSize);
+}
+
+static void writeSnapshotTable(
+	SnapshotWriter*	writer,
+	int				index,
+	uint64_t		offset)
+{
+	lua_State* L = writer->L;
+	index = lua_absindex(L, index);
+
+	lua_Integer arrayCount = (lua_Integer) readLittleEndian64((uint8_t const*) writer->data + offset);
+	uint64_t hashCount = readLittleEndian64((uint8_t const*) writer->data + offset + 8);
+	uint64_t arraySlot = offset + kSnapshotTableHeaderSize;
+	uint64_t entrySlot = arraySlot + (uint64_t) arrayCount * kSnapshotValueSize;
+
+	for(lua_Integer ii = 1; ii <= arrayCount; ii++)
+	{
+		lua_rawgeti(L, index, ii);
+		encodeSnapshotValue(writer, -1, arraySlot + (uint64_t) (ii - 1) * kSnapshotValueSize);
+		lua_pop(L, 1);
+	}
+
+	uint64_t entryCount = 0;
+	lua_pushnil(L);
+	while(lua_next(L, index))
+	{
+		if(lua_isinteger(L, -2))
+		{
+			lua_Integer key = lua_tointeger(L, -2);
+			if(key >= 1 && key <= arrayCount)
+			{
+				lua_pop(L, 1);
+				continue;
+			}
+		}
+		int keyType = lua_type(L, -2);
+		if(keyType != LUA_TBOOLEAN && keyType != LUA_TNUMBER && keyType != LUA_TSTRING)
+			luaL_error(L, "cannot store a %s key in a snapshot", luaL_typename(L, -2));
+
+		uint64_t slot = entrySlot + entryCount * kSnapshotValueSize * 2;
+		encodeSnapshotValue(writer, -2, slot);
+		encodeSnapshotValue(writer, -1, slot + kSnapshotValueSize);
+		entryCount++;
+		lua_pop(L, 1);
+	}
+
+	gSortedSnapshotData = writer->data;
+	qsort(writer->data + entrySlot, (size_t) hashCount, kSnapshotValueSize * 2, &compareSnapshotEntries);
+	gSortedSnapshotData = NULL;
+}
+
+static int buildSnapshot(lua_State* L)
+{
+	SnapshotWriter* writer = (SnapshotWriter*) lua_touserdata(L, 2);
+	lua_newtable(L);
+	writer->offsetsIndex = lua_gettop(L);
+	lua_newtable(L);
+	writer->queueIndex = lua_gettop(L);
+
+	uint64_t header = reserveSnapshotBytes(writer, kSnapshotHeaderSize);
+	encodeSnapshotValue(writer, 1, header + kSnapshotHeaderSize - kSnapshotValueSize);
+
+	for(lua_Integer next = 1; next <= writer->queueCount; next++)
+	{
+		lua_rawgeti(L, writer->queueIndex, next);
+		lua_pushvalue(L, -1);
+		lua_rawget(L, writer->offsetsIndex);
+		writeSnapshotTable(writer, -2, (uint64_t) lua_tointeger(L, -1));
+		lua_pop(L, 2);
+	}
+
+	memcpy(writer->data, kSnapshotMagic, sizeof(kSnapshotMagic));
+	writer->data[8] = (char) kSnapshotVersion;
+	writeLittleEndian64(writer->data + 16, writer->size);
+	return 0;
+}
+
+/*
+
+When reading, a `Snapshot` userdata owns the mapping of
+the file, and keeps the proxy for each table it has
+handed out (in a weak table), so that a table that is
+reached twice is the same proxy both times. Each proxy
+holds on to its snapshot.
+
+*/
+static char const kSnapshotMetatable[] = "fiddle.snapshot";
+static char const kSnapshotTableMetatable[] = "fiddle.snapshotTable";
+
+typedef struct Snapshot
+{
+	InputFile	file;
+	int			isOpen;
+} Snapshot;
+
+typedef struct SnapshotTable
+{
+	Snapshot*	snapshot;
+	uint64_t	offset;
+	uint64_t	arrayCount;
+	uint64_t	hashCount;
+} SnapshotTable;
+
+static uint8_t const* readSnapshotBytes(
+	lua_State*	L,
+	Snapshot*	snapshot,
+	uint64_t	offset,
+	uint64_t	size)
+{
+	uint64_t fileSize = (uint64_t) (snapshot->file.text.end - snapshot->file.text.begin);
+	if(offset > fileSize || size > fileSize - offset)
+		luaL_error(L, "snapshot is corrupt");
+	return (uint8_t const*) snapshot->file.text.begin + offset;
+}
+
+static void readSnapshotString(
+	lua_State*		L,
+	Snapshot*		snapshot,
+	uint8_t const*	value,
+	uint8_t const**	outText,
+	uint64_t*		outSize)
+{
+	uint64_t offset = readLittleEndian64(value + 8);
+	uint64_t size = readLittleEndian64(readSnapshotBytes(L, snapshot, offset, 8));
+	*outText = readSnapshotBytes(L, snapshot, offset + 8, size);
+	*outSize = size;
+}
+
+/*
+
+`pushSnapshotValue()` pushes the value in the slot
+`value` of the snapshot at `snapshotIndex` on the stack.
+
+*/
+static void pushSnapshotValue(
+	lua_State*		L,
+	int				snapshotIndex,
+	uint8_t const*	value)
+{
+	Snapshot* snapshot = (Snapshot*) lua_touserdata(L, snapshotIndex);
+	uint64_t payload = readLittleEndian64(value + 8);
+	switch(value[0])
+	{
+	case kSnapshotType_Nil:		lua_pushnil(L); return;
+	case kSnapshotType_False:	lua_pushboolean(L, 0); return;
+	case kSnapshotType_True:	lua_pushboolean(L, 1); return;
+	case kSnapshotType_Integer:	lua_pushinteger(L, (lua_Integer) (int64_t) payload); return;
+	case kSnapshotType_Null:	lua_pushlightuserdata(L, NULL); return;
+
+	case kSnapshotType_Float:
+		{
+			double number;
+			memcpy(&number, &payload, sizeof(number));
+			lua_pushnumber(L, (lua_Number) number);
+		}
+		return;
+
+	case kSnapshotType_String:
+		{
+			uint8_t const* text = NULL;
+			uint64_t size = 0;
+			readSnapshotString(L, snapshot, value, &text, &size);
+			lua_pushlstring(L, (char const*) text, (size_t) size);
+		}
+		return;
+
+	case kSnapshotType_Table:
+		{
+			snapshotIndex = lua_absindex(L, snapshotIndex);
+			lua_getuservalue(L, snapshotIndex);
+			if(lua_rawgeti(L, -1, (lua_Integer) payload) != LUA_TNIL)
+			{
+				lua_remove(L, -2);
+				return;
+			}
+			lua_pop(L, 1);
+
+			uint8_t const* record = readSnapshotBytes(L, snapshot, payload, kSnapshotTableHeaderSize);
+			uint64_t arrayCount = readLittleEndian64(record);
+			uint64_t hashCount = readLittleEndian64(record + 8);
+			if(arrayCount > UINT32_MAX * (uint64_t) 16 || hashCount > UINT32_MAX * (uint64_t) 16)
+				luaL_error(L, "snapshot is corrupt");
+			readSnapshotBytes(L, snapshot, payload + kSnapshotTableHeaderSize,
+				(arrayCount + hashCount * 2) * kSnapshotValueSize);
+
+			SnapshotTable* table = (SnapshotTable*) lua_newuserdata(L, sizeof(SnapshotTable));
+			table->snapshot = snapshot;
+			table->offset = payload;
+			table->arrayCount = arrayCount;
+			table->hashCount = hashCount;
+			luaL_setmetatable(L, kSnapshotTableMetatable);
+			lua_pushvalue(L, snapshotIndex);
+			lua_setuservalue(L, -2);
+
+			lua_pushvalue(L, -1);
+			lua_rawseti(L, -3, (lua_Integer) payload);
+			lua_remove(L, -2);
+		}
+		return;
+
+	default:
+		luaL_error(L, "snapshot is corrupt");
+	}
+}
+
+static uint8_t const* findSnapshotEntry(
+	lua_State*		L,
+	SnapshotTable*	table,
+	int				keyIndex)
+{
+	Snapshot* snapshot = table->snapshot;
+	uint8_t const* slots = (uint8_t const*) snapshot->file.text.begin
+		+ table->offset + kSnapshotTableHeaderSize;
+
+	/* Encode the key the way the writer would have */
+	uint8_t key[kSnapshotValueSize];
+	memset(key, 0, sizeof(key));
+	uint8_t const* keyText = NULL;
+	uint64_t keySize = 0;
+	switch(lua_type(L, keyIndex))
+	{
+	case LUA_TBOOLEAN:
+		key[0] = lua_toboolean(L, keyIndex) ? kSnapshotType_True : kSnapshotType_False;
+		break;
+
+	case LUA_TNUMBER:
+		{
+			int isInteger = 0;
+			lua_Integer integer = lua_tointegerx(L, keyIndex, &isInteger);
+			if(isInteger)
+			{
+				if(integer >= 1 && (uint64_t) integer <= table->arrayCount)
+					return slots + (uint64_t) (integer - 1) * kSnapshotValueSize;
+				key[0] = kSnapshotType_Integer;
+				writeLittleEndian64((char*) key + 8, (uint64_t) integer);
+			}
+			else
+			{
+				double number = (double) lua_tonumber(L, keyIndex);
+				uint64_t bits = 0;
+				memcpy(&bits, &number, sizeof(bits));
+				key[0] = kSnapshotType_Float;
+				writeLittleEndian64((char*) key + 8, bits);
+			}
+		}
+		break;
+
+	case LUA_TSTRING:
+		{
+			size_t size = 0;
+			keyText = (uint8_t const*) lua_tolstring(L, keyIndex, &size);
+			keySize = size;
+			key[0] = kSnapshotType_String;
+		}
+		break;
+
+	default:
+		return NULL;
+	}
+
+	uint8_t const* entries = slots + table->arrayCount * kSnapshotValueSize;
+	uint64_t low = 0;
+	uint64_t high = table->hashCount;
+	while(low < high)
+	{
+		uint64_t middle = low + (high - low) / 2;
+		uint8_t const* entry = entries + middle * kSnapshotValueSize * 2;
+		uint8_t const* entryText = NULL;
+		uint64_t entrySize = 0;
+		if(entry[0] == kSnapshotType_String)
+			readSnapshotString(L, snapshot, entry, &entryText, &entrySize);
+
+		int order = compareSnapshotKeys(key, keyText, keySize, entry, entryText, entrySize);
+		if(order == 0)
+			return entry + kSnapshotValueSize;
+		if(order < 0)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return NULL;
+}
+
+static SnapshotTable* checkSnapshotTable(
+	lua_State*	L,
+	int			index)
+{
+	SnapshotTable* table = (SnapshotTable*) luaL_checkudata(L, index, kSnapshotTableMetatable);
+	if(!table->snapshot->isOpen)
+		luaL_error(L, "snapshot has been closed");
+	return table;
+}
+
+static int luaSnapshotTableIndex(lua_State* L)
+{
+	SnapshotTable* table = checkSnapshotTable(L, 1);
+	uint8_t const* value = findSnapshotEntry(L, table, 2);
+	if(!value)
+		return 0;
+	lua_getuservalue(L, 1);
+	pushSnapshotValue(L, -1, value);
+	return 1;
+}
+
+static int luaSnapshotTableNewIndex(lua_State* L)
+{
+	return luaL_error(L, "snapshot tables are read-only");
+}
+
+static int luaSnapshotTableLength(lua_State* L)
+{
+	SnapshotTable* table = checkSnapshotTable(L, 1);
+	lua_pushinteger(L, (lua_Integer) table->arrayCount);
+	return 1;
+}
+
+/*
+
+`pairs()` visits the array part in order, and then the
+other entries in the order they are stored. The position
+is kept in an upvalue of the iterator.
+
+*/
+static int luaSnapshotTableNext(lua_State* L)
+{
+	SnapshotTable* table = checkSnapshotTable(L, lua_upvalueindex(1));
+	uint8_t const* slots = (uint8_t const*) table->snapshot->file.text.begin
+		+ table->offset + kSnapshotTableHeaderSize;
+	uint64_t position = (uint64_t) lua_tointeger(L, lua_upvalueindex(2));
+
+	lua_getuservalue(L, lua_upvalueindex(1));
+	int snapshotIndex = lua_gettop(L);
+	for(; position < table->arrayCount + table->hashCount; position++)
+	{
+		if(position < table->arrayCount)
+		{
+			uint8_t const* value = slots + position * kSnapshotValueSize;
+			if(value[0] == kSnapshotType_Nil)
+				continue;
+			lua_pushinteger(L, (lua_Integer) position + 1);
+			pushSnapshotValue(L, snapshotIndex, value);
+		}
+		else
+		{
+			uint8_t const* entry = slots + table->arrayCount * kSnapshotValueSize
+				+ (position - table->arrayCount) * kSnapshotValueSize * 2;
+			pushSnapshotValue(L, snapshotIndex, entry);
+			pushSnapshotValue(L, snapshotIndex, entry + kSnapshotValueSize);
+		}
+		lua_pushinteger(L, (lua_Integer) position + 1);
+		lua_replace(L, lua_upvalueindex(2));
+		return 2;
+	}
+	return 0;
+}
+
+static int luaSnapshotTablePairs(lua_State* L)
+{
+	checkSnapshotTable(L, 1);
+	lua_pushvalue(L, 1);
+	lua_pushinteger(L, 0);
+	lua_pushcclosure(L, &luaSnapshotTableNext, 2);
+	lua_pushvalue(L, 1);
+	lua_pushnil(L);
+	return 3;
+}
+
+static int luaSnapshotTableToString(lua_State* L)
+{
+	lua_pushfstring(L, "snapshot table: %p", lua_touserdata(L, 1));
+	return 1;
+}
+
+static int luaCloseSnapshot(lua_State* L)
+{
+	Snapshot* snapshot = (Snapshot*) luaL_checkudata(L, 1, kSnapshotMetatable);
+	if(snapshot->isOpen)
+		closeInputFile(&snapshot->file);
+	snapshot->isOpen = 0;
+	return 0;
+}
+
+static int luaOpenSnapshot(lua_State* L)
+{
+	char const* path = luaL_checkstring(L, 1);
+
+	Snapshot* snapshot = (Snapshot*) lua_newuserdata(L, sizeof(Snapshot));
+	memset(snapshot, 0, sizeof(Snapshot));
+	if(luaL_newmetatable(L, kSnapshotMetatable))
+	{
+		lua_pushcfunction(L, &luaCloseSnapshot);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+	int snapshotIndex = lua_gettop(L);
+
+	openModelFile(L, path, &snapshot->file);
+	snapshot->isOpen = 1;
+
+	uint8_t const* header = (uint8_t const*) snapshot->file.text.begin;
+	uint64_t size = (uint64_t) (snapshot->file.text.end - snapshot->file.text.begin);
+	if(size < kSnapshotHeaderSize
+		|| memcmp(header, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0
+		|| header[8] != kSnapshotVersion
+		|| readLittleEndian64(header + 16) != size)
+	{
+		return luaL_error(L, "'%s' is not a snapshot written by this version of Fiddle", path);
+	}
+
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_pushliteral(L, "v");
+	lua_setfield(L, -2, "__mode");
+	lua_setmetatable(L, -2);
+	lua_setuservalue(L, snapshotIndex);
+
+	if(luaL_newmetatable(L, kSnapshotTableMetatable))
+	{
+		static luaL_Reg const kMetamethods[] =
+		{
+			{ "__index", &luaSnapshotTableIndex },
+			{ "__newindex", &luaSnapshotTableNewIndex },
+			{ "__len", &luaSnapshotTableLength },
+			{ "__pairs", &luaSnapshotTablePairs },
+			{ "__tostring", &luaSnapshotTableToString },
+			{ NULL, NULL },
+		};
+		luaL_setfuncs(L, kMetamethods, 0);
+	}
+	lua_pop(L, 1);
+
+	pushSnapshotValue(L, snapshotIndex, header + kSnapshotHeaderSize - kSnapshotValueSize);
+	return 1;
+}
+
+static int openFiddleModule(lua_State* L)
+{
+	static luaL_Reg const kFunctions[] =
+	{
+		{ "load_json", &luaLoadJson },
+		{ "load_csv", &luaLoadCsv },
+		{ "open_snapshot", &luaOpenSnapshot },
+		{ NULL, NULL },
+	};
+	luaL_newlib(L, kFunctions);
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+	return 1;
+}
+
+/*
+
+A state can be used with or without capturing `print()`,
+so we keep the original function in the registry.
+
+*/
+static char const kPrintKey[] = "fiddle.print";
+
+static void selectPrint(
+	lua_State*	L,
+	int			capturePrint)
+{
+	if(capturePrint)
+		lua_pushcfunction(L, &luaCapturedPrint);
+	else
+		lua_getfield(L, LUA_REGISTRYINDEX, kPrintKey);
+	lua_setglobal(L, "print");
+}
+
+/*
+
+`createLuaState()` creates and initializes a Lua state,
+so that every worker thread can have its own.
+
+*/
+static lua_State* createLuaState(
+	int	capturePrint)
+{
+	lua_State* L = lua_newstate(&allocatorForLua, 0);
+	if(!L)
+		return NULL;
+
+	luaL_openlibs(L);
+	luaL_requiref(L, "fiddle", &openFiddleModule, 1);
+	lua_pop(L, 1);
+
+	if(gIncludePath)
+	{
+		lua_getglobal(L, "package");
+		lua_pushstring(L, gIncludePath);
+		lua_pushstring(L, "/?.lua");
+		lua_concat(L, 2);
+		lua_setfield(L, -2, "path");
+		lua_pop(L, 1);
+	}
+
+	lua_getglobal(L, "print");
+	lua_setfield(L, LUA_REGISTRYINDEX, kPrintKey);
+	selectPrint(L, capturePrint);
+
+	if(gTrackDependencies || gKeepLuaStates)
+		installDependencyTracking(L);
+
+	return L;
+}
+
+/*
+
+While serving or watching, Lua states outlive the run that
+created them. `acquireLuaState()` prefers an idle state
+that was set up with the same include path, and
+`releaseLuaState()` keeps a state around for later.
+
+A server's clients run in different directories, and
+an include path like `inc` means something else in each
+of them, as does the `./?.lua` in the default module
+path. So idle states are matched by a key made of the
+real path of the current directory and the include path.
+
+Keeping the modules a state has loaded is the point, but
+not once the file a module was loaded from has changed.
+Modules can hold on to each other, so when any of them
+has changed we unload all of them.
+
+*/
+typedef struct IdleState
+{
+	lua_State*	L;
+	char*		key;
+} IdleState;
+
+enum { kMaxIdleStates = 64 };
+
+static FiddleMutex gIdleStateLock;
+static IdleState gIdleStates[kMaxIdleStates];
+static int gIdleStateCount = 0;
+
+static void unloadChangedModules(
+	lua_State*	L)
+{
+	int top = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, kModuleStampsKey);
+	lua_getfield(L, LUA_REGISTRYINDEX, kModulePathsKey);
+	if(!lua_istable(L, top + 1) || !lua_istable(L, top + 2))
+	{
+		lua_settop(L, top);
+		return;
+	}
+
+	int changed = 0;
+	lua_pushnil(L);
+	while(lua_next(L, top + 1))
+	{
+		pushFileStamp(L, lua_tostring(L, -2));
+		changed = !lua_rawequal(L, -1, -2);
+		lua_pop(L, 2);
+		if(changed)
+		{
+			lua_pop(L, 1);
+			break;
+		}
+	}
+
+	if(changed)
+	{
+		lua_getglobal(L, "package");
+		if(lua_getfield(L, -1, "loaded") == LUA_TTABLE)
+		{
+			lua_pushnil(L);
+			while(lua_next(L, top + 2))
+			{
+				lua_pop(L, 1);
+				lua_pushvalue(L, -1);
+				lua_pushnil(L);
+				lua_rawset(L, top + 4);
+			}
+		}
+
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, kModulePathsKey);
+		lua_newtable(L);
+		lua_setfield(L, LUA_REGISTRYINDEX, kModuleStampsKey);
+	}
+	lua_settop(L, top);
+}
+
+static char* makeIdleStateKey()
+{
+#ifdef _WIN32
+	char* directory = _fullpath(NULL, ".", 0);
+#else
+	char* directory = realpath(".", NULL);
+#endif
+	if(!directory)
+		return NULL;
+
+	char const* includePath = gIncludePath ? gIncludePath : "";
+	size_t size = strlen(directory) + strlen(includePath) + 4;
+	char* key = (char*) malloc(size);
+	if(key)
+		snprintf(key, size, "%s\n%s%s", directory, gIncludePath ? "-I" : "", includePath);
+	free(directory);
+	return key;
+}
+
+static lua_State* acquireLuaState(
+	int	capturePrint)
+{
+	char* key = gKeepLuaStates ? makeIdleStateKey() : NULL;
+	if(key)
+	{
+		lua_State* L = NULL;
+		lockMutex(&gIdleStateLock);
+		for(int ii = gIdleStateCount; ii-- > 0; )
+		{
+			if(strcmp(gIdleStates[ii].key, key) == 0)
+			{
+				L = gIdleStates[ii].L;
+				free(gIdleStates[ii].key);
+				gIdleStates[ii] = gIdleStates[--gIdleStateCount];
+				break;
+			}
+		}
+		unlockMutex(&gIdleStateLock);
+		free(key);
+
+		if(L)
+		{
+			unloadChangedModules(L);
+			selectPrint(L, capturePrint);
+			return L;
+		}
+	}
+	return createLuaState(capturePrint);
+}
+
+static void releaseLuaState(
+	lua_State*	L)
+{
+	char* key = gKeepLuaStates ? makeIdleStateKey() : NULL;
+	if(key)
+	{
+		lockMutex(&gIdleStateLock);
+		int kept = gIdleStateCount < kMaxIdleStates;
+		if(kept)
+		{
+			IdleState* idle = &gIdleStates[gIdleStateCount++];
+			idle->L = L;
+			idle->key = key;
+		}
+		unlockMutex(&gIdleStateLock);
+		if(kept)
+			return;
+		free(key);
+	}
+	lua_close(L);
+}
+
+/*
+
+### Prelude
+
+Sharing a Lua state between files lets globals set by
+one file leak into the next, but a fresh state per file
+would mean running the code that builds a big model
+again for every file. With `--prelude <script>`, we run
+the script once, in a Lua state of its own, and then
+process each file in a child process forked from ours.
+The child starts out with everything the prelude built
+(shared with us, copy-on-write), and whatever a file
+does to it is gone once the child exits. With `-j`,
+several children run at once.
+
+A child sends its diagnostics back to us over a socket,
+so they are reported in order like any others.
+
+*/
+static lua_State* gPreludeState = NULL;
+
+static int runPrelude()
+{
+	lua_State* L = createLuaState(0);
+	if(!L)
+	{
+		fprintf(stderr, "fiddle: failed to create Lua state\n");
+		exit(1);
+	}
+
+	if(gTrackDependencies)
+	{
+		beginDependencyTracking(L);
+		recordDependency(L, gPreludePath, 1);
+	}
+	int err = luaL_loadfile(L, gPreludePath);
+	if(err == LUA_OK)
+		err = lua_pcall(L, 0, 0, 0);
+	if(gTrackDependencies)
+		endDependencyTracking(L, &gPreludeDependencies);
+
+	if(err != LUA_OK)
+	{
+		reportError("%s", lua_tostring(L, -1));
+		lua_close(L);
+		freeDependencyList(&gPreludeDependencies);
+		return 0;
+	}
+	gPreludeState = L;
+	return 1;
+}
+
+static void closePrelude()
+{
+	if(gPreludeState)
+		lua_close(gPreludeState);
+	gPreludeState = NULL;
+	freeDependencyList(&gPreludeDependencies);
+}
+
+/*
+
+`writeSnapshot()` runs the script for `--snapshot` in a
+Lua state of its own, like a prelude, and writes the
+value it returns to a snapshot at `outputPath`.
+
+*/
+static char const* gSnapshotScript = NULL;
+
+static int writeSnapshot(
+	char const*	scriptPath,
+	char const*	outputPath)
+{
+	lua_State* L = createLuaState(0);
+	if(!L)
+	{
+		fprintf(stderr, "fiddle: failed to create Lua state\n");
+		exit(1);
+	}
+
+	SnapshotWriter writer;
+	memset(&writer, 0, sizeof(SnapshotWriter));
+	writer.L = L;
+
+	int err = luaL_loadfile(L, scriptPath);
+	if(err == LUA_OK)
+		err = lua_pcall(L, 0, 1, 0);
+	if(err == LUA_OK)
+	{
+		lua_pushcfunction(L, &buildSnapshot);
+		lua_insert(L, -2);
+		lua_pushlightuserdata(L, &writer);
+		err = lua_pcall(L, 2, 0, 0);
+	}
+
+	int ok = err == LUA_OK;
+	if(!ok)
+		reportError("%s", lua_tostring(L, -1));
+	else if(!writeFileAtomically(outputPath, writer.data, writer.data + writer.size))
+	{
+		reportError("cannot write '%s'", outputPath);
+		ok = 0;
+	}
+
+	free(writer.data);
+	lua_close(L);
+	return ok;
+}
+
+#ifndef _WIN32
+static int sendAll(
+	int			fd,
+	void const*	data,
+	size_t		size)
+{
+	char const* cursor = (char const*) data;
+	while(size)
+	{
+		ssize_t sent = send(fd, cursor, size, 0);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent <= 0)
+			return 0;
+		cursor += sent;
+		size -= (size_t) sent;
+	}
+	return 1;
+}
+
+static int receiveAll(
+	int		fd,
+	void*	data,
+	size_t	size)
+{
+	char* cursor = (char*) data;
+	while(size)
+	{
+		ssize_t received = recv(fd, cursor, size, 0);
+		if(received < 0 && errno == EINTR)
+			continue;
+		if(received <= 0)
+			return 0;
+		cursor += received;
+		size -= (size_t) received;
+	}
+	return 1;
+}
+
+typedef struct ChildResult
+{
+	uint64_t	outputSize;
+	uint64_t	messagesSize;
+	int32_t		errorCount;
+	int32_t		storedOutput;
+	FileStats	stats;
+} ChildResult;
+
+static int receiveText(
+	int			fd,
+	TextBuffer*	buffer,
+	uint64_t	size)
+{
+	if(!size)
+		return 1;
+	char* text = (char*) malloc((size_t) size);
+	if(!text)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	int ok = receiveAll(fd, text, (size_t) size);
+	if(ok)
+		appendText(buffer, text, (size_t) size);
+	free(text);
+	return ok;
+}
+
+/*
+
+`processFileInChild()` is `processFile()`, but in a child
+process. It must be called with diagnostics captured.
+
+*/
+static void processFileInChild(
+	char const*	inputPath,
+	int			requireMarker,
+	int			capturePrint)
+{
+	Diagnostics* diagnostics = tDiagnostics;
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+	{
+		reportError("cannot start a process for '%s': %s", inputPath, strerror(errno));
+		return;
+	}
+
+	/* Otherwise the child would write out anything still buffered, too */
+	fflush(stdout);
+	fflush(stderr);
+
+	pid_t pid = fork();
+	if(pid == 0)
+	{
+		close(fds[0]);
+		gOutputCacheStoreCount = 0;
+		selectPrint(gPreludeState, capturePrint);
+		processFile(gPreludeState, inputPath, requireMarker);
+		fflush(stdout);
+
+		ChildResult result;
+		memset(&result, 0, sizeof(ChildResult));
+		result.outputSize = diagnostics->output.size;
+		result.messagesSize = diagnostics->messages.size;
+		result.errorCount = diagnostics->errorCount;
+		result.storedOutput = gOutputCacheStoreCount != 0;
+		if(tFileStats)
+			result.stats = *tFileStats;
+		int ok = sendAll(fds[1], &result, sizeof(ChildResult))
+			&& sendAll(fds[1], diagnostics->output.data, diagnostics->output.size)
+			&& sendAll(fds[1], diagnostics->messages.data, diagnostics->messages.size);
+		_exit(ok ? 0 : 1);
+	}
+	close(fds[1]);
+	if(pid < 0)
+	{
+		reportError("cannot start a process for '%s': %s", inputPath, strerror(errno));
+		close(fds[0]);
+		return;
+	}
+
+	ChildResult result;
+	int ok = receiveAll(fds[0], &result, sizeof(ChildResult))
+		&& receiveText(fds[0], &diagnostics->output, result.outputSize)
+		&& receiveText(fds[0], &diagnostics->messages, result.messagesSize);
+	close(fds[0]);
+
+	int status = 0;
+	while(waitpid(pid, &status, 0) < 0 && errno == EINTR)
+	{}
+
+	if(!ok)
+	{
+		reportError("the process for '%s' failed", inputPath);
+		return;
+	}
+	diagnostics->errorCount += result.errorCount;
+	if(tFileStats)
+		*tFileStats = result.stats;
+	if(result.storedOutput)
+		atomicIncrement(&gOutputCacheStoreCount);
+}
+#endif
+
+/*
+
+### Jobserver
+
+When Fiddle runs from a recipe of a parallel GNU make,
+make tells it (through `MAKEFLAGS`) how to reach its
+jobserver, which hands out one token for every job that
+may run in addition to those already running. Fiddle then
+runs one file at a time on the implicit slot that make
+gave it, and every additional file that runs in parallel
+first takes a token, and returns it once the file is done.
+That way the total parallelism stays at what `make -j`
+allows, instead of multiplying with ours.
+
+Make describes its jobserver either as a pair of pipe
+file descriptors (`--jobserver-auth=R,W`, or the older
+`--jobserver-fds=R,W`), as a named pipe
+(`--jobserver-auth=fifo:PATH`), or on Windows as the name
+of a semaphore. Note that make only passes the pipe file
+descriptors to recipes it considers recursive (ones that
+use `$(MAKE)` or are marked with `+`); if they are not
+open, we simply run without a jobserver.
+
+We wait for tokens with a timeout, so that a worker can
+give up waiting once there is no more work for it. For
+that, we read tokens through a non-blocking file
+description of our own: we must not change the flags of
+the one shared with make and its other children.
+
+*/
+typedef struct Jobserver
+{
+	int		active;
+#ifdef _WIN32
+	HANDLE	semaphore;
+#else
+	int		readFD;
+	int		writeFD;
+	int		ownsReadFD;
+	int		nonBlocking;
+#endif
+} Jobserver;
+
+static Jobserver gJobserver;
+
+/*
+
+`findJobserverAuth()` returns the value of the last
+jobserver option in `MAKEFLAGS` (make may pass more
+than one, and the last one wins), copied into `buffer`.
+
+*/
+static int findJobserverAuth(
+	char const*	makeFlags,
+	char*		buffer,
+	size_t		bufferSize)
+{
+	static char const* const kOptions[] = { "--jobserver-auth=", "--jobserver-fds=" };
+
+	char const* value = NULL;
+	for(int ii = 0; ii < 2; ii++)
+	{
+		size_t optionSize = strlen(kOptions[ii]);
+		for(char const* cursor = makeFlags; (cursor = strstr(cursor, kOptions[ii])) != NULL; cursor++)
+		{
+			if(!value || cursor + optionSize > value)
+				value = cursor + optionSize;
+		}
+	}
+	if(!value)
+		return 0;
+
+	size_t size = strcspn(value, " \t");
+	if(size == 0 || size >= bufferSize)
+		return 0;
+	memcpy(buffer, value, size);
+	buffer[size] = 0;
+	return 1;
+}
+
+#ifndef _WIN32
+static int isOpenFileDescriptor(int fd)
+{
+	return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
+#endif
+
+static int connectJobserver(
+	Jobserver*	jobserver)
+{
+	memset(jobserver, 0, sizeof(Jobserver));
+
+	char const* makeFlags = getenv("MAKEFLAGS");
+	char auth[1024];
+	if(!makeFlags || !findJobserverAuth(makeFlags, auth, sizeof(auth)))
+		return 0;
+
+#ifdef _WIN32
+	jobserver->semaphore = OpenSemaphoreA(
+		SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE, auth);
+	if(!jobserver->semaphore)
+		return 0;
+#else
+	if(strncmp(auth, "fifo:", 5) == 0)
+	{
+		int fd = open(auth + 5, O_RDWR | O_NONBLOCK);
+		if(fd < 0)
+			return 0;
+		jobserver->readFD = fd;
+		jobserver->writeFD = fd;
+		jobserver->ownsReadFD = 1;
+		jobserver->nonBlocking = 1;
+	}
+	else
+	{
+		int readFD = -1;
+		int writeFD = -1;
+		if(sscanf(auth, "%d,%d", &readFD, &writeFD) != 2
+			|| !isOpenFileDescriptor(readFD)
+			|| !isOpenFileDescriptor(writeFD))
+		{
+			return 0;
+		}
+		jobserver->readFD = readFD;
+		jobserver->writeFD = writeFD;
+
+		/*
+
+		On Linux we can open the read end of the pipe
+		again, to get a file description that we can
+		make non-blocking. Elsewhere we read from the
+		shared one, after `poll()` says there is a
+		token (which another process may still take
+		before we do, in which case we block until
+		one is available).
+
+		*/
+		char path[64];
+		snprintf(path, sizeof(path), "/proc/self/fd/%d", readFD);
+		int fd = open(path, O_RDONLY | O_NONBLOCK);
+		if(fd >= 0)
+		{
+			jobserver->readFD = fd;
+			jobserver->ownsReadFD = 1;
+			jobserver->nonBlocking = 1;
+		}
+	}
+#endif
+
+	jobserver->active = 1;
+	return 1;
+}
+
+static void disconnectJobserver(
+	Jobserver*	jobserver)
+{
+	if(!jobserver->active)
+		return;
+#ifdef _WIN32
+	CloseHandle(jobserver->semaphore);
+#else
+	if(jobserver->ownsReadFD)
+		close(jobserver->readFD);
+#endif
+	memset(jobserver, 0, sizeof(Jobserver));
+}
+
+/*
+
+`tryAcquireJobToken()` waits up to `timeout` milliseconds
+for a token, and returns zero if it didn't get one, or
+-1 if the jobserver is gone.
+
+*/
+static int tryAcquireJobToken(
+	Jobserver*	jobserver,
+	char*		token,
+	int			timeout)
+{
+#ifdef _WIN32
+	*token = '+';
+	return WaitForSingleObject(jobserver->semaphore, (DWORD) timeout) == WAIT_OBJECT_0;
+#else
+	struct pollfd request;
+	request.fd = jobserver->readFD;
+	request.events = POLLIN;
+	request.revents = 0;
+
+	int ready = poll(&request, 1, timeout);
+	if(ready <= 0)
+		return 0;
+	if(!(request.revents & POLLIN))
+	{
+		/* Make has gone away, so there is no point in waiting */
+		if(request.revents & (POLLERR | POLLHUP | POLLNVAL))
+			return -1;
+		return 0;
+	}
+
+	ssize_t result = read(jobserver->readFD, token, 1);
+	return result == 1;
+#endif
+}
+
+static void releaseJobToken(
+	Jobserver*	jobserver,
+	char		token)
+{
+#ifdef _WIN32
+	(void) token;
+	ReleaseSemaphore(jobserver->semaphore, 1, NULL);
+#else
+	for(;;)
+	{
+		ssize_t result = write(jobserver->writeFD, &token, 1);
+		if(result == 1 || (result < 0 && errno != EINTR && errno != EAGAIN))
+			break;
+	}
+#endif
+}
+
+/*
+
+### Directories
+
+When a directory is given on the command line, we look
+for inputs anywhere inside it. Files whose names end
+in `.fiddle` are templates; any other file is an input
+if it contains a `FIDDLE TEMPLATE` marker (which we check
+for before parsing it, see `processFile()`). Hidden files
+and directories (names starting with `.`) are skipped,
+and so are symbolic links to directories, so that the
+walk can't go around in circles.
+
+The files found can be filtered with `--include` and
+`--exclude` glob patterns. A pattern that contains a `/`
+is matched against the path of a file relative to the
+directory given on the command line, and any other
+pattern against just the name of the file. In a pattern,
+`*` and `?` never match a `/`, while `**` matches across
+directories. An excluded directory is not entered at all.
+If any `--include` patterns are given, only the files
+that match one of them are used.
+
+*/
+static char const** gIncludeGlobs = NULL;
+static int gIncludeGlobCount = 0;
+static char const** gExcludeGlobs = NULL;
+static int gExcludeGlobCount = 0;
+
+/*
+
+`matchGlobClass()` matches a character against a
+`[...]` class, and returns -1 if the class isn't
+terminated (in which case the `[` is just a character).
+
+*/
+static int matchGlobClass(
+	char const*		pattern,
+	char			c,
+	char const**	outEnd)
+{
+	char const* cursor = pattern + 1;
+	int negate = 0;
+	if(*cursor == '!' || *cursor == '^')
+	{
+		negate = 1;
+		cursor++;
+	}
+
+	int matched = 0;
+	int first = 1;
+	while(*cursor && (*cursor != ']' || first))
+	{
+		unsigned char low = (unsigned char) cursor[0];
+		unsigned char high = low;
+		if(cursor[1] == '-' && cursor[2] && cursor[2] != ']')
+		{
+			high = (unsigned char) cursor[2];
+			cursor += 3;
+		}
+		else
+		{
+			cursor++;
+		}
+		if((unsigned char) c >= low && (unsigned char) c <= high)
+			matched = 1;
+		first = 0;
+	}
+	if(*cursor != ']')
+		return -1;
+
+	*outEnd = cursor + 1;
+	return c != '/' && matched != negate;
+}
+
+static int matchGlob(
+	char const*	pattern,
+	char const*	text)
+{
+	for(;;)
+	{
+		char p = *pattern;
+		if(p == 0)
+			return *text == 0;
+
+		if(p == '*')
+		{
+			int anyDepth = pattern[1] == '*';
+			pattern += anyDepth ? 2 : 1;
+
+			/* `**` followed by `/` may also match no directories at all */
+			if(anyDepth && *pattern == '/' && matchGlob(pattern + 1, text))
+				return 1;
+
+			for(;;)
+			{
+				if(matchGlob(pattern, text))
+					return 1;
+				if(*text == 0 || (*text == '/' && !anyDepth))
+					return 0;
+				text++;
+			}
+		}
+
+		if(*text == 0)
+			return 0;
+
+		if(p == '?')
+		{
+			if(*text == '/')
+				return 0;
+			pattern++;
+			text++;
+			continue;
+		}
+
+		if(p == '[')
+		{
+			char const* classEnd = NULL;
+			int result = matchGlobClass(pattern, *text, &classEnd);
+			if(result >= 0)
+			{
+				if(!result)
+					return 0;
+				pattern = classEnd;
+				text++;
+				continue;
+			}
+		}
+
+		if(p == '\\' && pattern[1])
+			p = *++pattern;
+
+		if(p != *text)
+			return 0;
+		pattern++;
+		text++;
+	}
+}
+
+static int matchAnyGlob(
+	char const**	globs,
+	int				globCount,
+	char const*		name,
+	char const*		relativePath)
+{
+	for(int ii = 0; ii < globCount; ii++)
+	{
+		char const* subject = strchr(globs[ii], '/') ? relativePath : name;
+		if(matchGlob(globs[ii], subject))
+			return 1;
+	}
+	return 0;
+}
+
+static int isPathSeparator(char c)
+{
+#ifdef _WIN32
+	return c == '/' || c == '\\';
+#else
+	return c == '/';
+#endif
+}
+
+static char* joinPath(
+	char const*	directory,
+	char const*	name)
+{
+	size_t directorySize = strlen(directory);
+	size_t nameSize = strlen(name);
+	int needsSeparator = directorySize && !isPathSeparator(directory[directorySize - 1]);
+
+	char* result = (char*) malloc(directorySize + needsSeparator + nameSize + 1);
+	if(!result)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(result, directory, directorySize);
+	if(needsSeparator)
+		result[directorySize] = '/';
+	memcpy(result + directorySize + needsSeparator, name, nameSize + 1);
+	return result;
+}
+
+static int isDirectoryPath(
+	char const*	path)
+{
+#ifdef _WIN32
+	DWORD attributes = GetFileAttributesA(path);
+	return attributes != INVALID_FILE_ATTRIBUTES
+		&& (attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat info;
+	return stat(path, &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+typedef struct DirectoryEntry
+{
+	char*	name;
+	int		isDirectory;
+} DirectoryEntry;
+
+typedef struct DirectoryListing
+{
+	DirectoryEntry*	entries;
+	size_t			count;
+	size_t			capacity;
+} DirectoryListing;
+
+static void addDirectoryEntry(
+	DirectoryListing*	listing,
+	char const*			name,
+	int					isDirectory)
+{
+	if(listing->count == listing->capacity)
+	{
+		size_t capacity = listing->capacity ? listing->capacity * 2 : 64;
+		DirectoryEntry* entries = (DirectoryEntry*) realloc(listing->entries, capacity * sizeof(DirectoryEntry));
+		if(!entries)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		listing->entries = entries;
+		listing->capacity = capacity;
+	}
+
+	size_t nameSize = strlen(name) + 1;
+	char* copy = (char*) malloc(nameSize);
+	if(!copy)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	memcpy(copy, name, nameSize);
+
+	listing->entries[listing->count].name = copy;
+	listing->entries[listing->count].isDirectory = isDirectory;
+	listing->count++;
+}
+
+/*
+
+`listDirectory()` collects the names of the regular files
+and directories in a directory. Where the directory
+entries tell us the type of each file, we avoid calling
+`stat()` on every one of them.
+
+*/
+static int listDirectory(
+	char const*			path,
+	DirectoryListing*	listing)
+{
+#ifdef _WIN32
+	char* pattern = joinPath(path, "*");
+	WIN32_FIND_DATAA data;
+	HANDLE find = FindFirstFileExA(pattern, FindExInfoBasic, &data,
+		FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	free(pattern);
+	if(find == INVALID_HANDLE_VALUE)
+		return GetLastError() == ERROR_FILE_NOT_FOUND;
+
+	do
+	{
+		char const* name = data.cFileName;
+		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		int isDirectory = (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if(isDirectory && (data.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			continue;
+		addDirectoryEntry(listing, name, isDirectory);
+	} while(FindNextFileA(find, &data));
+
+	FindClose(find);
+	return 1;
+#else
+	int fd = open(path, O_RDONLY | O_DIRECTORY);
+	if(fd < 0)
+		return 0;
+	DIR* directory = fdopendir(fd);
+	if(!directory)
+	{
+		close(fd);
+		return 0;
+	}
+
+	struct dirent* entry;
+	while((entry = readdir(directory)) != NULL)
+	{
+		char const* name = entry->d_name;
+		if(strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+			continue;
+
+		int isDirectory = 0;
+		int isLink = 0;
+		int known = 0;
+#ifdef DT_UNKNOWN
+		switch(entry->d_type)
+		{
+		case DT_DIR:		isDirectory = 1; known = 1; break;
+		case DT_REG:		known = 1; break;
+		case DT_LNK:		isLink = 1; break;
+		case DT_UNKNOWN:	break;
+		default:			continue;
+		}
+#endif
+		if(!known)
+		{
+			struct stat info;
+			if(fstatat(fd, name, &info, 0) != 0)
+				continue;
+			if(S_ISDIR(info.st_mode))
+			{
+				/* We don't follow links to directories */
+				if(isLink)
+					continue;
+				if(fstatat(fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0 || S_ISLNK(info.st_mode))
+					continue;
+				isDirectory = 1;
+			}
+			else if(!S_ISREG(info.st_mode))
+			{
+				continue;
+			}
+		}
+		addDirectoryEntry(listing, name, isDirectory);
+	}
+
+	closedir(directory);
+	return 1;
+#endif
+}
+
+static int compareDirectoryEntries(
+	void const*	left,
+	void const*	right)
+{
+	return strcmp(
+		((DirectoryEntry const*) left)->name,
+		((DirectoryEntry const*) right)->name);
+}
+
+/*
+
+### Work Queue
+
+Each input (a file or directory given on the command
+line, or a file or directory found inside one) becomes
+a `Task`. Worker threads take tasks from a shared
+`WorkQueue`, and walking a directory adds a task for
+each of its entries, so files are processed as soon as
+they are found.
+
+Each task records the diagnostics for its input. The
+tasks form a tree (with the entries of a directory in
+sorted order), and diagnostics are printed in a
+pre-order walk of that tree, as far as all of the tasks
+have finished. That way the output is the same no
+matter how the work was scheduled.
+
+*/
+typedef enum TaskKind
+{
+	kTaskKind_Root,
+	kTaskKind_Argument,
+	kTaskKind_Directory,
+	kTaskKind_File,
+} TaskKind;
+
+typedef struct Task Task;
+struct Task
+{
+	TaskKind	kind;
+	char*		path;
+
+	/* Size of the prefix of `path` naming the directory given on the command line */
+	size_t		rootSize;
+
+	Diagnostics	diagnostics;
+	FileStats	stats;
+	int			done;
+
+	Task*		parent;
+	Task*		firstChild;
+	Task*		nextSibling;
+	Task*		nextQueued;
+	Task*		nextAllocated;
+};
+
+typedef struct WorkQueue
+{
+	FiddleMutex		lock;
+	FiddleCondition	wake;
+
+	Task			root;
+	Task*			allocatedTasks;
+
+	Task*			queueHead;
+	Task*			queueTail;
+	size_t			activeCount;
+
+	Task*			reportCursor;
+	int				capturePrint;
+	int				errorCount;
+
+	/* Only used with `--stats` or `--stats-json` */
+	int				collectsStats;
+	StatsReport		stats;
+} WorkQueue;
+
+/*
+
+`newTask()` must be called with the queue locked.
+
+*/
+static Task* newTask(
+	WorkQueue*	queue,
+	TaskKind	kind,
+	char*		path,
+	size_t		rootSize,
+	Task*		parent)
+{
+	Task* task = (Task*) calloc(1, sizeof(Task));
+	if(!task)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	task->kind = kind;
+	task->path = path;
+	task->rootSize = rootSize;
+	task->parent = parent;
+
+	task->nextAllocated = queue->allocatedTasks;
+	queue->allocatedTasks = task;
+	return task;
+}
+
+static void enqueueTask(
+	WorkQueue*	queue,
+	Task*		task)
+{
+	if(queue->queueTail)
+		queue->queueTail->nextQueued = task;
+	else
+		queue->queueHead = task;
+	queue->queueTail = task;
+}
+
+static Task* dequeueTask(
+	WorkQueue*	queue)
+{
+	Task* task = queue->queueHead;
+	queue->queueHead = task->nextQueued;
+	if(!queue->queueHead)
+		queue->queueTail = NULL;
+	task->nextQueued = NULL;
+	return task;
+}
+
+static Task* nextTaskInOrder(
+	Task*	task)
+{
+	if(task->firstChild)
+		return task->firstChild;
+	while(task)
+	{
+		if(task->nextSibling)
+			return task->nextSibling;
+		task = task->parent;
+	}
+	return NULL;
+}
+
+static void reportFinishedTasks(
+	WorkQueue*	queue)
+{
+	Task* task = queue->reportCursor;
+	while(task && task->done)
+	{
+		Diagnostics* diagnostics = &task->diagnostics;
+		if(diagnostics->output.size)
+		{
+			fwrite(diagnostics->output.data, 1, diagnostics->output.size, stdout);
+			fflush(stdout);
+		}
+		if(diagnostics->messages.size)
+		{
+			fwrite(diagnostics->messages.data, 1, diagnostics->messages.size, stderr);
+			fflush(stderr);
+		}
+		queue->errorCount += diagnostics->errorCount;
+		if(queue->collectsStats)
+			reportFileStats(&queue->stats, task->path, &task->stats);
+
+		freeTextBuffer(&diagnostics->output);
+		freeTextBuffer(&diagnostics->messages);
+		if(task->kind != kTaskKind_Argument)
+			free(task->path);
+		task->path = NULL;
+
+		task = nextTaskInOrder(task);
+	}
+	queue->reportCursor = task;
+}
+
+/*
+
+`isWalkedEntry()` decides whether a directory walk
+visits an entry named `name`, at `relativePath` in the
+directory given on the command line.
+
+*/
+static int isWalkedEntry(
+	char const*	name,
+	char const*	relativePath,
+	int			isDirectory)
+{
+	if(name[0] == '.')
+		return 0;
+	if(matchAnyGlob(gExcludeGlobs, gExcludeGlobCount, name, relativePath))
+		return 0;
+	if(isDirectory)
+		return 1;
+
+	/* Literate templates aren't supported yet */
+	if(stringEndsWith(name, ".md"))
+		return 0;
+	if(gIncludeGlobCount
+		&& !matchAnyGlob(gIncludeGlobs, gIncludeGlobCount, name, relativePath))
+	{
+		return 0;
+	}
+	return 1;
+}
+
+/*
+
+`walkDirectory()` adds a task for every entry of the
+directory named by `task` that passes our filters.
+
+*/
+static void walkDirectory(
+	WorkQueue*	queue,
+	Task*		task)
+{
+	DirectoryListing listing;
+	memset(&listing, 0, sizeof(DirectoryListing));
+	if(!listDirectory(task->path, &listing))
+	{
+		reportError("cannot read directory '%s'", task->path);
+		return;
+	}
+	qsort(listing.entries, listing.count, sizeof(DirectoryEntry), &compareDirectoryEntries);
+
+	lockMutex(&queue->lock);
+	Task** link = &task->firstChild;
+	for(size_t ii = 0; ii < listing.count; ii++)
+	{
+		DirectoryEntry* entry = &listing.entries[ii];
+		char* path = joinPath(task->path, entry->name);
+		if(isWalkedEntry(entry->name, path + task->rootSize, entry->isDirectory))
+		{
+			Task* child = newTask(queue,
+				entry->isDirectory ? kTaskKind_Directory : kTaskKind_File,
+				path, task->rootSize, task);
+			*link = child;
+			link = &child->nextSibling;
+			enqueueTask(queue, child);
+			path = NULL;
+		}
+		free(path);
+		free(entry->name);
+	}
+	if(task->firstChild)
+		wakeAllWaiting(&queue->wake);
+	unlockMutex(&queue->lock);
+
+	free(listing.entries);
+}
+
+/*
+
+A `Worker` that doesn't hold the implicit job slot must
+get a token from the jobserver (if there is one) for
+each task it runs.
+
+*/
+typedef struct Worker
+{
+	WorkQueue*	queue;
+	int			hasImplicitSlot;
+	lua_State*	L;
+} Worker;
+
+enum
+{
+	kJobTokenPollInterval = 50,
+};
+
+static void runTask(
+	Worker*	worker,
+	Task*	task)
+{
+	WorkQueue* queue = worker->queue;
+	switch(task->kind)
+	{
+	case kTaskKind_Argument:
+		if(isDirectoryPath(task->path))
+		{
+			size_t size = strlen(task->path);
+			task->rootSize = size + (size && !isPathSeparator(task->path[size - 1]));
+			walkDirectory(queue, task);
+			return;
+		}
+		break;
+
+	case kTaskKind_Directory:
+		walkDirectory(queue, task);
+		return;
+
+	default:
+		break;
+	}
+
+	int requireMarker = task->kind == kTaskKind_File
+		&& !stringEndsWith(task->path, ".fiddle");
+#ifndef _WIN32
+	if(gPreludeState)
+	{
+		processFileInChild(task->path, requireMarker, queue->capturePrint);
+		return;
+	}
+#endif
+
+	/*
+
+	We only create a Lua state once there is a file to
+	process, since a worker may never get one at all.
+
+	*/
+	if(!worker->L)
+	{
+		worker->L = acquireLuaState(queue->capturePrint);
+		if(!worker->L)
+		{
+			fprintf(stderr, "fiddle: failed to create Lua state\n");
+			exit(1);
+		}
+	}
+
+	processFile(worker->L, task->path, requireMarker);
+}
+
+static void runWorker(
+	void*	userData)
+{
+	Worker* worker = (Worker*) userData;
+	WorkQueue* queue = worker->queue;
+
+	char token = 0;
+	int hasToken = 0;
+
+	lockMutex(&queue->lock);
+	for(;;)
+	{
+		if(!queue->queueHead)
+		{
+			/* We never hold on to a token while idle */
+			if(hasToken)
+			{
+				releaseJobToken(&gJobserver, token);
+				hasToken = 0;
+			}
+			if(queue->activeCount == 0)
+				break;
+			waitCondition(&queue->wake, &queue->lock);
+			continue;
+		}
+
+		if(!worker->hasImplicitSlot && gJobserver.active && !hasToken)
+		{
+			unlockMutex(&queue->lock);
+			int result = tryAcquireJobToken(&gJobserver, &token, kJobTokenPollInterval);
+			lockMutex(&queue->lock);
+			if(result < 0)
 				break;
+			hasToken = result;
+			continue;
+		}
+
+		Task* task = dequeueTask(queue);
+		queue->activeCount++;
+		unlockMutex(&queue->lock);
+
+		tDiagnostics = &task->diagnostics;
+		tFileStats = queue->collectsStats ? &task->stats : NULL;
+		runTask(worker, task);
+		tDiagnostics = NULL;
+		tFileStats = NULL;
+
+		if(hasToken)
+		{
+			releaseJobToken(&gJobserver, token);
+			hasToken = 0;
+		}
+
+		lockMutex(&queue->lock);
+		task->done = 1;
+		queue->activeCount--;
+		reportFinishedTasks(queue);
+		if(!queue->queueHead && queue->activeCount == 0)
+			wakeAllWaiting(&queue->wake);
+	}
+	unlockMutex(&queue->lock);
+
+	if(worker->L)
+		releaseLuaState(worker->L);
+	worker->L = NULL;
+}
+
+/*
+
+`processFiles()` processes all of the given files and
+directories, using up to `workerCount` threads, and
+returns the number of errors reported.
+
+*/
+static int processFiles(
+	char**	paths,
+	size_t	pathCount,
+	int		workerCount)
+{
+	WorkQueue queue;
+	memset(&queue, 0, sizeof(WorkQueue));
+	initMutex(&queue.lock);
+	initCondition(&queue.wake);
+
+	queue.root.kind = kTaskKind_Root;
+	queue.root.done = 1;
+	queue.reportCursor = &queue.root;
+
+	int hasDirectories = 0;
+	Task** link = &queue.root.firstChild;
+	for(size_t ii = 0; ii < pathCount; ii++)
+	{
+		Task* task = newTask(&queue, kTaskKind_Argument, paths[ii], 0, &queue.root);
+		*link = task;
+		link = &task->nextSibling;
+		enqueueTask(&queue, task);
+
+		if(!hasDirectories && isDirectoryPath(paths[ii]))
+			hasDirectories = 1;
+	}
+
+	if(!hasDirectories && (size_t) workerCount > pathCount)
+		workerCount = (int) pathCount;
+	if(workerCount < 1)
+		workerCount = 1;
+	/*
+
+	Files are processed in the order they are found,
+	which (with several workers, or while walking
+	directories) isn't the order in which we report
+	them, so then we capture `print()` output as well.
+
+	*/
+	queue.capturePrint = workerCount > 1 || hasDirectories;
+	queue.collectsStats = gPrintStats || gStatsJsonPath;
 
-			case kSourceFileParseState_InTemplateCode:
-			case kSourceFileParseState_InTemplateOutput:
-				fprintf(stderr, "fiddle: error: starting new template without ending previous one\n");
-				return 0;
-			}
+	/*
 
-			continue;
-		}
+	The main thread is one of the workers (the one that
+	uses the implicit job slot), so we only start
+	`workerCount - 1` additional threads.
 
-		char const* closeLoc = findMatchInLine(closeTagPattern, line);
-		if(closeLoc)
-		{
-			/*
-			*/
-			switch(state)
-			{
-			case kSourceFileParseState_InTemplateCode:
-				chunk->code.end = line.begin;
-				chunk->prefix.end = cursor;
-				chunk->outputSpan.begin = cursor;
-				chunk->linePrefix = commonPrefix(line, chunk->linePrefix);
-				state = kSourceFileParseState_InTemplateOutput;
-				break;
+	*/
+	Worker* workers = (Worker*) calloc(workerCount, sizeof(Worker));
+	FiddleThread* threads = (FiddleThread*) calloc(workerCount, sizeof(FiddleThread));
+	if(!workers || !threads)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+	for(int ii = 0; ii < workerCount; ii++)
+	{
+		workers[ii].queue = &queue;
+		workers[ii].hasImplicitSlot = (ii == 0);
+	}
 
-			case kSourceFileParseState_Initial:
-			case kSourceFileParseState_Default:
-			case kSourceFileParseState_InTemplateOutput:
-				fprintf(stderr, "fiddle: error: 'OUTPUT' tag without 'TEMPLATE'\n");
-				return 0;
+	int threadCount = 0;
+	for(int ii = 1; ii < workerCount; ii++)
+	{
+		if(!startThread(&threads[threadCount], &runWorker, &workers[ii]))
+			break;
+		threadCount++;
+	}
 
-			}
-		}
+	runWorker(&workers[0]);
 
-		char const* endLoc = findMatchInLine(endTagPattern, line);
-		if(endLoc)
-		{
-			/*
-			*/
-			switch(state)
-			{
-			case kSourceFileParseState_InTemplateOutput:
-				/*
+	for(int ii = 0; ii < threadCount; ii++)
+		joinThread(threads[ii]);
+	free(threads);
+	free(workers);
 
-				Okay, we've reached the end of an embedded
-				template, and we need to finish up
-				the current chunk and start a new one.
+	if(queue.collectsStats)
+		finishStatsReport(&queue.stats);
 
-				*/
-				chunk->outputSpan.end = line.begin;
-				chunk->codeNode = parseTemplate(
-					chunk->code,
-					chunk->linePrefix);
-				/*
+	int errorCount = queue.errorCount;
+	Task* task = queue.allocatedTasks;
+	while(task)
+	{
+		Task* next = task->nextAllocated;
+		free(task);
+		task = next;
+	}
+	destroyCondition(&queue.wake);
+	destroyMutex(&queue.lock);
+	return errorCount;
+}
 
-				Failure to parse the template should
-				count as a failure for the overall
-				file.
+char const* readArg(
+	char const* opt,
+	char*** ioArgCursor,
+	char** argEnd)
+{
+	if(*ioArgCursor == argEnd)
+	{
+		fprintf(stderr, "fiddle: expected argument for option '%s'\n", opt);
+		*ioArgCursor = NULL;
+		return NULL;
+	}
+	else
+	{
+		return *(*ioArgCursor)++;
+	}
+}
 
-				*/
-				if(!chunk->codeNode)
-				{
-					return 0;
-				}
+/*
 
-				/*
+`trimOutputCache()` deletes the least recently used
+files from the cache until it fits in its size limit
+(with some room to spare, so that the next few runs
+don't each have to trim it again). Other processes may
+be using the cache at the same time, so files can
+disappear under us; we just skip them.
 
-				State a new chunk.
+*/
+typedef struct CacheFileInfo
+{
+	char*		path;
+	uint64_t	size;
+	int64_t		time;
+} CacheFileInfo;
+
+static int compareCacheFileTimes(
+	void const*	left,
+	void const*	right)
+{
+	CacheFileInfo const* l = (CacheFileInfo const*) left;
+	CacheFileInfo const* r = (CacheFileInfo const*) right;
+	if(l->time != r->time)
+		return l->time < r->time ? -1 : 1;
+	return strcmp(l->path, r->path);
+}
 
-				*/
-				chunk = allocateChunk();
-				*link = chunk;
-				link = &chunk->next;
-				chunk->prefix.begin = line.begin;
-				state = kSourceFileParseState_Default;
-				break;
+static void trimOutputCache()
+{
+	DirectoryListing listing;
+	memset(&listing, 0, sizeof(DirectoryListing));
+	if(!listDirectory(gOutputCacheDir, &listing))
+		return;
 
-			case kSourceFileParseState_Initial:
-			case kSourceFileParseState_Default:
-				fprintf(stderr, "fiddle: error: 'END' tag without 'TEMPLATE'\n");
-				return 0;
-			case kSourceFileParseState_InTemplateCode:
-				fprintf(stderr, "fiddle: error: 'END' tag without 'OUTPUT'\n");
-				return 0;
+	CacheFileInfo* files = (CacheFileInfo*) calloc(listing.count ? listing.count : 1, sizeof(CacheFileInfo));
+	if(!files)
+	{
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
 
+	size_t fileCount = 0;
+	uint64_t totalSize = 0;
+	for(size_t ii = 0; ii < listing.count; ii++)
+	{
+		DirectoryEntry* entry = &listing.entries[ii];
+		if(!entry->isDirectory
+			&& (stringEndsWith(entry->name, kManifestSuffix)
+				|| stringEndsWith(entry->name, kCachedOutputSuffix)))
+		{
+			char* path = joinPath(gOutputCacheDir, entry->name);
+#ifdef _WIN32
+			struct _stat64 info;
+			int found = _stat64(path, &info) == 0;
+#else
+			struct stat info;
+			int found = stat(path, &info) == 0;
+#endif
+			if(found)
+			{
+				files[fileCount].path = path;
+				files[fileCount].size = (uint64_t) info.st_size;
+				files[fileCount].time = (int64_t) info.st_mtime;
+				totalSize += files[fileCount].size;
+				fileCount++;
+			}
+			else
+			{
+				free(path);
 			}
 		}
-		/*
+		free(entry->name);
+	}
+	free(listing.entries);
 
-		If none of the above cases matched, then this
-		is an "ordinary" line.
+	if(totalSize > gOutputCacheLimit)
+	{
+		qsort(files, fileCount, sizeof(CacheFileInfo), &compareCacheFileTimes);
 
-		*/
-		switch(state)
+		uint64_t target = gOutputCacheLimit - gOutputCacheLimit / 10;
+		for(size_t ii = 0; ii < fileCount && totalSize > target; ii++)
 		{
-		default:
-			break;
-
-		case kSourceFileParseState_InTemplateCode:
-			chunk->linePrefix = commonPrefix(line, chunk->linePrefix);
-			break;
+			if(remove(files[ii].path) == 0 || errno == ENOENT)
+				totalSize -= files[ii].size;
 		}
 	}
-	/*
 
-	We've reached the end of the file.
-	If we never ran into any embedded templates,
-	then there is no point in processing this file
-	further, and we should bail.
+	for(size_t ii = 0; ii < fileCount; ii++)
+		free(files[ii].path);
+	free(files);
+}
 
-	*/
-	if(state == kSourceFileParseState_Initial)
+/*
+
+`parseSize()` reads a size in bytes, optionally followed
+by `K`, `M` or `G` (for units of 1024 bytes, and so on).
+
+*/
+static int parseSize(
+	char const*	text,
+	uint64_t*	outSize)
+{
+	char* end = NULL;
+	errno = 0;
+	unsigned long long value = strtoull(text, &end, 10);
+	if(end == text || errno != 0 || *text == '-')
 		return 0;
-	/*
 
-	Otherwise we need to terminate the last
-	chunk, and then return the whole list
-	of chunks.
+	int shift = 0;
+	switch(*end)
+	{
+	case 'K': case 'k': shift = 10; end++; break;
+	case 'M': case 'm': shift = 20; end++; break;
+	case 'G': case 'g': shift = 30; end++; break;
+	default: break;
+	}
+	if(*end != 0 || value > (~0ull >> shift))
+		return 0;
 
-	*/
-	chunk->prefix.end = end;
-	chunk->code.begin = end;
-	chunk->code.end = end;
-	chunk->outputSpan.begin = end;
-	chunk->outputSpan.end = end;
-	chunk->codeNode = 0;
-	return chunks;
+	*outSize = (uint64_t) value << shift;
+	return 1;
 }
 
+/*
 
+### Watch Loop
 
-static int stringEndsWith(
-	char const*	str,
-	char const*	suffix)
+`runWatchLoop()` waits for changes with inotify, which
+reports changes to the entries of a directory, so we
+watch the directory holding each file we care about:
+the files we processed, the files their templates read,
+and (recursively) the directories given on the command
+line, where new files can turn up.
+
+Editors and build tools tend to change several files in
+a row, so once something changes we wait until nothing
+has changed for `kWatchQuietPeriod` milliseconds, and
+then process every affected file at once (in parallel,
+with `-j`). The Lua states, with the modules they have
+loaded and the templates they have compiled, are kept
+from one run to the next, just like on a server.
+
+*/
+#ifdef __linux__
+typedef struct WatchRoot
 {
-	size_t strSize = strlen(str);
-	size_t suffixSize = strlen(suffix);
-	if(strSize < suffixSize)
-		return 0;		
+	char*	path;
+	char*	key;
+} WatchRoot;
 
-	return strcmp(
-		str + strSize - suffixSize,
-		suffix) == 0;
+typedef struct WatchedDirectory
+{
+	int		descriptor;
+	char*	key;
+} WatchedDirectory;
+
+typedef struct Watcher
+{
+	int					fd;
+
+	WatchedDirectory*	directories;
+	size_t				directoryCount;
+	size_t				directoryCapacity;
+
+	/* The directories given on the command line */
+	WatchRoot*			roots;
+	size_t				rootCount;
+
+	/* New files to process, found in those directories */
+	char**				foundPaths;
+	size_t				foundCount;
+	size_t				foundCapacity;
+
+	/* Set if the kernel dropped events, so we must start over */
+	int					overflowed;
+} Watcher;
+
+enum
+{
+	kWatchQuietPeriod = 50,
+	kWatchEventBufferSize = 16 * 1024,
+};
+
+static uint32_t const kWatchedEvents =
+	IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR;
+
+static void watchDirectory(
+	Watcher*	watcher,
+	char const*	key)
+{
+	for(size_t ii = 0; ii < watcher->directoryCount; ii++)
+	{
+		if(strcmp(watcher->directories[ii].key, key) == 0)
+			return;
+	}
+
+	int descriptor = inotify_add_watch(watcher->fd, key, kWatchedEvents);
+	if(descriptor < 0)
+		return;
+
+	if(watcher->directoryCount == watcher->directoryCapacity)
+	{
+		size_t capacity = watcher->directoryCapacity ? watcher->directoryCapacity * 2 : 64;
+		WatchedDirectory* directories = (WatchedDirectory*) realloc(
+			watcher->directories, capacity * sizeof(WatchedDirectory));
+		if(!directories)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		watcher->directories = directories;
+		watcher->directoryCapacity = capacity;
+	}
+	WatchedDirectory* directory = &watcher->directories[watcher->directoryCount++];
+	directory->descriptor = descriptor;
+	directory->key = copyString(key, strlen(key));
 }
 
-static char* pickOutputPath(
-	char const* inputPath,
-	char const* suffix)
+static void watchParentDirectory(
+	Watcher*	watcher,
+	char const*	key)
 {
-	assert(stringEndsWith(inputPath, suffix));
+	char const* name = strrchr(key, '/');
+	if(!name)
+		return;
 
-	size_t inputSize = strlen(inputPath);
-	size_t suffixSize = strlen(suffix);
+	char* directory = name == key ? copyString("/", 1) : copyString(key, name - key);
+	watchDirectory(watcher, directory);
+	free(directory);
+}
 
-	size_t trimmedSize = inputSize - suffixSize;
+static void watchRecordedFiles(
+	Watcher*	watcher)
+{
+	for(size_t ii = 0; ii < gWatchedFileCount; ii++)
+	{
+		WatchedFile* file = &gWatchedFiles[ii];
+		if(!file->unwatched)
+			continue;
+		watchParentDirectory(watcher, file->key);
+		for(size_t jj = 0; jj < file->dependencyCount; jj++)
+			watchParentDirectory(watcher, file->dependencyKeys[jj]);
+		file->unwatched = 0;
+	}
+}
 
-	char* buffer = (char*) malloc(trimmedSize + 1);
-	if(!buffer)
-		return NULL;
+/*
 
-	memcpy(buffer, inputPath, trimmedSize);
-	buffer[trimmedSize] = 0;
+`isWalkedPath()` applies `isWalkedEntry()` to each step
+of a path relative to a directory given on the command
+line, since a directory walk would never have reached a
+file inside a directory it skips.
 
-	return buffer;
+*/
+static int isWalkedPath(
+	char const*	relativePath,
+	int			isDirectory)
+{
+	char* path = copyString(relativePath, strlen(relativePath));
+	char* name = path;
+	int walked = 1;
+	for(char* cursor = path; walked; cursor++)
+	{
+		char c = *cursor;
+		if(c != '/' && c != 0)
+			continue;
+
+		*cursor = 0;
+		walked = isWalkedEntry(name, path, c == '/' || isDirectory);
+		*cursor = c;
+		name = cursor + 1;
+		if(c == 0)
+			break;
+	}
+	free(path);
+	return walked;
 }
 
-typedef struct SkubWriter
+static void addFoundFile(
+	Watcher*	watcher,
+	WatchRoot*	root,
+	char const*	relativePath)
 {
-	char* cursor;
-	char* begin;
-	char* end;
-} SkubWriter;
+	char* path = joinPath(root->path, relativePath);
+	for(size_t ii = 0; ii < watcher->foundCount; ii++)
+	{
+		if(strcmp(watcher->foundPaths[ii], path) == 0)
+		{
+			free(path);
+			return;
+		}
+	}
 
-static void writeRawByte(
-	SkubWriter*	writer,
-	char 		val)
+	/* The same test that a directory walk applies */
+	int isInput = stringEndsWith(path, ".fiddle");
+	if(!isInput)
+	{
+		InputFile input;
+		char const* failure = NULL;
+		if(tryOpenInputFile(&input, path, &failure))
+		{
+			isInput = containsTemplateMarker(input.text);
+			closeInputFile(&input);
+		}
+	}
+	if(!isInput)
+	{
+		free(path);
+		return;
+	}
+
+	if(watcher->foundCount == watcher->foundCapacity)
+	{
+		size_t capacity = watcher->foundCapacity ? watcher->foundCapacity * 2 : 16;
+		char** paths = (char**) realloc(watcher->foundPaths, capacity * sizeof(char*));
+		if(!paths)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+		watcher->foundPaths = paths;
+		watcher->foundCapacity = capacity;
+	}
+	watcher->foundPaths[watcher->foundCount++] = path;
+}
+
+/*
+
+`watchTree()` watches a directory inside `root` (at
+`relativePath`, which is empty for the root itself) and
+the directories inside it. If `collect` is set, the
+files inside are new to us, so we process them too.
+
+*/
+static void watchTree(
+	Watcher*	watcher,
+	WatchRoot*	root,
+	char const*	relativePath,
+	int			collect)
+{
+	char* key = *relativePath
+		? joinPath(root->key, relativePath)
+		: copyString(root->key, strlen(root->key));
+	char* path = *relativePath
+		? joinPath(root->path, relativePath)
+		: copyString(root->path, strlen(root->path));
+	watchDirectory(watcher, key);
+
+	DirectoryListing listing;
+	memset(&listing, 0, sizeof(DirectoryListing));
+	if(listDirectory(path, &listing))
+	{
+		for(size_t ii = 0; ii < listing.count; ii++)
+		{
+			DirectoryEntry* entry = &listing.entries[ii];
+			char* entryPath = *relativePath
+				? joinPath(relativePath, entry->name)
+				: copyString(entry->name, strlen(entry->name));
+			if(isWalkedEntry(entry->name, entryPath, entry->isDirectory))
+			{
+				if(entry->isDirectory)
+					watchTree(watcher, root, entryPath, collect);
+				else if(collect)
+					addFoundFile(watcher, root, entryPath);
+			}
+			free(entryPath);
+			free(entry->name);
+		}
+		free(listing.entries);
+	}
+	free(path);
+	free(key);
+}
+
+static int isSameFileStamp(
+	FileStamp const*	left,
+	FileStamp const*	right)
+{
+	return left->seconds == right->seconds
+		&& left->nanoseconds == right->nanoseconds
+		&& left->size == right->size;
+}
+
+static void handleWatchEvent(
+	Watcher*				watcher,
+	struct inotify_event*	event)
 {
-	char* c = writer->cursor;
-	char* e = writer->end;
-	if(c == e)
+	if(event->mask & IN_Q_OVERFLOW)
+	{
+		watcher->overflowed = 1;
+		return;
+	}
+
+	WatchedDirectory* directory = NULL;
+	for(size_t ii = 0; ii < watcher->directoryCount; ii++)
 	{
-		char* b = writer->begin;
+		if(watcher->directories[ii].descriptor == event->wd)
+		{
+			directory = &watcher->directories[ii];
+			break;
+		}
+	}
+	if(!directory)
+		return;
 
-        size_t oldOffset = c - b;
-		size_t oldSize = e - b;
-		size_t newSize = oldSize ? oldSize * 2 : 1024; 
+	/* The directory itself is gone */
+	if(event->mask & IN_IGNORED)
+	{
+		free(directory->key);
+		*directory = watcher->directories[--watcher->directoryCount];
+		return;
+	}
 
-		char* n = (char*) realloc(b, newSize);
+	/* A new file will also be reported once it has been written */
+	int isDirectory = (event->mask & IN_ISDIR) != 0;
+	if(!event->len || ((event->mask & IN_CREATE) && !isDirectory))
+		return;
 
-        c = n + oldOffset;
-        e = n + newSize;
-        
-        writer->begin = n;
-		writer->end = e;
+	char* key = joinPath(directory->key, event->name);
+	int isKnown = 0;
+	for(size_t ii = 0; ii < gWatchedFileCount; ii++)
+	{
+		WatchedFile* file = &gWatchedFiles[ii];
+		if(strcmp(file->key, key) == 0)
+		{
+			/* Ignore our own changes to the file */
+			FileStamp stamp;
+			int hasStamp = readFileStamp(file->path, &stamp);
+			if(hasStamp != file->hasStamp || (hasStamp && !isSameFileStamp(&stamp, &file->stamp)))
+				file->affected = 1;
+			isKnown = 1;
+		}
+		for(size_t jj = 0; jj < file->dependencyCount && !file->affected; jj++)
+		{
+			if(strcmp(file->dependencyKeys[jj], key) == 0)
+				file->affected = 1;
+		}
 	}
 
-	*c++ = val;
-	writer->cursor = c;
-}
-
-static void writeRaw(
-	SkubWriter*	writer,
-	char const* begin,
-	char const* end)
-{
-	char const* cc = begin;
-	while(cc != end)
+	if(!isKnown && !(event->mask & (IN_DELETE | IN_MOVED_FROM)))
 	{
-		char c = *cc++;
-		switch(c)
+		for(size_t ii = 0; ii < watcher->rootCount; ii++)
 		{
-		case '\r': case '\n':
-			if(cc != end)
+			WatchRoot* root = &watcher->roots[ii];
+			size_t rootSize = strlen(root->key);
+			if(strncmp(key, root->key, rootSize) != 0 || key[rootSize] != '/')
+				continue;
+
+			char const* relativePath = key + rootSize + 1;
+			if(isWalkedPath(relativePath, isDirectory))
 			{
-				char d = *cc;
-				if((c ^ d) == ('\n' ^ '\r'))
-					cc++;
+				if(isDirectory)
+					watchTree(watcher, root, relativePath, 1);
+				else
+					addFoundFile(watcher, root, relativePath);
 			}
-			writeRawByte(writer, '\n');
-			break;
-
-		default:
-			writeRawByte(writer, c);
 			break;
 		}
 	}
+	free(key);
 }
 
-static void writeRawT(
-	SkubWriter*	writer,
-	char const* begin)
-{
-	writeRaw(writer, begin, begin + strlen(begin));
-}
+/*
 
-static void emitRaw(
-	SkubWriter*	writer,
-	char const* begin,
-	char const* end)
-{
-	if(begin == end)
-		return;
+`waitForChanges()` blocks until there are events, and
+then handles events until things settle down.
 
-	if(begin == end)
-		return;
+*/
+static void waitForChanges(
+	Watcher*	watcher)
+{
+	union
+	{
+		struct inotify_event	event;
+		char					bytes[kWatchEventBufferSize];
+	} buffer;
 
-	switch(*begin)
+	int timeout = -1;
+	for(;;)
 	{
-	default:
-		break;
+		struct pollfd poller;
+		poller.fd = watcher->fd;
+		poller.events = POLLIN;
+		poller.revents = 0;
+		int ready = poll(&poller, 1, timeout);
+		if(ready == 0)
+			return;
+
+		ssize_t size = ready < 0 ? -1 : read(watcher->fd, buffer.bytes, sizeof(buffer.bytes));
+		if(size < 0)
+		{
+			if(errno == EINTR || errno == EAGAIN)
+				continue;
+			fprintf(stderr, "fiddle: cannot watch for changes: %s\n", strerror(errno));
+			exit(1);
+		}
 
-	case '\r': case '\n':
-		writeRawT(writer, " _RAW(\"\\n\");");
-		break;
+		char* cursor = buffer.bytes;
+		char* end = buffer.bytes + size;
+		while(cursor < end)
+		{
+			struct inotify_event* event = (struct inotify_event*) cursor;
+			handleWatchEvent(watcher, event);
+			cursor += sizeof(struct inotify_event) + event->len;
+		}
+		timeout = kWatchQuietPeriod;
 	}
-
-	writeRawT(writer, " _RAW([==[");
-	writeRaw(writer, begin, end);
-	writeRawT(writer, "]==]);");
 }
 
-static void emitRawX(
-	SkubWriter*	writer,
-	char const* begin,
-	char const* end)
+static int runWatchLoop(
+	char**	paths,
+	size_t	pathCount,
+	int		jobCount)
 {
-	if(begin == end)
-		return;
+	Watcher watcher;
+	memset(&watcher, 0, sizeof(Watcher));
+	watcher.fd = inotify_init1(IN_CLOEXEC);
+	watcher.roots = (WatchRoot*) calloc(pathCount + 1, sizeof(WatchRoot));
+	char** affectedPaths = NULL;
+	if(watcher.fd < 0 || !watcher.roots)
+	{
+		fprintf(stderr, "fiddle: cannot watch for changes: %s\n", strerror(errno));
+		return 1;
+	}
+
+	/*
 
-	writeRawT(writer, " _RAW([==[");
+	We keep watching input files given on the command
+	line even if they don't exist, or have no templates.
 
-	char const* cursor = begin;
-	while(cursor != end)
+	*/
+	for(size_t ii = 0; ii < pathCount; ii++)
 	{
-		char c = *cursor++;
-		switch(c)
+		if(isDirectoryPath(paths[ii]))
 		{
-		default:
+			char* key = realpath(paths[ii], NULL);
+			if(!key)
+				continue;
+			WatchRoot* root = &watcher.roots[watcher.rootCount++];
+			root->path = paths[ii];
+			root->key = key;
+			watchTree(&watcher, root, "", 0);
+		}
+		else
+		{
+			char* key = makeWatchKey(paths[ii]);
+			if(key && !findWatchedFile(key))
+				recordWatchedFile(paths[ii], NULL);
+			free(key);
+		}
+	}
+
+	for(;;)
+	{
+		watchRecordedFiles(&watcher);
+		waitForChanges(&watcher);
+
+		size_t affectedCount = 0;
+		free(affectedPaths);
+		affectedPaths = (char**) calloc(gWatchedFileCount + watcher.foundCount + pathCount + 1, sizeof(char*));
+		if(!affectedPaths)
+		{
+			fprintf(stderr, "fiddle: memory allocation failed\n");
+			exit(1);
+		}
+
+		if(watcher.overflowed)
+		{
+			for(size_t ii = 0; ii < pathCount; ii++)
+				affectedPaths[affectedCount++] = paths[ii];
+			for(size_t ii = 0; ii < watcher.rootCount; ii++)
+				watchTree(&watcher, &watcher.roots[ii], "", 0);
+			for(size_t ii = 0; ii < gWatchedFileCount; ii++)
+				gWatchedFiles[ii].affected = 0;
+			watcher.overflowed = 0;
+		}
+		else
+		{
+			/* A deleted file can't be processed, but we keep watching it */
+			for(size_t ii = 0; ii < gWatchedFileCount; ii++)
 			{
-				char buf[2] = { c, 0 };
-				writeRawT(writer, buf);
+				WatchedFile* file = &gWatchedFiles[ii];
+				FileStamp stamp;
+				if(file->affected && readFileStamp(file->path, &stamp))
+					affectedPaths[affectedCount++] = file->path;
+				file->affected = 0;
 			}
-			break;
+			for(size_t ii = 0; ii < watcher.foundCount; ii++)
+			{
+				FileStamp stamp;
+				if(readFileStamp(watcher.foundPaths[ii], &stamp))
+					affectedPaths[affectedCount++] = watcher.foundPaths[ii];
+			}
+		}
 
-		case '\r': case '\n':
-			if(cursor != end)
+		if(affectedCount)
+		{
+			processFiles(affectedPaths, affectedCount, jobCount);
+			if(gOutputCacheStoreCount)
 			{
-				char d = *cursor;
-				if((c ^ d) == ('\r' ^ '\n'))
-					cursor++;
+				trimOutputCache();
+				gOutputCacheStoreCount = 0;
 			}
-			writeRawT(writer, "]==]);_RAW(\"\\n\");_RAW([==[");
-			break;
 		}
 
+		for(size_t ii = 0; ii < watcher.foundCount; ii++)
+			free(watcher.foundPaths[ii]);
+		watcher.foundCount = 0;
 	}
-	writeRawT(writer, "]==]);");
 }
-
-// Emit text as comments
-static void emitRawComment(
-	SkubWriter*	writer,
-	char const* begin,
-	char const* end)
+#else
+static int runWatchLoop(
+	char**	paths,
+	size_t	pathCount,
+	int		jobCount)
 {
-	if(begin == end)
-		return;
-
-	writeRawT(writer, "--[==[");
-	writeRaw(writer, begin, end);
-	writeRawT(writer, "]==]");
+	fprintf(stderr, "fiddle: '--watch' is not supported on this platform\n");
+	return 1;
 }
+#endif
 
-static int isEmpty(StringSpan span)
+/*
+
+### Command Line
+
+`parseCommandLine()` applies the options in `argv` (which
+doesn't include the program name) to our globals, and
+moves the remaining arguments (the inputs) to the front
+of `argv`. It returns how many inputs there are, or -1
+if the options are invalid.
+
+A server parses a new command line for every request,
+so `resetOptions()` first puts everything back the way
+it was when we started.
+
+*/
+static void resetOptions()
 {
-	return span.begin == span.end;
+	gIncludePath = NULL;
+	gOutputPath = NULL;
+	gCacheDir = NULL;
+	gJobCount = 0;
+	gWriteDepfiles = 0;
+	gDepfilePath = NULL;
+	gPhonyDependencies = 0;
+	gIncludeGlobCount = 0;
+	gExcludeGlobCount = 0;
+	gFsync = 0;
+	gOutputCacheDir = NULL;
+	gOutputCacheLimit = (uint64_t) 1 << 30;
+	gOutputCacheStoreCount = 0;
+	gStampOutputs = 0;
+	gCheckOutputs = 0;
+	gTrackDependencies = 0;
+	gWatching = 0;
+	gPreludePath = NULL;
+	gSnapshotScript = NULL;
+	gTrackReads = 0;
+	gPrintStats = 0;
+	gStatsJsonPath = NULL;
+	gErrorCount = 0;
 }
 
-static void emitSpliceExpr(
-	SkubWriter*		writer,
-	TemplateNode*	node)
+static int parseCommandLine(
+	int		argc,
+	char**	argv)
 {
-	for(TemplateNode* nn = node; nn; nn = nn->next)
+	/* There can't be more globs than arguments */
+	free((void*) gIncludeGlobs);
+	free((void*) gExcludeGlobs);
+	gIncludeGlobs = (char const**) calloc(argc + 1, sizeof(char const*));
+	gExcludeGlobs = (char const**) calloc(argc + 1, sizeof(char const*));
+	if(!gIncludeGlobs || !gExcludeGlobs)
 	{
-		switch(nn->flavor)
+		fprintf(stderr, "fiddle: memory allocation failed\n");
+		exit(1);
+	}
+
+	char** argCursor = argv;
+	char** argEnd = argv + argc;
+	char** writeCursor = argv;
+	while(argCursor != argEnd)
+	{
+		char const* arg = *argCursor++;
+		if(arg[0] == '-')
 		{
-		case kTemplateNodeFlavor_Text:
-			writeRaw(
-				writer,
-				nn->text.begin,
-				nn->text.end);
-			break;
+			if(arg[1] == '-' && arg[2] == 0)
+			{
+				break;
+			}
+			else if(arg[1] == 'I')
+			{
+				char const* path = arg + 2;
+				if(*path == 0)
+				{
+					path = readArg(arg, &argCursor, argEnd);
+				}
 
-		case kTemplateNodeFlavor_TextAndNewline:
-			writeRaw(
-				writer,
-				nn->text.begin,
-				nn->text.end);
-			writeRawT(
-				writer,
-				"\n");
-			break;
+				gIncludePath = path;
+			}
+			else if(strcmp(arg, "-o") == 0)
+			{
+				gOutputPath = readArg(arg, &argCursor, argEnd);
+			}
+			else if(arg[1] == 'j')
+			{
+				char const* count = arg + 2;
+				if(*count == 0)
+				{
+					count = readArg(arg, &argCursor, argEnd);
+					if(!count)
+						return -1;
+				}
 
-		default:
-			assert(!"unimplemented");
-			break;
+				char* countEnd = NULL;
+				long value = strtol(count, &countEnd, 10);
+				if(countEnd == count || *countEnd != 0 || value < 0)
+				{
+					fprintf(stderr, "fiddle: invalid job count '%s'\n", count);
+					return -1;
+				}
+				gJobCount = value ? (int) value : getProcessorCount();
+			}
+			else if(strcmp(arg, "-MD") == 0)
+			{
+				gWriteDepfiles = 1;
+			}
+			else if(strcmp(arg, "-MF") == 0)
+			{
+				gWriteDepfiles = 1;
+				gDepfilePath = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "-MP") == 0)
+			{
+				gPhonyDependencies = 1;
+			}
+			else if(strcmp(arg, "--include") == 0)
+			{
+				gIncludeGlobs[gIncludeGlobCount++] = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--exclude") == 0)
+			{
+				gExcludeGlobs[gExcludeGlobCount++] = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--fsync") == 0)
+			{
+				gFsync = 1;
+			}
+			else if(strcmp(arg, "--cache-dir") == 0)
+			{
+				gCacheDir = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--stamp") == 0)
+			{
+				gStampOutputs = 1;
+			}
+			else if(strcmp(arg, "--check") == 0)
+			{
+				gCheckOutputs = 1;
+			}
+			else if(strcmp(arg, "--watch") == 0)
+			{
+				gWatching = 1;
+			}
+			else if(strcmp(arg, "--prelude") == 0)
+			{
+				gPreludePath = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--track-reads") == 0)
+			{
+				gTrackReads = 1;
+			}
+			else if(strcmp(arg, "--stats") == 0)
+			{
+				gPrintStats = 1;
+			}
+			else if(strcmp(arg, "--stats-json") == 0)
+			{
+				gStatsJsonPath = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--snapshot") == 0)
+			{
+				gSnapshotScript = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--output-cache") == 0)
+			{
+				gOutputCacheDir = readArg(arg, &argCursor, argEnd);
+			}
+			else if(strcmp(arg, "--output-cache-size") == 0)
+			{
+				char const* size = readArg(arg, &argCursor, argEnd);
+				if(size && !parseSize(size, &gOutputCacheLimit))
+				{
+					fprintf(stderr, "fiddle: invalid cache size '%s'\n", size);
+					return -1;
+				}
+			}
+			else
+			{
+				fprintf(stderr, "fiddle: unknown option '%s'\n", arg);
+				return -1;
+			}
+
+			/* `readArg()` clears the cursor if an argument was missing */
+			if(!argCursor)
+				return -1;
+		}
+		else
+		{
+			*writeCursor++ = (char*) arg;
 		}
 	}
+	while(argCursor != argEnd)
+	{
+		*writeCursor++ = *argCursor++;
+	}
+	return (int)(writeCursor - argv);
 }
 
-static void emitTemplate(
-	SkubWriter*	writer,
-	TemplateNode*	node)
+/*
+
+`runCommandLine()` does everything a Fiddle command line
+asks for, and returns the exit status.
+
+*/
+static int runCommandLine(
+	int		argc,
+	char**	argv)
 {
-	for(TemplateNode* nn = node; nn; nn = nn->next)
+	resetOptions();
+	int inputCount = parseCommandLine(argc, argv);
+	if(inputCount < 0)
+		return 1;
+
+	if(!gCacheDir)
 	{
-		switch(nn->flavor)
-		{
-		case kTemplateNodeFlavor_Text:
-			emitRaw(
-				writer,
-				nn->text.begin,
-				nn->text.end);
-			break;
+		char const* cacheDir = getenv("FIDDLE_CACHE_DIR");
+		if(cacheDir && *cacheDir)
+			gCacheDir = cacheDir;
+	}
+	if(gCacheDir && !makeDirectory(gCacheDir))
+	{
+		fprintf(stderr, "fiddle: cannot create cache directory '%s'\n", gCacheDir);
+		gCacheDir = NULL;
+	}
 
-		case kTemplateNodeFlavor_TextAndNewline:
-			emitRaw(
-				writer,
-				nn->text.begin,
-				nn->text.end);
-			writeRawT(
-				writer,
-				"_RAW(\"\\n\");\n");
-			break;
+	if(!gOutputCacheDir)
+	{
+		char const* cacheDir = getenv("FIDDLE_OUTPUT_CACHE");
+		if(cacheDir && *cacheDir)
+			gOutputCacheDir = cacheDir;
+	}
+	if(gOutputCacheDir && !makeDirectory(gOutputCacheDir))
+	{
+		fprintf(stderr, "fiddle: cannot create cache directory '%s'\n", gOutputCacheDir);
+		gOutputCacheDir = NULL;
+	}
 
-		case kTemplateNodeFlavor_Escape:
-			writeRaw(
-				writer,
-				nn->text.begin,
-				nn->text.end);
-			writeRawT(
-				writer,
-				"\n");
-			break;
+	if(gSnapshotScript)
+	{
+		if(!gOutputPath || inputCount != 0)
+		{
+			fprintf(stderr, "fiddle: '--snapshot' requires '-o' and no inputs\n");
+			return 1;
+		}
+		return writeSnapshot(gSnapshotScript, gOutputPath) ? 0 : 1;
+	}
 
-		case kTemplateNodeFlavor_EscapeExpr:
-			writeRawT(writer, "_SPLICE(");
-			emitSpliceExpr(writer, nn->firstChild);
-			writeRawT(writer, "); ");
-			break;
+	gTrackDependencies = gWriteDepfiles || gOutputCacheDir || gStampOutputs || gWatching || gTrackReads;
 
-		default:
-			assert(!"unimplemented");
-			break;
+	if(gDepfilePath && (inputCount != 1 || isDirectoryPath(argv[0])))
+	{
+		fprintf(stderr, "fiddle: '-MF' requires a single input file\n");
+		return 1;
+	}
+
+	if(gWatching)
+	{
+		if(gCheckOutputs || gServing)
+		{
+			fprintf(stderr, "fiddle: '--watch' can't be used with '--check' or a server\n");
+			return 1;
 		}
+		initMutex(&gWatchLock);
+		initMutex(&gIdleStateLock);
+		gKeepLuaStates = 1;
 	}
-}
 
-static void emitChunks(
-	SkubWriter* writer,
-	Chunk*		chunks)
-{
-	Chunk* chunk = chunks;
-	while(chunk)
+	if(gPreludePath)
 	{
-		emitRaw(writer, chunk->prefix.begin, chunk->code.begin);
-		emitRawX(writer, chunk->code.begin, chunk->prefix.end);
-
-		if(chunk->codeNode)
-		{		
-			emitTemplate(writer, chunk->codeNode);
+#ifdef _WIN32
+		fprintf(stderr, "fiddle: '--prelude' is not supported on this platform\n");
+		return 1;
+#endif
+		if(gWatching)
+		{
+			fprintf(stderr, "fiddle: '--prelude' can't be used with '--watch'\n");
+			return 1;
 		}
-
-		emitRawComment(writer, chunk->code.end, chunk->prefix.end);
-
-		emitRawComment(writer, chunk->outputSpan.begin, chunk->outputSpan.end);
-
-		chunk = chunk->next;
+		if(!runPrelude())
+			return 1;
 	}
-}
-
-static char const* luaReadCallback(
-	lua_State* L,
-	void* userData,
-	size_t*	size)
-{
-	StringSpan* spanPtr = (StringSpan*) userData;
-	StringSpan span = *spanPtr;
 
-	spanPtr->begin = NULL;
-	spanPtr->end = NULL;
+	/*
 
-	*size = span.end - span.begin;
-	return span.begin;
-}
+	Under a parallel make, we run as many files in
+	parallel as make gives us tokens for, unless the
+	user asked for a specific limit. Each worker sets up
+	its own Lua state (and loads its own modules), so we
+	don't start more of them than there are processors.
 
-static int luaRawCallback(lua_State* L)
-{
-//	fprintf(stderr, "rawCallback[[[\n");
-	SkubWriter* writer = (SkubWriter*) lua_touserdata(L, lua_upvalueindex(1));
+	*/
+	int jobCount = gJobCount ? gJobCount : 1;
+	int usesJobserver = !gServing && !gWatching && connectJobserver(&gJobserver);
+	if(usesJobserver && !gJobCount)
+		jobCount = getProcessorCount();
 
-	size_t len = 0;
-	char const* text = luaL_tolstring(L, 1, &len);
+	int errorCount = processFiles(argv, inputCount, jobCount);
+	if(usesJobserver)
+		disconnectJobserver(&gJobserver);
+	closePrelude();
 
-	writeRaw(writer, text, text + len);
+	if(gOutputCacheStoreCount)
+		trimOutputCache();
 
-//	fprintf(stderr, "%.*s]]]\n", (int)(len), text);
+	if(gWatching)
+		return runWatchLoop(argv, inputCount, jobCount);
 
-	return 0;
+	return (errorCount != 0 || gErrorCount != 0) ? 1 : 0;
 }
 
-static int luaSpliceCallback(lua_State* L)
-{
-//	fprintf(stderr, "spliceCallback[[[\n");
-	SkubWriter* writer = (SkubWriter*) lua_touserdata(L, lua_upvalueindex(1));
-
-	size_t len = 0;
-	char const* text = luaL_tolstring(L, 1, &len);
+/*
 
-	writeRaw(writer, text, text + len);
+### Server
+
+Starting Fiddle, opening the Lua libraries, and loading
+the modules that describe a big model can take longer
+than expanding the templates of a typical file, and a
+build may run Fiddle hundreds of times. So Fiddle can
+also run as a server, with `fiddle --server <socket>`,
+listening on a Unix domain socket. A Fiddle started with
+`--connect <socket>` (or with the `FIDDLE_SERVER`
+environment variable set) just forwards its command line
+to the server, and only does the work itself if it can't
+reach one.
+
+Between requests the server keeps its Lua states, with
+the modules they have loaded (see `acquireLuaState()`),
+and the compiled code for every file they have run.
+
+A request holds the client's working directory, the
+environment variables that Fiddle reads, and its command
+line, as a sequence of NUL-terminated strings. Along with
+it, the client passes its standard output and error, and
+the server writes diagnostics (and anything templates
+print) straight to them. The reply is the exit status.
+
+The server handles one request at a time (each of them
+using as many threads as it asks for with `-j`), and it
+doesn't take part in make's jobserver.
 
-//	fprintf(stderr, "%.*s]]]\n", (int)(len), text);
+*/
+static char const* const kForwardedVariables[] =
+{
+	"FIDDLE_CACHE_DIR",
+	"FIDDLE_OUTPUT_CACHE",
+};
+enum
+{
+	kForwardedVariableCount = sizeof(kForwardedVariables) / sizeof(kForwardedVariables[0]),
+	kServerMagic = 0x464C4431,	/* "FLD1" */
+	kMaxRequestSize = 16 * 1024 * 1024,
+};
 
-	return 0;
+#ifndef _WIN32
+static int makeSocketAddress(
+	char const*			path,
+	struct sockaddr_un*	address)
+{
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(address->sun_path))
+		return 0;
+	strcpy(address->sun_path, path);
+	return 1;
 }
 
-char const* gIncludePath;
-char const* gOutputPath;
-
-static void processFile(
-	lua_State* 	L,
-	char const* inputPath)
-{
-	char const* outputPath = 0;
-	/*
+/*
 
-	We read in the whole input file at once,
-	so that we can process it in memory.
-	If we fail to read the file, then we bail
-	out here and now.
+`runClient()` hands the command line to the server
+listening at `socketPath`, and returns its exit status,
+or -1 if there is no server to talk to.
 
-	*/
-	StringSpan span = readFile(inputPath);
-	if(!span.begin)
+*/
+static int runClient(
+	char const*	socketPath,
+	int			argc,
+	char**		argv)
+{
+	struct sockaddr_un address;
+	if(!makeSocketAddress(socketPath, &address))
+		return -1;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd < 0)
+		return -1;
+	if(connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
 	{
-		return;		
+		close(fd);
+		return -1;
 	}
-	/*
-
-	The input file will need tobe parsed
-	differently based on whether it is a
-	template file, or a source file with
-	embedded templates. This will also
-	determine how we derive a default
-	output path.
 
-	*/
-	Chunk* chunks = 0;
-	char const* templateSuffix = ".fiddle";
-	char const* literateSuffix = ".md";
-	if(stringEndsWith(inputPath, templateSuffix))
+	SkubWriter request = { 0 };
+	char* cwd = NULL;
+	for(size_t size = 256; !cwd; size *= 2)
 	{
-		// Need to trim the end of the path
-		outputPath = pickOutputPath(inputPath, templateSuffix);
-
-		chunks = parseTemplateFile(span.begin, span.end);
+		char* buffer = (char*) malloc(size);
+		if(!buffer)
+			break;
+		cwd = getcwd(buffer, size);
+		if(!cwd)
+		{
+			free(buffer);
+			if(errno != ERANGE)
+				break;
+		}
 	}
-	else if(stringEndsWith(inputPath, literateSuffix))
+	if(!cwd)
 	{
-		outputPath = pickOutputPath(inputPath, literateSuffix);
-		assert(!"literate mode not implemented");
+		close(fd);
+		return -1;
 	}
-	else
+	writeBytes(&request, cwd, cwd + strlen(cwd) + 1);
+	free(cwd);
+
+	for(int ii = 0; ii < kForwardedVariableCount; ii++)
 	{
-		/*
+		char const* value = getenv(kForwardedVariables[ii]);
+		writeRawT(&request, value ? "=" : "-");
+		if(value)
+			writeRawT(&request, value);
+		writeBytes(&request, "", "" + 1);
+	}
+	for(int ii = 0; ii < argc; ii++)
+		writeBytes(&request, argv[ii], argv[ii] + strlen(argv[ii]) + 1);
 
-		If the input is a source file, then by
-		default output will be written to the
-		same file.
+	/* The header carries our standard output and error */
+	uint32_t header[2];
+	header[0] = kServerMagic;
+	header[1] = (uint32_t)(request.cursor - request.begin);
 
-		*/
-		outputPath = inputPath;
-		/*
+	struct iovec vector;
+	vector.iov_base = header;
+	vector.iov_len = sizeof(header);
 
-		We need to parse the input text into
-		an AST representing the file and any
-		embedded templates.
+	union
+	{
+		char			buffer[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr	align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+	fflush(stdout);
+	fflush(stderr);
+
+	ssize_t sent;
+	do
+	{
+		sent = sendmsg(fd, &message, 0);
+	} while(sent < 0 && errno == EINTR);
 
-		*/
-		chunks = parseSourceFile(span.begin, span.end);
-	}
-	/*
+	int32_t status = -1;
+	int ok = sent == (ssize_t) sizeof(header)
+		&& sendAll(fd, request.begin, request.cursor - request.begin)
+		&& receiveAll(fd, &status, sizeof(status));
 
-	If we encountered any errors parsing the source
-	file, or if there were no embedded templates found
-	in a source file, then `chunks` will be null.
-	In that case there is nothing to be done with
-	this file, and we skip the output generation steps.
+	free(request.begin);
+	close(fd);
+	return ok ? (int) status : -1;
+}
 
-	*/
-	if(!chunks)
-		return;
-	/*
+/*
 
-	Regardless of the output path we would choose
-	by default, the user can override it with the `-o`
-	command line option, which sets `gOutputPath`
+`serveRequest()` runs one request, with our standard
+output and error (and working directory) switched to
+those of the client for the duration.
 
-	*/
-	if(gOutputPath)
+*/
+static void serveRequest(
+	int	client,
+	int	serverDirectory)
+{
+	uint32_t header[2];
+	struct iovec vector;
+	vector.iov_base = header;
+	vector.iov_len = sizeof(header);
+
+	union
 	{
-		outputPath = gOutputPath;
+		char			buffer[CMSG_SPACE(2 * sizeof(int))];
+		struct cmsghdr	align;
+	} control;
+	memset(&control, 0, sizeof(control));
+
+	struct msghdr message;
+	memset(&message, 0, sizeof(message));
+	message.msg_iov = &vector;
+	message.msg_iovlen = 1;
+	message.msg_control = control.buffer;
+	message.msg_controllen = sizeof(control.buffer);
+
+	ssize_t received;
+	do
+	{
+		received = recvmsg(client, &message, 0);
+	} while(received < 0 && errno == EINTR);
+
+	int fds[2] = { -1, -1 };
+	struct cmsghdr* cmsg = received > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+	if(cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+		&& cmsg->cmsg_len == CMSG_LEN(2 * sizeof(int)))
+	{
+		memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
 	}
-	/*
 
-	Once we've parsed the input into an AST, we will
-	generate Lua source code to perform the actual
-	code generation logic for this file.
+	char* request = NULL;
+	int ok = received == (ssize_t) sizeof(header)
+		&& fds[0] >= 0 && fds[1] >= 0
+		&& header[0] == kServerMagic
+		&& header[1] > 0 && header[1] <= kMaxRequestSize
+		&& (request = (char*) malloc(header[1])) != NULL
+		&& receiveAll(client, request, header[1])
+		&& request[header[1] - 1] == 0;
+
+	/* Split the request into strings */
+	char** strings = NULL;
+	int stringCount = 0;
+	if(ok)
+	{
+		for(uint32_t ii = 0; ii < header[1]; ii++)
+			stringCount += request[ii] == 0;
+		strings = (char**) calloc(stringCount + 1, sizeof(char*));
+		ok = strings != NULL && stringCount >= 1 + kForwardedVariableCount;
+	}
+	if(ok)
+	{
+		char* cursor = request;
+		for(int ii = 0; ii < stringCount; ii++)
+		{
+			strings[ii] = cursor;
+			cursor += strlen(cursor) + 1;
+		}
+	}
 
-	*/
-	SkubWriter writer = { 0, 0, 0 };
-	writeRawT(&writer,
-		"local _RAW, _SPLICE = ...; ");
-	writeRawT(&writer,
-		"fiddle_write = _RAW; ");
+	int32_t status = 1;
+	if(ok)
+	{
+		fflush(stdout);
+		fflush(stderr);
+		int savedOutput = dup(STDOUT_FILENO);
+		int savedError = dup(STDERR_FILENO);
+		dup2(fds[0], STDOUT_FILENO);
+		dup2(fds[1], STDERR_FILENO);
+
+		for(int ii = 0; ii < kForwardedVariableCount; ii++)
+		{
+			char const* value = strings[1 + ii];
+			if(value[0] == '=')
+				setenv(kForwardedVariables[ii], value + 1, 1);
+			else
+				unsetenv(kForwardedVariables[ii]);
+		}
 
-	emitChunks(&writer, chunks);
-	char const* empty = "";
-	writeRaw(&writer, empty, empty + 1);
+		if(chdir(strings[0]) != 0)
+		{
+			fprintf(stderr, "fiddle: cannot change to directory '%s'\n", strings[0]);
+		}
+		else
+		{
+			int argOffset = 1 + kForwardedVariableCount;
+			status = runCommandLine(stringCount - argOffset, strings + argOffset);
+		}
 
-	StringSpan processed;
-	processed.begin = writer.begin;
-	processed.end = writer.cursor - 1;
+		fflush(stdout);
+		fflush(stderr);
+		dup2(savedOutput, STDOUT_FILENO);
+		dup2(savedError, STDERR_FILENO);
+		close(savedOutput);
+		close(savedError);
+		if(fchdir(serverDirectory) != 0)
+			fprintf(stderr, "fiddle: cannot return to the server's directory\n");
 
-	{
-		FILE* dump = fopen("dump.lua", "w");	
-		fprintf(dump, "%.*s\n", (int)(processed.end - processed.begin), processed.begin);
-		fclose(dump);
-//		exit(0);
+		sendAll(client, &status, sizeof(status));
 	}
 
-	char* luaFileName = (char*)
-		malloc(strlen(inputPath) + 2);
-	luaFileName[0] = '@';
-	memcpy(luaFileName + 1, inputPath, strlen(inputPath) + 1);
+	if(fds[0] >= 0)
+		close(fds[0]);
+	if(fds[1] >= 0)
+		close(fds[1]);
+	free(strings);
+	free(request);
+}
 
-	StringSpan readerState = processed;
-	int err = lua_load(
-		L,
-		&luaReadCallback,
-		(void*) &readerState,
-		luaFileName,
-		0);
-	if(err != LUA_OK)
+static int runServer(
+	char const*	socketPath)
+{
+	struct sockaddr_un address;
+	if(!makeSocketAddress(socketPath, &address))
 	{
-		char const* message = lua_tostring(L, -1);
-		fprintf(stderr, "fiddle: %s\n", message);
-		exit(1);
+		fprintf(stderr, "fiddle: socket path '%s' is too long\n", socketPath);
+		return 1;
 	}
 
-	SkubWriter outputWriter = { 0, 0, 0 };
-
+	/* A client going away mid-request mustn't take the server with it */
+	signal(SIGPIPE, SIG_IGN);
 
-	lua_pushlightuserdata(L, &outputWriter);
-	lua_pushcclosure(L, &luaRawCallback, 1);
-
-	lua_pushlightuserdata(L, &outputWriter);
-	lua_pushcclosure(L, &luaSpliceCallback, 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
 
-	err = lua_pcall(L, 2, 0, 0);
-	if(err != LUA_OK)
+	/* Replace the socket of a server that is no longer running */
+	struct stat info;
+	if(fd >= 0 && stat(socketPath, &info) == 0 && S_ISSOCK(info.st_mode)
+		&& connect(fd, (struct sockaddr*) &address, sizeof(address)) != 0)
 	{
-		char const* message = lua_tostring(L, -1);
-		fprintf(stderr, "fiddle: %s\n", message);		
-		exit(1);
+		unlink(socketPath);
+	}
+	if(fd >= 0)
+	{
+		close(fd);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	}
-	writeRaw(&outputWriter, empty, empty + 1);
-
-	StringSpan outputText;
-	outputText.begin = outputWriter.begin;
-	outputText.end = outputWriter.cursor - 1;
 
-	FILE* output = fopen(outputPath, "w");
-	if(!output)
+	if(fd < 0
+		|| bind(fd, (struct sockaddr*) &address, sizeof(address)) != 0
+		|| listen(fd, 64) != 0)
 	{
-		fprintf(stderr,
-			"fiddle: cannot open '%s' for writing\n",
-			outputPath);
-		return;
+		fprintf(stderr, "fiddle: cannot listen on '%s': %s\n", socketPath, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return 1;
 	}
-	fprintf(output, "%.*s", (int) (outputText.end - outputText.begin), outputText.begin);
 
-	fclose(output);
+	int serverDirectory = open(".", O_RDONLY | O_DIRECTORY);
+	if(serverDirectory < 0)
+	{
+		fprintf(stderr, "fiddle: cannot open the current directory\n");
+		close(fd);
+		return 1;
+	}
 
-	// 
+	initMutex(&gIdleStateLock);
+	gServing = 1;
+	gKeepLuaStates = 1;
+	for(;;)
+	{
+		int client = accept(fd, NULL, NULL);
+		if(client < 0)
+		{
+			if(errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "fiddle: cannot accept connections: %s\n", strerror(errno));
+			break;
+		}
+		serveRequest(client, serverDirectory);
+		close(client);
+	}
 
+	close(serverDirectory);
+	close(fd);
+	return 1;
 }
-
-static void* allocatorForLua(
-	void* userData,
-	void* ptr,
-	size_t oldSize,
-	size_t newSize)
+#else
+static int runClient(
+	char const*	socketPath,
+	int			argc,
+	char**		argv)
 {
-	return realloc(ptr, newSize);
+	return -1;
 }
 
-char const* readArg(
-	char const* opt,
-	char*** ioArgCursor,
-	char** argEnd)
+static int runServer(
+	char const*	socketPath)
 {
-	if(*ioArgCursor == argEnd)
-	{
-		fprintf(stderr, "fiddle: expected argument for option '%s'\n", opt);
-		exit(1);					
-	}
-	else
-	{
-		return *(*ioArgCursor)++;
-	}
+	fprintf(stderr, "fiddle: '--server' is not supported on this platform\n");
+	return 1;
 }
+#endif
 
 int main(
 	int 	argc,
 	char**	argv)
 {
-	/* TODO: parse options */
-
-	char** argCursor = argv;
-	char** argEnd = argv + argc;
-
 	char const* appName = "fiddle";
-	if(argCursor != argEnd)
-		appName = *argCursor++;
-
-	char** writeCursor = argv;
-	while(argCursor != argEnd)
+	if(argc > 0)
 	{
-		char const* arg = *argCursor++;
-		if(arg[0] == '-')
-		{
-			if(arg[1] == '-' && arg[2] == 0)
-			{
-				break;
-			}
-			else if(arg[1] == 'I')
-			{
-				char const* path = arg + 2;
-				if(*path == 0)
-				{
-					path = readArg(arg, &argCursor, argEnd);
-				}
-
-				gIncludePath = path;
-			}
-			else if(strcmp(arg, "-o") == 0)
-			{
-				gOutputPath = readArg(arg, &argCursor, argEnd);
-			}
-			else
-			{
-				fprintf(stderr, "fiddle: unknown option '%s'\n", arg);
-				exit(1);
-			}
+		appName = argv[0];
+		argc--;
+		argv++;
+	}
 
-		}
-		else
+	if(argc > 0 && strcmp(argv[0], "--server") == 0)
+	{
+		if(argc != 2)
 		{
-			*writeCursor++ = (char*) arg;
+			fprintf(stderr, "fiddle: '--server' expects a socket path\n");
+			return 1;
 		}
+		return runServer(argv[1]);
 	}
-	while(argCursor != argEnd)
-	{
-		*writeCursor++ = *argCursor++;
-	}
-
-	argEnd = argv + (writeCursor - argv);
-	argCursor = argv;
-
 
-	lua_State* L = lua_newstate(&allocatorForLua, 0);
-	if(!L)
+	char const* socketPath = getenv("FIDDLE_SERVER");
+	if(argc > 0 && strcmp(argv[0], "--connect") == 0)
 	{
-		fprintf(stderr, "fiddle: failed to create Lua state\n");
-		return 1;
+		if(argc < 2)
+		{
+			fprintf(stderr, "fiddle: '--connect' expects a socket path\n");
+			return 1;
+		}
+		socketPath = argv[1];
+		argc -= 2;
+		argv += 2;
 	}
-
-	luaL_openlibs(L);
-
-	if(gIncludePath)
+	else
 	{
-		lua_getglobal(L, "package");
-		lua_pushstring(L, gIncludePath);
-		lua_pushstring(L, "/?.lua");
-		lua_concat(L, 2);
-		lua_setfield(L, -2, "path");		
+		/* A watch keeps its own Lua states warm, so it doesn't need a server */
+		for(int ii = 0; ii < argc && strcmp(argv[ii], "--") != 0; ii++)
+		{
+			if(strcmp(argv[ii], "--watch") == 0)
+				socketPath = NULL;
+		}
 	}
-
-
-
-	while(argCursor != argEnd)
+	if(socketPath && *socketPath)
 	{
-		char const* inputPath = *argCursor++;
-		processFile(L, inputPath);
+		int status = runClient(socketPath, argc, argv);
+		if(status >= 0)
+			return status;
 	}
 
-	exit(0);
-
-	lua_close(L);
-
-	if(gErrorCount != 0)
-	{
-		exit(1);
-	}
-	return 0;
+	return runCommandLine(argc, argv);
 }
 
 /*
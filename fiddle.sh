@@ -67,9 +67,11 @@ pushd "$FIDDLEPATH" > /dev/null
 #
 # Our actual build command is as simple as we can
 # manage, in order to try to build cleanly on
-# as many platforms as possible.
+# as many platforms as possible. We only add
+# `libm`, since Lua's math library needs it, and
+# `libpthread` for the worker threads.
 #
-$CC fiddle.c -o fiddle
+$CC fiddle.c -o fiddle -lm -lpthread
 #
 # Whether or not the build succeeds, restore the
 # path to what it was.